@@ -1,105 +1,267 @@
-/*
- * Allocator.hpp: Allocate/deallocate contiguous region of memory using mmap
- * Expand/Shrink of an already allocated memory chunk using mremap
- * To keep the realloced memory valid, we always return the new virtual address
- * (c) Mohammad Hasanzadeh Mofrad, 2019
- * (e) m.hasanzadeh.mofrad@gmail.com
- */
-
-#ifndef ALLOCATOR_HPP
-#define ALLOCATOR_HPP
-
-#include <sys/mman.h>
- 
-#include <unistd.h>
-#include <cstring> 
-
-template<typename Data_Type>
-struct Data_Block {
-    public:
-        Data_Block() { ptr = nullptr; nitems = 0; nbytes = 0; }
-        Data_Block(Data_Type** ptr_, uint64_t nitems_, uint64_t nbytes_, bool page_aligned_ = false);
-        ~Data_Block();
-        void allocate();
-        void clear();
-        void reallocate(Data_Type** ptr_, uint64_t nitems_, uint64_t nbytes_);
-        void deallocate();
-        uint64_t nitems;
-        uint64_t nbytes;
-        Data_Type* ptr;
-        uint64_t PAGE_SIZE;
-        bool page_aligned;
-};
-
-template<typename Data_Type>
-Data_Block<Data_Type>::Data_Block(Data_Type** ptr_, uint64_t nitems_, uint64_t nbytes_, bool page_aligned_) {
-    nitems = nitems_; 
-    nbytes = nbytes_; 
-    ptr = nullptr; 
-    page_aligned = page_aligned_;
-    PAGE_SIZE = sysconf(_SC_PAGESIZE);
-    allocate();
-    *ptr_ = ptr;
-}
-
-template<typename Data_Type>
-Data_Block<Data_Type>::~Data_Block() {
-    deallocate();
-}
-
-template<typename Data_Type>
-void Data_Block<Data_Type>::allocate() {
-    if(nbytes) {
-        if(page_aligned) {
-            nbytes += (PAGE_SIZE - (nbytes % PAGE_SIZE));
-        }
-
-        if((ptr = (Data_Type*) mmap(nullptr, nbytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0)) == (void*) -1) {  
-            fprintf(stderr, "Error: Cannot map memory\n");
-            exit(1);
-        }
-        memset(ptr, 0,  nbytes); 
-    }
-}
-
-template<typename Data_Type>
-void Data_Block<Data_Type>::reallocate(Data_Type** ptr_, uint64_t nitems_, uint64_t nbytes_) {
-    if(nbytes) {
-        if(page_aligned) {
-            uint64_t new_nbytes = nbytes_;
-            new_nbytes += (PAGE_SIZE - (new_nbytes % PAGE_SIZE));
-            uint64_t old_nbytes = nbytes;
-
-            if(old_nbytes != new_nbytes) {
-                if((ptr = (Data_Type*) mremap(ptr, old_nbytes, new_nbytes, MREMAP_MAYMOVE)) == (void*) -1) { 
-                    fprintf(stderr, "Error: Cannot remap memory\n");
-                    exit(1);
-                }
-                if(new_nbytes > old_nbytes) {
-                    memset(ptr + nitems, 0, new_nbytes - old_nbytes); // If grow zeros the added memory
-                }
-            }
-
-            nitems = nitems_;
-            nbytes = new_nbytes;
-            *ptr_ = ptr;   
-        }
-    }
-}
-
-template<typename Data_Type>
-void Data_Block<Data_Type>::deallocate() {
-    if(ptr and nbytes) {
-        if((munmap(ptr, nbytes)) == -1) {
-            fprintf(stderr, "Error: Cannot unmap memory\n");
-            exit(1);
-        }
-        ptr = nullptr;
-    }
-}
-
-template<typename Data_Type>
-void Data_Block<Data_Type>::clear() {
-    memset(ptr, 0,  nbytes); 
-}
+/*
+ * Allocator.hpp: Allocate/deallocate contiguous region of memory using mmap
+ * Expand/Shrink of an already allocated memory chunk using mremap
+ * To keep the realloced memory valid, we always return the new virtual address
+ * Blocks can also be mapped from a file (private copy-on-write mapping) 
+ * With a NUMA placement, new pages are left to the first thread that touches them
+ * Large blocks can be backed by 2 MiB huge pages, from the MAP_HUGETLB pool if it has 
+ * pages left, otherwise by transparent huge pages through madvise
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef ALLOCATOR_HPP
+#define ALLOCATOR_HPP
+
+#include <sys/mman.h>
+ 
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring> 
+#include <atomic>
+
+#include "Numa.hpp"
+#include "Profile.hpp"
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+/* Huge pages for blocks of at least HUGE_PAGE_SIZE bytes, and the huge pages obtained */
+class Huge_Pages {
+    public:
+        static bool enabled;
+        static std::atomic<uint64_t> hugetlb_bytes;  // Mapped with MAP_HUGETLB now
+        static std::atomic<uint64_t> hugetlb_total;  // Mapped with MAP_HUGETLB over the run
+        static std::atomic<uint64_t> advised_bytes;  // Advised with MADV_HUGEPAGE now
+        static uint64_t transparent_bytes();
+};
+bool Huge_Pages::enabled = false;
+std::atomic<uint64_t> Huge_Pages::hugetlb_bytes(0);
+std::atomic<uint64_t> Huge_Pages::hugetlb_total(0);
+std::atomic<uint64_t> Huge_Pages::advised_bytes(0);
+
+/* Anonymous memory backed by transparent huge pages now (AnonHugePages of the process) */
+uint64_t Huge_Pages::transparent_bytes() {
+    uint64_t kbytes = 0;
+    FILE *fd = fopen("/proc/self/smaps_rollup", "r");
+    if(fd) {
+        char line[256];
+        while(fgets(line, sizeof(line), fd)) {
+            if(sscanf(line, "AnonHugePages: %lu kB", &kbytes) == 1) {
+                break;
+            }
+        }
+        fclose(fd);
+    }
+    return(kbytes * 1024);
+}
+
+template<typename Data_Type>
+struct Data_Block {
+    public:
+        Data_Block() { ptr = nullptr; nitems = 0; nbytes = 0; mapped = false; huge = false; advised = 0; }
+        Data_Block(Data_Type** ptr_, uint64_t nitems_, uint64_t nbytes_, bool page_aligned_ = false);
+        Data_Block(Data_Type** ptr_, uint64_t nitems_, uint64_t nbytes_, int fd, off_t offset);
+        ~Data_Block();
+        void allocate();
+        Data_Type* map_anonymous(uint64_t &nbytes_, bool &huge_);
+        void advise();
+        void map(int fd, off_t offset);
+        void clear();
+        void place(int node = -1);
+        void count_pages(std::vector<uint64_t> &node_pages);
+        void reallocate(Data_Type** ptr_, uint64_t nitems_, uint64_t nbytes_);
+        void deallocate();
+        uint64_t nitems;
+        uint64_t nbytes;
+        Data_Type* ptr;
+        uint64_t PAGE_SIZE;
+        bool page_aligned;
+        bool mapped; // File backed
+        bool huge;   // MAP_HUGETLB pages
+        uint64_t advised; // Bytes advised with MADV_HUGEPAGE
+};
+
+template<typename Data_Type>
+Data_Block<Data_Type>::Data_Block(Data_Type** ptr_, uint64_t nitems_, uint64_t nbytes_, bool page_aligned_) {
+    nitems = nitems_; 
+    nbytes = nbytes_; 
+    ptr = nullptr; 
+    page_aligned = page_aligned_;
+    mapped = false;
+    huge = false;
+    advised = 0;
+    PAGE_SIZE = sysconf(_SC_PAGESIZE);
+    allocate();
+    *ptr_ = ptr;
+}
+
+template<typename Data_Type>
+Data_Block<Data_Type>::Data_Block(Data_Type** ptr_, uint64_t nitems_, uint64_t nbytes_, int fd, off_t offset) {
+    nitems = nitems_; 
+    nbytes = nbytes_; 
+    ptr = nullptr; 
+    page_aligned = true;
+    mapped = false;
+    huge = false;
+    advised = 0;
+    PAGE_SIZE = sysconf(_SC_PAGESIZE);
+    map(fd, offset);
+    *ptr_ = ptr;
+}
+
+template<typename Data_Type>
+Data_Block<Data_Type>::~Data_Block() {
+    deallocate();
+}
+
+template<typename Data_Type>
+void Data_Block<Data_Type>::allocate() {
+    if(nbytes) {
+        if(page_aligned) {
+            nbytes += (PAGE_SIZE - (nbytes % PAGE_SIZE));
+        }
+
+        ptr = map_anonymous(nbytes, huge);
+        advise();
+        PROFILE_ALLOCATED(nbytes);
+        if(Numa::placement == Numa::NONE) {
+            memset(ptr, 0,  nbytes); 
+            PROFILE_CLEARED(nbytes);
+        }
+    }
+}
+
+/* Map zeroed memory, from the huge page pool if huge pages are enabled and it has enough left */
+template<typename Data_Type>
+Data_Type* Data_Block<Data_Type>::map_anonymous(uint64_t &nbytes_, bool &huge_) {
+    Data_Type* ptr_ = (Data_Type*) -1;
+    huge_ = false;
+    if(Huge_Pages::enabled and (nbytes_ >= HUGE_PAGE_SIZE)) {
+        uint64_t huge_nbytes = ((nbytes_ + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+        if((ptr_ = (Data_Type*) mmap(nullptr, huge_nbytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0)) != (void*) -1) {
+            nbytes_ = huge_nbytes;
+            huge_ = true;
+            Huge_Pages::hugetlb_bytes += nbytes_;
+            Huge_Pages::hugetlb_total += nbytes_;
+        }
+    }
+    if(ptr_ == (void*) -1) {
+        uint64_t align = (Huge_Pages::enabled and (nbytes_ >= HUGE_PAGE_SIZE)) ? HUGE_PAGE_SIZE : 0; // Transparent huge pages only fill aligned ranges
+        char *p = nullptr;
+        if((p = (char*) mmap(nullptr, nbytes_ + align, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0)) == (void*) -1) {
+            fprintf(stderr, "Error: Cannot map memory\n");
+            exit(1);
+        }
+        if(align) {
+            uint64_t head = (HUGE_PAGE_SIZE - ((uintptr_t) p % HUGE_PAGE_SIZE)) % HUGE_PAGE_SIZE;
+            uint64_t end = ((nbytes_ + align + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+            uint64_t last = ((head + nbytes_ + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+            if((head and (munmap(p, head) == -1)) or ((end > last) and (munmap(p + last, end - last) == -1))) {
+                fprintf(stderr, "Error: Cannot unmap memory\n");
+                exit(1);
+            }
+            p += head;
+        }
+        ptr_ = (Data_Type*) p;
+    }
+    return(ptr_);
+}
+
+/* Ask for transparent huge pages if a large block did not get MAP_HUGETLB pages */
+template<typename Data_Type>
+void Data_Block<Data_Type>::advise() {
+    if(Huge_Pages::enabled and (not huge) and (not mapped) and (nbytes >= HUGE_PAGE_SIZE) and (advised != nbytes)) {
+        if(madvise(ptr, nbytes, MADV_HUGEPAGE) == 0) {
+            Huge_Pages::advised_bytes += nbytes;
+            Huge_Pages::advised_bytes -= advised;
+            advised = nbytes;
+        }
+    }
+}
+
+template<typename Data_Type>
+void Data_Block<Data_Type>::map(int fd, off_t offset) {
+    if(nbytes) {
+        if(offset % PAGE_SIZE) {
+            fprintf(stderr, "Error: Cannot map memory at unaligned offset %lu\n", offset);
+            exit(1);
+        }
+        if(nbytes % PAGE_SIZE) {
+            nbytes += (PAGE_SIZE - (nbytes % PAGE_SIZE));
+        }
+        
+        if((ptr = (Data_Type*) mmap(nullptr, nbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, offset)) == (void*) -1) {  
+            fprintf(stderr, "Error: Cannot map file\n");
+            exit(1);
+        }
+        mapped = true;
+    }
+}
+
+template<typename Data_Type>
+void Data_Block<Data_Type>::reallocate(Data_Type** ptr_, uint64_t nitems_, uint64_t nbytes_) {
+    if(nbytes) {
+        if(page_aligned) {
+            uint64_t new_nbytes = nbytes_;
+            new_nbytes += (PAGE_SIZE - (new_nbytes % PAGE_SIZE));
+            uint64_t old_nbytes = nbytes;
+
+            if(huge and (((new_nbytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE) == old_nbytes) {
+                new_nbytes = old_nbytes; // Still fits in the same huge pages
+            }
+            else if(mapped or huge) { // Pages past the end of file and huge pages are not remapped, so move to new memory
+                bool new_huge = false;
+                Data_Type* new_ptr = map_anonymous(new_nbytes, new_huge);
+                memcpy(new_ptr, ptr, (old_nbytes < new_nbytes) ? old_nbytes : new_nbytes);
+                deallocate();
+                ptr = new_ptr;
+                mapped = false;
+                huge = new_huge;
+            }
+            else if(old_nbytes != new_nbytes) { // Added pages are zero, and are placed when first touched
+                if((ptr = (Data_Type*) mremap(ptr, old_nbytes, new_nbytes, MREMAP_MAYMOVE)) == (void*) -1) { 
+                    fprintf(stderr, "Error: Cannot remap memory\n");
+                    exit(1);
+                }
+            }
+
+            PROFILE_ALLOCATED((new_nbytes > old_nbytes) ? new_nbytes - old_nbytes : 0);
+            nitems = nitems_;
+            nbytes = new_nbytes;
+            advise();
+            *ptr_ = ptr;   
+        }
+    }
+}
+
+template<typename Data_Type>
+void Data_Block<Data_Type>::deallocate() {
+    if(ptr and nbytes) {
+        if((munmap(ptr, nbytes)) == -1) {
+            fprintf(stderr, "Error: Cannot unmap memory\n");
+            exit(1);
+        }
+        Huge_Pages::hugetlb_bytes -= (huge) ? nbytes : 0;
+        Huge_Pages::advised_bytes -= advised;
+        advised = 0;
+        ptr = nullptr;
+    }
+}
+
+template<typename Data_Type>
+void Data_Block<Data_Type>::clear() {
+    memset(ptr, 0,  nbytes); 
+    PROFILE_CLEARED(nbytes);
+}
+
+/* Interleave the pages over the NUMA nodes (node < 0) or move them to a node */
+template<typename Data_Type>
+void Data_Block<Data_Type>::place(int node) {
+    Numa::place(ptr, nbytes, node);
+}
+
+template<typename Data_Type>
+void Data_Block<Data_Type>::count_pages(std::vector<uint64_t> &node_pages) {
+    Numa::count_pages(ptr, nbytes, node_pages);
+}
 #endif
\ No newline at end of file
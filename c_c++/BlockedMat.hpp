@@ -0,0 +1,289 @@
+/*
+ * BlockedMat.hpp: Column blocked sparse matrix
+ * Every block of columns keeps its own column pointers and its own growable
+ * (row, value) segment, so blocks are written independently of each other.
+ * A hybrid matrix also stores each block in the format its density makes cheapest:
+ * CSC, a bitmap of rows per column with packed values, or dense columns.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef BLOCKEDMAT_HPP
+#define BLOCKEDMAT_HPP
+
+#include <vector>
+#include <algorithm>
+#include "SparseMat.hpp"
+#include "Segment.hpp"
+
+/*
+ * Formats of a block. Column c of a block has its values at JA[c] to JA[c+1] of the segment.
+ * SPARSE_BLOCK: rows in the segment. BITMAP_BLOCK: rows are the set bits of the column bitmap.
+ * DENSE_BLOCK: all rows, JA[c] = c * nrows, zeros included.
+ */
+enum Formats {SPARSE_BLOCK, BITMAP_BLOCK, DENSE_BLOCK};
+
+/*
+ * A hybrid block goes dense if at least 1/HYBRID_DENSE_FRACTION of it is nonzero, and to a bitmap
+ * if at least 1/HYBRID_BITMAP_FRACTION is (a bit per row costs less than a 32 bit row index)
+ */
+#define HYBRID_DENSE_FRACTION 2
+#define HYBRID_BITMAP_FRACTION 32
+
+template<typename Weight>
+struct BlockedCSC {
+    public:
+        BlockedCSC() { nrows = 0; ncols = 0; nblocks = 0; block_size = 0; nwords = 0; hybrid = false; };
+        BlockedCSC(uint32_t nrows_, uint32_t ncols_, uint32_t block_size_, uint64_t nnzmax, bool hybrid_ = false);
+        ~BlockedCSC();
+        inline uint32_t block_first(uint32_t block) { return(block * block_size); };
+        inline uint32_t block_last(uint32_t block) { return(std::min(block_first(block) + block_size, ncols)); };
+        inline void set_rows(uint32_t nrows_) { nrows = nrows_; nwords = (nrows + 63) / 64; };
+        inline uint64_t count();
+        inline void reformat(uint32_t block);
+        inline void scatter(struct CSC<Weight> *A_CSC, uint32_t block);
+        inline void gather(struct CSC<Weight> *A_CSC, uint32_t block, uint64_t offset);
+        void scatter(struct CSC<Weight> *A_CSC);
+        void gather(struct CSC<Weight> *A_CSC);
+        uint32_t nrows;
+        uint32_t ncols;
+        uint32_t nblocks;
+        uint32_t block_size;
+        uint32_t nwords;   // Bitmap words per column
+        bool hybrid;       // Reformat blocks by density, otherwise all blocks are SPARSE_BLOCK
+        std::vector<std::vector<uint32_t>> JA;         // Local column pointers of every block
+        std::vector<struct Segment<Weight>*> segments; // Rows and values of every block
+        std::vector<std::vector<uint64_t>> bitmaps;    // Row bitmaps of the columns of BITMAP_BLOCK blocks
+        std::vector<int> formats;                      // Format of every block
+        std::vector<uint64_t> nnz;                     // Nonzeros of every block
+};
+
+template<typename Weight>
+BlockedCSC<Weight>::BlockedCSC(uint32_t nrows_, uint32_t ncols_, uint32_t block_size_, uint64_t nnzmax, bool hybrid_) {
+    set_rows(nrows_);
+    ncols = ncols_;
+    block_size = block_size_;
+    hybrid = hybrid_;
+    nblocks = (ncols + block_size - 1) / block_size;
+    JA.resize(nblocks);
+    segments.resize(nblocks);
+    bitmaps.resize(nblocks);
+    formats.resize(nblocks, SPARSE_BLOCK);
+    nnz.resize(nblocks);
+    for(uint32_t i = 0; i < nblocks; i++) {
+        JA[i].resize(block_size + 1);
+        segments[i] = new struct Segment<Weight>((nnzmax / nblocks) + 1);
+    }
+}
+
+template<typename Weight>
+BlockedCSC<Weight>::~BlockedCSC() {
+    for(uint32_t i = 0; i < nblocks; i++) {
+        delete segments[i];
+    }
+}
+
+/* Nonzeros of all blocks */
+template<typename Weight>
+inline uint64_t BlockedCSC<Weight>::count() {
+    uint64_t nnz_ = 0;
+    for(uint32_t i = 0; i < nblocks; i++) {
+        nnz_ += nnz[i];
+    }
+    return(nnz_);
+}
+
+/*
+ * Convert a SPARSE_BLOCK or DENSE_BLOCK block with nnz[block] nonzeros to the format of its
+ * density. A bitmap keeps the packed values of CSC, so only the rows change. CSC to dense
+ * spreads values from the back, where the dense position of a value is never below its
+ * packed position, and dense to CSC or bitmap packs values from the front.
+ */
+template<typename Weight>
+inline void BlockedCSC<Weight>::reformat(uint32_t block) {
+    uint32_t *JA_ = JA[block].data();
+    struct Segment<Weight> *segment = segments[block];
+    uint32_t ncols_ = block_last(block) - block_first(block);
+    uint64_t size = (uint64_t) ncols_ * nrows;
+    int format = SPARSE_BLOCK;
+    if(hybrid and size) {
+        if((nnz[block] * HYBRID_DENSE_FRACTION) >= size) {
+            format = DENSE_BLOCK;
+        }
+        else if((nnz[block] * HYBRID_BITMAP_FRACTION) >= size) {
+            format = BITMAP_BLOCK;
+        }
+    }
+    if(format == formats[block]) {
+        return;
+    }
+
+    if(format == BITMAP_BLOCK) {
+        bitmaps[block].assign((uint64_t) ncols_ * nwords, 0);
+    }
+    uint64_t *bitmap = bitmaps[block].data();
+    uint32_t *IA = segment->IA;
+    Weight   *A  = segment->A;
+    if(formats[block] == SPARSE_BLOCK) {
+        if(format == BITMAP_BLOCK) {
+            for(uint32_t c = 0; c < ncols_; c++) {
+                uint64_t *words = bitmap + (uint64_t) c * nwords;
+                for(uint32_t m = JA_[c]; m < JA_[c+1]; m++) {
+                    words[IA[m] >> 6] |= (1ULL << (IA[m] & 63));
+                }
+            }
+        }
+        else {
+            segment->reserve_values(size);
+            A = segment->A;
+            uint64_t d = size; // Positions from d up are done
+            for(uint32_t c = ncols_; c-- > 0;) {
+                for(uint32_t m = JA_[c+1]; m-- > JA_[c];) {
+                    uint64_t p = ((uint64_t) c * nrows) + IA[m];
+                    while(d > p + 1) {
+                        A[--d] = 0;
+                    }
+                    A[p] = A[m];
+                    d = p;
+                }
+            }
+            while(d > 0) {
+                A[--d] = 0;
+            }
+            for(uint32_t c = 0; c <= ncols_; c++) {
+                JA_[c] = c * nrows;
+            }
+            segment->nnz = size;
+        }
+    }
+    else {
+        if(format == SPARSE_BLOCK) { // Dense blocks only grow A
+            segment->reserve(nnz[block]);
+            IA = segment->IA;
+        }
+        uint64_t out = 0;
+        for(uint32_t c = 0; c < ncols_; c++) {
+            Weight *column = A + ((uint64_t) c * nrows);
+            uint64_t *words = bitmap + (uint64_t) c * nwords;
+            JA_[c] = out;
+            for(uint32_t i = 0; i < nrows; i++) {
+                Weight value = column[i];
+                if(value != 0) {
+                    if(format == BITMAP_BLOCK) {
+                        words[i >> 6] |= (1ULL << (i & 63));
+                    }
+                    else {
+                        IA[out] = i;
+                    }
+                    A[out] = value;
+                    out++;
+                }
+            }
+        }
+        JA_[ncols_] = out;
+        segment->nnz = out;
+    }
+    formats[block] = format;
+}
+
+/* Copy the columns of a block from A as SPARSE_BLOCK, then reformat it */
+template<typename Weight>
+inline void BlockedCSC<Weight>::scatter(struct CSC<Weight> *A_CSC, uint32_t block) {
+    uint32_t *A_JA = A_CSC->JA;
+    uint32_t first = block_first(block);
+    uint32_t last = block_last(block);
+    struct Segment<Weight> *segment = segments[block];
+    uint64_t nnz_ = A_JA[last] - A_JA[first];
+    segment->clear();
+    segment->reserve(nnz_);
+    memcpy(segment->IA, A_CSC->IA + A_JA[first], nnz_ * sizeof(uint32_t));
+    memcpy(segment->A, A_CSC->A + A_JA[first], nnz_ * sizeof(Weight));
+    segment->nnz = nnz_;
+    for(uint32_t j = first; j <= last; j++) {
+        JA[block][j - first] = A_JA[j] - A_JA[first];
+    }
+    formats[block] = SPARSE_BLOCK;
+    nnz[block] = nnz_;
+    reformat(block);
+}
+
+/* Copy the nonzeros of a block to A from offset on, and their column pointers */
+template<typename Weight>
+inline void BlockedCSC<Weight>::gather(struct CSC<Weight> *A_CSC, uint32_t block, uint64_t offset) {
+    uint32_t *A_JA = A_CSC->JA;
+    uint32_t *A_IA = A_CSC->IA + offset;
+    Weight   *A_A  = A_CSC->A + offset;
+    uint32_t first = block_first(block);
+    uint32_t last = block_last(block);
+    uint32_t *JA_ = JA[block].data();
+    struct Segment<Weight> *segment = segments[block];
+    uint64_t n = 0;
+    if(formats[block] == SPARSE_BLOCK) {
+        memcpy(A_IA, segment->IA, nnz[block] * sizeof(uint32_t));
+        memcpy(A_A, segment->A, nnz[block] * sizeof(Weight));
+    }
+    for(uint32_t j = first; j < last; j++) {
+        uint32_t c = j - first;
+        if(formats[block] == SPARSE_BLOCK) {
+            n = JA_[c+1];
+        }
+        else if(formats[block] == BITMAP_BLOCK) {
+            uint64_t *words = bitmaps[block].data() + (uint64_t) c * nwords;
+            for(uint32_t w = 0; w < nwords; w++) {
+                for(uint64_t word = words[w]; word; word &= (word - 1)) {
+                    A_IA[n] = (w << 6) + __builtin_ctzll(word);
+                    A_A[n] = segment->A[n];
+                    n++;
+                }
+            }
+        }
+        else {
+            Weight *column = segment->A + JA_[c];
+            for(uint32_t i = 0; i < nrows; i++) {
+                if(column[i] != 0) {
+                    A_IA[n] = i;
+                    A_A[n] = column[i];
+                    n++;
+                }
+            }
+        }
+        A_JA[j + 1] = offset + n;
+    }
+}
+
+/* Split A into blocks */
+template<typename Weight>
+void BlockedCSC<Weight>::scatter(struct CSC<Weight> *A_CSC) {
+    if((A_CSC->nrows != nrows) or (A_CSC->ncols != ncols)) {
+        fprintf(stderr, "Error: Cannot scatter A[%d %d] into blocks of [%d %d]\n", A_CSC->nrows, A_CSC->ncols, nrows, ncols);
+        exit(1);
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for(uint32_t i = 0; i < nblocks; i++) {
+        scatter(A_CSC, i);
+    }
+}
+
+/* Concatenate the blocks into A */
+template<typename Weight>
+void BlockedCSC<Weight>::gather(struct CSC<Weight> *A_CSC) {
+    if((A_CSC->nrows != nrows) or (A_CSC->ncols != ncols)) {
+        fprintf(stderr, "Error: Cannot gather blocks of [%d %d] into A[%d %d]\n", nrows, ncols, A_CSC->nrows, A_CSC->ncols);
+        exit(1);
+    }
+    std::vector<uint64_t> offsets(nblocks + 1);
+    for(uint32_t i = 0; i < nblocks; i++) {
+        offsets[i + 1] = offsets[i] + nnz[i];
+    }
+    uint64_t nnz_ = offsets[nblocks];
+    A_CSC->reserve(nnz_);
+    A_CSC->nnz = nnz_;
+    A_CSC->idx = nnz_;
+    A_CSC->JA[0] = 0;
+    #pragma omp parallel for schedule(dynamic)
+    for(uint32_t i = 0; i < nblocks; i++) {
+        gather(A_CSC, i, offsets[i]);
+    }
+}
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * Cache.hpp: Binary image of a CSC matrix
+ * A cache file is a header followed by JA, IA, and A arrays, 
+ * each stored at a page aligned offset so it can be mapped directly
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+ 
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <sys/stat.h>
+
+#include "Allocator.hpp"
+#include "SparseMat.hpp"
+#include "Fixed.hpp"
+
+struct Cache_Header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t weight_size;
+    uint32_t nrows;
+    uint32_t ncols;
+    uint64_t nnz;
+    uint64_t JA_offset;
+    uint64_t IA_offset;
+    uint64_t A_offset;
+};
+
+const char     CACHE_MAGIC[8] = {'S', 'P', 'D', 'N', 'N', 'C', 'S', 'C'};
+const uint32_t CACHE_VERSION  = 1;
+const uint64_t CACHE_ALIGN    = 1 << 12; // Multiple of page size
+
+inline uint64_t cache_align(uint64_t offset) {
+    return((offset % CACHE_ALIGN) ? (offset + (CACHE_ALIGN - (offset % CACHE_ALIGN))) : offset);
+}
+
+/* Caches are per weight type: .csc for double, .f32.csc for float, and .q10.csc for fixed point weights */
+template<typename Weight>
+inline std::string cache_ext() {
+    return((sizeof(Weight) == sizeof(double)) ? ".csc" : ".f32.csc");
+}
+
+template<>
+inline std::string cache_ext<Fixed>() {
+    return(".q10.csc");
+}
+
+/* A cache is used if it exists and is not older than its TSV file (if there is one) */
+inline bool cache_exists(std::string cacheFile, std::string tsvFile) {
+    struct stat cache_st;
+    struct stat tsv_st;
+    if(stat(cacheFile.c_str(), &cache_st) == -1) {
+        return(false);
+    }
+    if(stat(tsvFile.c_str(), &tsv_st) == -1) {
+        return(true);
+    }
+    return((cache_st.st_mtim.tv_sec > tsv_st.st_mtim.tv_sec) or 
+           ((cache_st.st_mtim.tv_sec == tsv_st.st_mtim.tv_sec) and (cache_st.st_mtim.tv_nsec >= tsv_st.st_mtim.tv_nsec)));
+}
+
+inline void cache_write_at(int fd, const void* buf, uint64_t nbytes, uint64_t offset, std::string &cacheFile) {
+    const char* p = (const char*) buf;
+    while(nbytes) {
+        ssize_t ret = pwrite(fd, p, nbytes, offset);
+        if(ret <= 0) {
+            fprintf(stderr, "Error: Writing %s\n", cacheFile.c_str());
+            exit(1);
+        }
+        p += ret;
+        nbytes -= ret;
+        offset += ret;
+    }
+}
+
+template<typename Weight>
+void write_cache(struct CSC<Weight> *csc, std::string cacheFile) {
+    struct Cache_Header header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.weight_size = sizeof(Weight);
+    header.nrows = csc->nrows;
+    header.ncols = csc->ncols;
+    header.nnz = csc->nnz;
+    header.JA_offset = cache_align(sizeof(header));
+    header.IA_offset = cache_align(header.JA_offset + ((csc->ncols + 1) * sizeof(uint32_t)));
+    header.A_offset  = cache_align(header.IA_offset + (csc->nnz * sizeof(uint32_t)));
+    uint64_t nbytes = header.A_offset + (csc->nnz * sizeof(Weight));
+    
+    std::string tmpFile = cacheFile + ".tmp";
+    int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        fprintf(stderr, "Error: Opening %s\n", tmpFile.c_str());
+        exit(1);
+    }
+    cache_write_at(fd, &header, sizeof(header), 0, tmpFile);
+    cache_write_at(fd, csc->JA, (csc->ncols + 1) * sizeof(uint32_t), header.JA_offset, tmpFile);
+    cache_write_at(fd, csc->IA, csc->nnz * sizeof(uint32_t), header.IA_offset, tmpFile);
+    cache_write_at(fd, csc->A, csc->nnz * sizeof(Weight), header.A_offset, tmpFile);
+    if(ftruncate(fd, nbytes) == -1) {
+        fprintf(stderr, "Error: Writing %s\n", tmpFile.c_str());
+        exit(1);
+    }
+    close(fd);
+    
+    if(rename(tmpFile.c_str(), cacheFile.c_str()) == -1) { // Never leave a partially written cache behind
+        fprintf(stderr, "Error: Renaming %s\n", tmpFile.c_str());
+        exit(1);
+    }
+}
+
+template<typename Weight>
+struct CSC<Weight>* read_cache(std::string cacheFile) {
+    int fd = open(cacheFile.c_str(), O_RDONLY);
+    if(fd == -1) {
+        fprintf(stderr, "Error: Opening %s\n", cacheFile.c_str());
+        exit(1);
+    }
+    
+    struct Cache_Header header;
+    if((pread(fd, &header, sizeof(header), 0) != sizeof(header)) or 
+       (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC))) or 
+       (header.version != CACHE_VERSION)) {
+        fprintf(stderr, "Error: Invalid cache file %s\n", cacheFile.c_str());
+        exit(1);
+    }
+    if(header.weight_size != sizeof(Weight)) {
+        fprintf(stderr, "Error: Cache file %s has %d-byte weights, expected %lu\n", cacheFile.c_str(), header.weight_size, sizeof(Weight));
+        exit(1);
+    }
+    /* Arrays must be in order and within the file, or a truncated file faults when it is read */
+    struct stat st;
+    uint64_t size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+    if((header.nnz > size) or (header.ncols >= size) or 
+       (header.JA_offset < sizeof(header)) or (header.JA_offset > size) or
+       (header.IA_offset < header.JA_offset + ((header.ncols + 1) * sizeof(uint32_t))) or (header.IA_offset > size) or
+       (header.A_offset < header.IA_offset + (header.nnz * sizeof(uint32_t))) or (header.A_offset > size) or
+       (size < header.A_offset + (header.nnz * sizeof(Weight)))) {
+        fprintf(stderr, "Error: Invalid cache file %s\n", cacheFile.c_str());
+        exit(1);
+    }
+    
+    struct CSC<Weight> *csc = new struct CSC<Weight>();
+    csc->nrows = header.nrows;
+    csc->ncols = header.ncols;
+    csc->nnz = header.nnz;
+    csc->nnzmax = header.nnz;
+    if(csc->nrows and csc->ncols and csc->nnz) {
+        csc->JA_blk = new Data_Block<uint32_t>(&csc->JA, (csc->ncols + 1), (csc->ncols + 1) * sizeof(uint32_t), fd, header.JA_offset);
+        csc->IA_blk = new Data_Block<uint32_t>(&csc->IA, csc->nnz, csc->nnz * sizeof(uint32_t), fd, header.IA_offset);
+        csc->A_blk  = new Data_Block<Weight>(&csc->A, csc->nnz, csc->nnz * sizeof(Weight), fd, header.A_offset);
+        csc->nbytes = csc->JA_blk->nbytes + csc->IA_blk->nbytes + csc->A_blk->nbytes;
+    }
+    close(fd); // Mappings outlive the descriptor
+    return(csc);
+}
+
+#endif
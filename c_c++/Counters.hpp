@@ -0,0 +1,254 @@
+/*
+ * Counters.hpp: Hardware performance counters around the phases of a layer (-c)
+ * Every thread opens its own counters with perf_event_open (user space cycles, instructions,
+ * LLC and dTLB load misses, branch misses, and page faults), using the raw system call so no
+ * library is needed. They are read at the end of every phase and barrier, and the differences are
+ * added to the thread's record of the layer. Counters the kernel or machine does not offer are left out.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef COUNTERS_HPP
+#define COUNTERS_HPP
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+/* Bytes moved from memory by an LLC miss */
+#define COUNTERS_LINE_BYTES 64
+
+/*
+ * Filler at the end of the per-thread records of Profile, Counters, and Trace. The records sit in a
+ * std::vector, which is not 64-byte aligned, so a full line of filler keeps the fields of neighbouring
+ * threads off each other's cache lines wherever the vector starts.
+ */
+#define THREAD_PADDING 64
+
+/* Phases of a layer, timed by the profile (Profile.hpp) and counted by the counters */
+class Phases {
+    public:
+        /*
+         * LOAD: waiting for a streamed layer. SYMBOLIC: SpMM_Sym, or the column costs of SpMM_Schedule.
+         * NUMERIC: accumulating and gathering columns. POPULATE: sizing C (postpopulate_t, or the
+         * prefix sum of blocks). REPOPULATE: copying the columns into C. COMPACT: dropping dead rows.
+         * WAIT: waiting at barriers.
+         */
+        enum Phase {LOAD, SYMBOLIC, NUMERIC, POPULATE, REPOPULATE, COMPACT, WAIT, NPHASES};
+        static const char *names[NPHASES];
+};
+const char *Phases::names[Phases::NPHASES] = {"load", "symbolic", "numeric", "populate", "repopulate", "compact", "wait"};
+
+class Counters {
+    public:
+        enum Event {CYCLES, INSTRUCTIONS, LLC_MISSES, DTLB_MISSES, BRANCH_MISSES, PAGE_FAULTS, NEVENTS};
+        struct Record {
+            uint32_t layer;
+            double start;
+            double time; // Up to the last phase read
+            uint64_t count[Phases::NPHASES][NEVENTS];
+        };
+        struct Thread {
+            std::vector<struct Record> records;
+            int fd[NEVENTS];
+            uint64_t last[NEVENTS];
+            char padding[THREAD_PADDING];
+        };
+        static bool enabled;
+        static bool available[NEVENTS];
+        static std::vector<struct Thread> threads;
+        static const char *names[NEVENTS];
+
+        static void init(uint32_t nlayers);
+        static int open(int event);
+        static inline void read(int tid, uint64_t *values);
+        static inline void layer(int tid, uint32_t layer);
+        static inline void phase(int tid, int phase);
+        static void report(uint64_t nimages, std::vector<uint64_t> &layerEdges);
+        static void close();
+};
+bool Counters::enabled = false;
+bool Counters::available[Counters::NEVENTS];
+std::vector<struct Counters::Thread> Counters::threads;
+const char *Counters::names[Counters::NEVENTS] = {"cycles", "instructions", "LLC misses", "dTLB misses", "branch misses", "page faults"};
+
+/* Counter of an event for the calling thread on any CPU, -1 if it cannot be opened */
+int Counters::open(int event) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    switch(event) {
+        case CYCLES:        attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case INSTRUCTIONS:  attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case BRANCH_MISSES: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        case PAGE_FAULTS:   attr.type = PERF_TYPE_SOFTWARE; attr.config = PERF_COUNT_SW_PAGE_FAULTS; break;
+        case LLC_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case DTLB_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+    }
+    return(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+/* Open the counters of every thread (threads must stay the same for the run), an event is kept if all threads have it */
+void Counters::init(uint32_t nlayers) {
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            threads.resize(omp_get_num_threads());
+        }
+        int tid = omp_get_thread_num();
+        auto &thread = threads[tid];
+        thread.records.clear();
+        thread.records.reserve(nlayers);
+        for(int e = 0; e < NEVENTS; e++) {
+            thread.fd[e] = open(e);
+        }
+    }
+    int navailable = 0;
+    for(int e = 0; e < NEVENTS; e++) {
+        available[e] = true;
+        for(auto &thread : threads) {
+            available[e] = available[e] and (thread.fd[e] != -1);
+        }
+        navailable += available[e];
+        if(not available[e]) {
+            printf("WARN: Counter %s is not available\n", names[e]);
+        }
+    }
+    if(not navailable) {
+        fprintf(stderr, "Error: Cannot open performance counters (see /proc/sys/kernel/perf_event_paranoid)\n");
+        exit(1);
+    }
+}
+
+inline void Counters::read(int tid, uint64_t *values) {
+    auto &thread = threads[tid];
+    for(int e = 0; e < NEVENTS; e++) {
+        values[e] = 0;
+        if(available[e] and (::read(thread.fd[e], &values[e], sizeof(uint64_t)) != sizeof(uint64_t))) {
+            values[e] = thread.last[e];
+        }
+    }
+}
+
+/* Open the record of a layer */
+inline void Counters::layer(int tid, uint32_t layer) {
+    if(not enabled) {
+        return;
+    }
+    auto &thread = threads[tid];
+    struct Record record;
+    memset(&record, 0, sizeof(record));
+    record.layer = layer;
+    record.start = omp_get_wtime();
+    thread.records.push_back(record);
+    uint64_t values[NEVENTS]; // read falls back to last, so never read into it
+    read(tid, values);
+    memcpy(thread.last, values, sizeof(values));
+}
+
+/* Counts since the last read go to phase */
+inline void Counters::phase(int tid, int phase) {
+    if((not enabled) or threads[tid].records.empty()) {
+        return;
+    }
+    auto &thread = threads[tid];
+    auto &record = thread.records.back();
+    uint64_t values[NEVENTS];
+    read(tid, values);
+    for(int e = 0; e < NEVENTS; e++) {
+        record.count[phase][e] += values[e] - thread.last[e];
+        thread.last[e] = values[e];
+    }
+    record.time = omp_get_wtime() - record.start;
+}
+
+/*
+ * Print the counts of all threads per phase, and per layer the memory bandwidth (LLC misses of
+ * COUNTERS_LINE_BYTES over the layer time) and the edges (images x layer edges, as the run rate
+ * counts them) per cycle of all threads.
+ */
+void Counters::report(uint64_t nimages, std::vector<uint64_t> &layerEdges) {
+    auto count = [](int e, uint64_t value) { return((available[e]) ? std::to_string(value) : std::string("n/a")); };
+    auto rates = [&](uint64_t *total, double time, uint64_t edges) {
+        std::string gbs = (available[LLC_MISSES] and (time > 0)) ? std::to_string((double) total[LLC_MISSES] * COUNTERS_LINE_BYTES / time / 1e9) : "n/a";
+        std::string epc = (available[CYCLES] and total[CYCLES]) ? std::to_string((double) edges / total[CYCLES]) : "n/a";
+        std::string ipc = (available[CYCLES] and available[INSTRUCTIONS] and total[CYCLES]) ? std::to_string((double) total[INSTRUCTIONS] / total[CYCLES]) : "n/a";
+        return("GB/s " + gbs + ", edges/cycle " + epc + ", IPC " + ipc);
+    };
+    auto counts = [&](uint64_t *total) {
+        std::string line;
+        for(int e = 0; e < NEVENTS; e++) {
+            line += std::string((e) ? ", " : "") + names[e] + " " + count(e, total[e]);
+        }
+        return(line);
+    };
+
+    uint32_t nlayers = 0;
+    for(auto &thread : threads) {
+        nlayers = std::max(nlayers, (uint32_t) thread.records.size());
+    }
+    std::vector<std::vector<uint64_t>> layerCounts(nlayers, std::vector<uint64_t>(NEVENTS));
+    std::vector<double> layerTime(nlayers);
+    std::vector<std::vector<uint64_t>> phaseCounts(Phases::NPHASES, std::vector<uint64_t>(NEVENTS));
+    for(auto &thread : threads) {
+        for(uint32_t i = 0; i < thread.records.size(); i++) {
+            auto &record = thread.records[i];
+            layerTime[i] = std::max(layerTime[i], record.time);
+            for(int p = 0; p < Phases::NPHASES; p++) {
+                for(int e = 0; e < NEVENTS; e++) {
+                    layerCounts[i][e] += record.count[p][e];
+                    phaseCounts[p][e] += record.count[p][e];
+                }
+            }
+        }
+    }
+    std::vector<uint64_t> total(NEVENTS);
+    double time = 0;
+    uint64_t edges = 0;
+    for(uint32_t i = 0; i < nlayers; i++) {
+        for(int e = 0; e < NEVENTS; e++) {
+            total[e] += layerCounts[i][e];
+        }
+        time += layerTime[i];
+        edges += nimages * ((i < layerEdges.size()) ? layerEdges[i] : 0);
+    }
+    printf("INFO: Counters of %lu threads over %d layers: %s\n", threads.size(), nlayers, rates(total.data(), time, edges).c_str());
+    printf("INFO: Counters: %s\n", counts(total.data()).c_str());
+    for(int p = 0; p < Phases::NPHASES; p++) {
+        printf("INFO: Counters %-10s: %s\n", Phases::names[p], counts(phaseCounts[p].data()).c_str());
+    }
+    for(uint32_t i = 0; i < nlayers; i++) {
+        uint64_t edges = nimages * ((i < layerEdges.size()) ? layerEdges[i] : 0);
+        printf("INFO: Layer %d counters: %s, %s\n", i, rates(layerCounts[i].data(), layerTime[i], edges).c_str(), counts(layerCounts[i].data()).c_str());
+    }
+}
+
+void Counters::close() {
+    for(auto &thread : threads) {
+        for(int e = 0; e < NEVENTS; e++) {
+            if(thread.fd[e] != -1) {
+                ::close(thread.fd[e]);
+            }
+        }
+    }
+    threads.clear();
+    enabled = false;
+}
+
+#endif
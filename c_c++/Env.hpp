@@ -1,88 +1,178 @@
-/*
- * Env.cpp: Multithreading environment 
- * (c) Mohammad Hasanzadeh Mofrad, 2019
- * (e) m.hasanzadeh.mofrad@gmail.com
- */
- 
-#ifndef ENV_HPP
-#define ENV_HPP
-
-#include <omp.h>
-
-class Env {
-    public:
-        Env();
-        static int nthreads;
-        static std::vector<uint64_t> start_col;
-        static std::vector<uint64_t> end_col;
-        static std::vector<uint64_t> start_nnz;
-        static std::vector<uint64_t> end_nnz;
-        static std::vector<uint64_t> length_nnz;
-        static std::vector<uint64_t> offset_nnz;
-        static std::vector<uint64_t> indices_nnz;
-
-        static void init();
-        static int env_get_num_threads();
-        static void env_unset(int tid);
-        static uint64_t env_set();
-};
-int Env::nthreads = 0;
-std::vector<uint64_t> Env::start_col;
-std::vector<uint64_t> Env::end_col;
-std::vector<uint64_t> Env::start_nnz;
-std::vector<uint64_t> Env::end_nnz;
-std::vector<uint64_t> Env::length_nnz;
-std::vector<uint64_t> Env::offset_nnz;
-std::vector<uint64_t> Env::indices_nnz;
-
-void Env::init() {
-    nthreads = env_get_num_threads();
-    start_col.resize(nthreads);
-    end_col.resize(nthreads);
-    start_nnz.resize(nthreads);
-    end_nnz.resize(nthreads);
-    length_nnz.resize(nthreads);
-    offset_nnz.resize(nthreads);
-    indices_nnz.resize(nthreads);
-}
-
-int Env::env_get_num_threads() {
-    int nthreads_ = 0;
-    #pragma omp parallel
-    {
-        nthreads_ = omp_get_num_threads();
-    }
-    return(nthreads_);
-}    
-
-void Env::env_unset(int tid) {    
-    start_col[tid] = 0;
-    end_col[tid] = 0;
-    start_nnz[tid] = 0;
-    end_nnz[tid] = 0;
-    offset_nnz[tid] = 0;
-    indices_nnz[tid] = 0;
-    length_nnz[tid] = 0;
-}
-
-uint64_t Env::env_set() {  
-    for(uint32_t i = 0; i < Env::nthreads; i++) {   
-        start_nnz[i] = 0;
-        end_nnz[i] = 0;
-        offset_nnz[i] = 0;
-        indices_nnz[i] = 0;
-    }
-    offset_nnz[0] = 0;
-    start_nnz[0] = 0;
-    end_nnz[0] = length_nnz[0];
-    uint64_t nnzmax = length_nnz[0];
-    for(uint32_t i = 1; i < Env::nthreads; i++) {
-        start_nnz[i] = end_nnz[i-1];
-        end_nnz[i] = start_nnz[i] + length_nnz[i];
-        offset_nnz[i] = start_nnz[i];
-        nnzmax += length_nnz[i];
-    }
-    return(nnzmax);
-}
-
+/*
+ * Env.cpp: Multithreading environment 
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+ 
+#ifndef ENV_HPP
+#define ENV_HPP
+
+#include <omp.h>
+#include <atomic>
+
+class Env {
+    public:
+        Env();
+        static int nthreads;
+        static std::vector<uint64_t> start_col;
+        static std::vector<uint64_t> end_col;
+        static std::vector<uint64_t> start_nnz;
+        static std::vector<uint64_t> end_nnz;
+        static std::vector<uint64_t> length_nnz;
+        static std::vector<uint64_t> offset_nnz;
+        static std::vector<uint64_t> indices_nnz;
+        
+        /* Column block scheduling */
+        enum Scheduling {STATIC, BALANCED, STEALING};
+        static int scheduling;
+        static uint32_t nblocks;
+        static uint32_t block_size;
+        static std::vector<uint64_t> block_work;
+        static std::vector<uint32_t> start_block;
+        static std::vector<uint32_t> end_block;
+        static std::atomic<uint64_t> *block_queue;
+        static std::vector<int> block_tid;
+        static std::vector<uint64_t> block_offset;
+        static std::vector<uint64_t> block_nnz;
+        static std::vector<uint64_t> block_out;
+        
+        /* Load imbalance */
+        static std::vector<double> busy_time;
+        static std::vector<uint64_t> stolen_blocks;
+        static std::vector<double> layer_imbalance;
+        
+        static void init();
+        static void init_blocks(uint32_t ncols);
+        static bool pop_block(int tid, uint32_t &block, bool back);
+        static void imbalance();
+        static int env_get_num_threads();
+        static void env_unset(int tid);
+        static uint64_t env_set();
+};
+int Env::nthreads = 0;
+std::vector<uint64_t> Env::start_col;
+std::vector<uint64_t> Env::end_col;
+std::vector<uint64_t> Env::start_nnz;
+std::vector<uint64_t> Env::end_nnz;
+std::vector<uint64_t> Env::length_nnz;
+std::vector<uint64_t> Env::offset_nnz;
+std::vector<uint64_t> Env::indices_nnz;
+int Env::scheduling = Env::STEALING;
+uint32_t Env::nblocks = 0;
+uint32_t Env::block_size = 0;
+std::vector<uint64_t> Env::block_work;
+std::vector<uint32_t> Env::start_block;
+std::vector<uint32_t> Env::end_block;
+std::atomic<uint64_t> *Env::block_queue = nullptr;
+std::vector<int> Env::block_tid;
+std::vector<uint64_t> Env::block_offset;
+std::vector<uint64_t> Env::block_nnz;
+std::vector<uint64_t> Env::block_out;
+std::vector<double> Env::busy_time;
+std::vector<uint64_t> Env::stolen_blocks;
+std::vector<double> Env::layer_imbalance;
+
+void Env::init() {
+    nthreads = env_get_num_threads();
+    start_col.resize(nthreads);
+    end_col.resize(nthreads);
+    start_nnz.resize(nthreads);
+    end_nnz.resize(nthreads);
+    length_nnz.resize(nthreads);
+    offset_nnz.resize(nthreads);
+    indices_nnz.resize(nthreads);
+    start_block.resize(nthreads);
+    end_block.resize(nthreads);
+    busy_time.resize(nthreads);
+    stolen_blocks.resize(nthreads);
+    delete[] block_queue;
+    block_queue = new std::atomic<uint64_t>[nthreads];
+    for(int i = 0; i < nthreads; i++) {
+        block_queue[i] = 0;
+    }
+}
+
+/* Split ncols columns into blocks, about 64 per thread, the unit of balancing and stealing */
+void Env::init_blocks(uint32_t ncols) {
+    uint32_t nblocks_ = nthreads * 64;
+    block_size = (ncols + nblocks_ - 1) / nblocks_;
+    block_size = (block_size) ? block_size : 1;
+    nblocks = (ncols + block_size - 1) / block_size;
+    block_work.resize(nblocks);
+    block_tid.resize(nblocks);
+    block_offset.resize(nblocks);
+    block_nnz.resize(nblocks);
+    block_out.resize(nblocks + 1);
+}
+
+/* 
+ * Each thread's blocks are a range [front, back) packed in one atomic word.
+ * The owner pops from the front and thieves pop from the back.
+ */
+bool Env::pop_block(int tid, uint32_t &block, bool back) {
+    uint64_t range = block_queue[tid].load(std::memory_order_relaxed);
+    while(true) {
+        uint32_t front = range >> 32;
+        uint32_t end = range & 0xFFFFFFFF;
+        if(front >= end) {
+            return(false);
+        }
+        uint64_t next = (back) ? (((uint64_t) front << 32) | (end - 1)) : (((uint64_t) (front + 1) << 32) | end);
+        if(block_queue[tid].compare_exchange_weak(range, next, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+            block = (back) ? end - 1 : front;
+            return(true);
+        }
+    }
+}
+
+/* Record max/mean thread busy time of the last layer */
+void Env::imbalance() {
+    double max = 0;
+    double sum = 0;
+    for(int i = 0; i < nthreads; i++) {
+        max = (busy_time[i] > max) ? busy_time[i] : max;
+        sum += busy_time[i];
+    }
+    layer_imbalance.push_back((sum > 0) ? (max * nthreads) / sum : 1);
+}
+
+int Env::env_get_num_threads() {
+    int nthreads_ = 0;
+    #pragma omp parallel
+    {
+        nthreads_ = omp_get_num_threads();
+    }
+    return(nthreads_);
+}    
+
+void Env::env_unset(int tid) {    
+    start_col[tid] = 0;
+    end_col[tid] = 0;
+    start_nnz[tid] = 0;
+    end_nnz[tid] = 0;
+    offset_nnz[tid] = 0;
+    indices_nnz[tid] = 0;
+    length_nnz[tid] = 0;
+}
+
+uint64_t Env::env_set() {  
+    for(uint32_t i = 0; i < Env::nthreads; i++) {   
+        start_nnz[i] = 0;
+        end_nnz[i] = 0;
+        offset_nnz[i] = 0;
+        indices_nnz[i] = 0;
+    }
+    offset_nnz[0] = 0;
+    start_nnz[0] = 0;
+    end_nnz[0] = length_nnz[0];
+    uint64_t nnzmax = length_nnz[0];
+    for(uint32_t i = 1; i < Env::nthreads; i++) {
+        start_nnz[i] = end_nnz[i-1];
+        end_nnz[i] = start_nnz[i] + length_nnz[i];
+        offset_nnz[i] = start_nnz[i];
+        nnzmax += length_nnz[i];
+    }
+    return(nnzmax);
+}
+
 #endif 
\ No newline at end of file
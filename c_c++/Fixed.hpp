@@ -0,0 +1,98 @@
+/*
+ * Fixed.hpp: Fixed point numbers
+ * Fixed holds weights and activations in a uint16_t (unsigned Q6.10, [0, 64)): activations are
+ * clamped to [0, 32], so Y takes a quarter of the bytes of a double. FixedSum holds column sums
+ * and biases in an int32_t (Q11.20, +-2048), which is what the SPA accumulates. A product of two
+ * Fixed is exact in Q11.20 and sums are integer adds, so a column sum has no rounding at all and
+ * is the same in any order or thread count; only narrowing the clamped sum back to Fixed rounds
+ * (to the nearest 2^-10). The biases (multiples of 0.05) are not dyadic, so results are
+ * deterministic and close to, but not the same as, the floating point paths.
+ * Accum<Weight> is the type a SPA of Weight adds in: Weight itself, FixedSum for Fixed.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef FIXED_HPP
+#define FIXED_HPP
+
+#include <stdint.h>
+#include <cmath>
+
+struct FixedSum;
+
+struct Fixed {
+    static const int32_t FRACTION_BITS = 10;
+    static const int32_t ONE = (1 << FRACTION_BITS);
+
+    Fixed() = default;
+    Fixed(int value) : q((uint16_t) (value * ONE)) {};
+    Fixed(double value) : q((uint16_t) std::lround(value * ONE)) {};
+    explicit inline Fixed(FixedSum sum);
+    static inline Fixed raw(uint16_t q_) { Fixed f; f.q = q_; return(f); };
+
+    explicit inline operator bool() const { return(q != 0); };
+    explicit inline operator double() const { return((double) q / ONE); };
+
+    inline Fixed operator+(Fixed other) const { return(raw(q + other.q)); };
+    inline Fixed& operator+=(Fixed other) { q += other.q; return(*this); };
+    inline FixedSum operator*(Fixed other) const;
+    inline bool operator==(Fixed other) const { return(q == other.q); };
+    inline bool operator!=(Fixed other) const { return(q != other.q); };
+    inline bool operator<(Fixed other) const { return(q < other.q); };
+    inline bool operator>(Fixed other) const { return(q > other.q); };
+    inline bool operator<=(Fixed other) const { return(q <= other.q); };
+    inline bool operator>=(Fixed other) const { return(q >= other.q); };
+
+    uint16_t q;
+};
+
+struct FixedSum {
+    static const int32_t FRACTION_BITS = 2 * Fixed::FRACTION_BITS;
+    static const int32_t ONE = (1 << FRACTION_BITS);
+
+    FixedSum() = default;
+    FixedSum(Fixed value) : q((int32_t) value.q << Fixed::FRACTION_BITS) {};
+    FixedSum(int value) : q(value * ONE) {};
+    FixedSum(double value) : q((int32_t) std::lround(value * ONE)) {};
+    static inline FixedSum raw(int32_t q_) { FixedSum s; s.q = q_; return(s); };
+
+    explicit inline operator bool() const { return(q != 0); };
+    explicit inline operator double() const { return((double) q / ONE); };
+
+    inline FixedSum operator+(FixedSum other) const { return(raw(q + other.q)); };
+    inline FixedSum operator-(FixedSum other) const { return(raw(q - other.q)); };
+    inline FixedSum operator-() const { return(raw(-q)); };
+    inline FixedSum operator*(FixedSum other) const { return(raw((int32_t) ((((int64_t) q * other.q) + (ONE / 2)) >> FRACTION_BITS))); };
+    inline FixedSum& operator+=(FixedSum other) { q += other.q; return(*this); };
+    inline bool operator==(FixedSum other) const { return(q == other.q); };
+    inline bool operator!=(FixedSum other) const { return(q != other.q); };
+    inline bool operator<(FixedSum other) const { return(q < other.q); };
+    inline bool operator>(FixedSum other) const { return(q > other.q); };
+    inline bool operator<=(FixedSum other) const { return(q <= other.q); };
+    inline bool operator>=(FixedSum other) const { return(q >= other.q); };
+
+    int32_t q;
+};
+
+/* Rounds to the nearest 2^-10, the sum must already be clamped to the range of Fixed */
+inline Fixed::Fixed(FixedSum sum) : q((uint16_t) ((sum.q + (ONE / 2)) >> FRACTION_BITS)) {}
+
+/* Exact, as long as the product stays under 2048 (activations up to 32 times weights under 64) */
+inline FixedSum Fixed::operator*(Fixed other) const {
+    return(FixedSum::raw((int32_t) ((uint32_t) q * other.q)));
+}
+
+template<typename Weight>
+struct Accumulator {
+    typedef Weight type;
+};
+
+template<>
+struct Accumulator<Fixed> {
+    typedef FixedSum type;
+};
+
+template<typename Weight>
+using Accum = typename Accumulator<Weight>::type;
+
+#endif
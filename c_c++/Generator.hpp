@@ -0,0 +1,88 @@
+/*
+ * Generator.hpp: Synthetic RadiX-Net layers and sparse images
+ * Layer l connects neuron j to the fanin neurons j + k * fanin^(l mod d) (mod Nneurons), k < fanin,
+ * with d the digits of Nneurons in base fanin, so every d layers mix all neurons as in the challenge
+ * networks. Images have density x Nneurons random pixels of value 1, as the binarized MNIST images.
+ * Both are built straight into CSC with 1-based rows and columns, like the challenge files.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef GENERATOR_HPP
+#define GENERATOR_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <algorithm>
+
+#include "Triple.hpp"
+#include "SparseMat.hpp"
+
+/* Weight of every connection of the challenge networks */
+#define GENERATOR_WEIGHT 0.0625
+
+/* Layer l of a RadiX-Net with Nneurons neurons and fanin connections into every neuron */
+template<typename Weight>
+struct CSC<Weight>* radixnet_layer(uint32_t Nneurons, uint32_t fanin, uint32_t layer, Weight value) {
+    if((not fanin) or (fanin > Nneurons)) {
+        fprintf(stderr, "Error: Fan-in %d is not in [1, %d]\n", fanin, Nneurons);
+        exit(1);
+    }
+    uint32_t ndigits = 0;
+    for(uint64_t radix = fanin; (fanin > 1) and (radix <= Nneurons); radix *= fanin) {
+        ndigits++;
+    }
+    ndigits = (ndigits) ? ndigits : 1;
+    uint64_t stride = 1;
+    for(uint32_t d = 0; d < (layer % ndigits); d++) {
+        stride *= fanin;
+    }
+
+    struct CSC<Weight> *W_CSC = new struct CSC<Weight>((Nneurons + 1), (Nneurons + 1), (uint64_t) Nneurons * fanin);
+    uint32_t *JA = W_CSC->JA;
+    uint32_t *IA = W_CSC->IA;
+    Weight   *A  = W_CSC->A;
+    uint64_t nnz = 0;
+    JA[0] = 0;
+    JA[1] = 0;
+    for(uint32_t j = 1; j <= Nneurons; j++) {
+        for(uint32_t k = 0; k < fanin; k++) {
+            IA[nnz + k] = 1 + ((j - 1 + (k * stride)) % Nneurons);
+            A[nnz + k] = value;
+        }
+        std::sort(IA + nnz, IA + nnz + fanin);
+        nnz += fanin;
+        JA[j+1] = nnz;
+    }
+    W_CSC->nnz = nnz;
+    W_CSC->idx = nnz;
+    return(W_CSC);
+}
+
+/* nimages images of Nneurons pixels, round(density x Nneurons) of them set, the same for the same seed */
+template<typename Weight>
+struct CSC<Weight>* sparse_images(uint32_t nimages, uint32_t Nneurons, double density, uint64_t seed) {
+    uint32_t npixels = std::lround(std::min(std::max(density, 0.0), 1.0) * Nneurons);
+    npixels = (npixels) ? npixels : 1;
+    std::mt19937_64 generator(seed);
+    std::vector<uint32_t> pixels(Nneurons);
+    std::vector<struct Triple<Weight>> triples;
+    triples.reserve((uint64_t) nimages * npixels);
+    for(uint32_t i = 1; i <= nimages; i++) {
+        for(uint32_t p = 0; p < Nneurons; p++) {
+            pixels[p] = p + 1;
+        }
+        for(uint32_t p = 0; p < npixels; p++) { // Partial Fisher-Yates shuffle
+            std::uniform_int_distribution<uint32_t> pick(p, Nneurons - 1);
+            std::swap(pixels[p], pixels[pick(generator)]);
+            struct Triple<Weight> triple = {i, pixels[p], 1};
+            triples.push_back(triple);
+        }
+    }
+    return(new struct CSC<Weight>((nimages + 1), (Nneurons + 1), triples.size(), triples));
+}
+
+#endif
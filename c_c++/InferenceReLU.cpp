@@ -1,84 +1,810 @@
-/*
- * InferenceReLU.cpp: Inference Rectified Linear Unit (ReLU) implementation
- * (c) Mohammad Hasanzadeh Mofrad, 2019
- * (e) m.hasanzadeh.mofrad@gmail.com
- */
- 
-#ifndef INFERENCERELU_CPP
-#define INFERENCERELU_CPP
-
-#include "SparseOps.cpp"
-#include "Env.hpp"
-
-template<typename Weight>
-void inferenceReLU(std::vector<struct CSC<Weight>*> &layersSpMat, std::vector<struct DenseVec<Weight>*> &biasesDenseVec, 
-                   struct CSC<Weight> *featuresSpMat, std::vector<struct DenseVec<Weight>*> &spa_VEC) {    
-    auto &W0 = layersSpMat;
-    uint32_t maxLayers = W0.size();
-    auto &B1 = biasesDenseVec;
-    auto *Y0 = featuresSpMat;
-    auto *Y_CSC = Y0;
-
-    uint32_t nrows = 0;
-    uint32_t ncols = 0;
-    uint64_t nnzmax = 0;    
-    struct CSC<Weight> *Z_CSC = new struct CSC<Weight>(nrows, ncols, nnzmax);
-    #pragma omp parallel
-    {
-        int nthreads = omp_get_num_threads();
-        int tid = omp_get_thread_num();
-        for(uint32_t r = 0; r < maxLayers; r++) {
-            auto *W_CSC = W0[r];
-            auto *B = B1[r];
-            auto &s = spa_VEC[tid];
-            SpMM_Sym<Weight>(Y_CSC, W_CSC, Z_CSC, s, tid);
-            SpMM<Weight>(Y_CSC, W_CSC, Z_CSC, s, B, tid);
-        }
-    } 
-    delete Z_CSC;        
-}
-
-template<typename Weight>
-void validate_prediction(struct CSC<Weight> *featuresSpMat, std::vector<uint32_t> trueCategories) {
-    auto *Y_CSC = featuresSpMat;
-    uint32_t *JA = Y_CSC->JA;
-    uint32_t *IA = Y_CSC->IA;
-    Weight   *A = Y_CSC->A;
-    uint32_t ncols = Y_CSC->ncols;
-    uint32_t nrows = Y_CSC->nrows;
-
-    std::vector<Weight> allCategories(nrows);
-    for(uint32_t j = 0; j < ncols; j++) {
-        for(uint32_t i = JA[j]; i < JA[j+1]; i++) {
-            allCategories[IA[i]] += A[i];
-        }
-    }
-    
-    std::vector<int32_t> predictedCategories;
-    for(uint32_t i = 0; i < nrows; i++) {
-        if(allCategories[i])
-            predictedCategories.push_back(i);
-    }
-
-    bool tf = true;
-    if(trueCategories.size() == predictedCategories.size()) {        
-        for(int32_t i = 0; i < trueCategories.size(); i++) {
-            if(predictedCategories[i] != trueCategories[i]) {
-                tf = false;
-                break;
-            }
-        }
-    } 
-    else {
-        tf = false;
-    }
-    
-    if(tf) {
-        printf("INFO: Challenge PASSED\n");
-    }
-    else {
-        printf("INFO: Challenge FAILED\n");
-    }
-}
-
-#endif
+/*
+ * InferenceReLU.cpp: Inference Rectified Linear Unit (ReLU) implementation
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+ 
+#ifndef INFERENCERELU_CPP
+#define INFERENCERELU_CPP
+
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "SparseOps.cpp"
+#include "BlockedMat.hpp"
+#include "LayerQueue.hpp"
+#include "SpscQueue.hpp"
+#include "Env.hpp"
+
+/* Look for dead rows every COMPACT_LAYERS layers, and drop them if at least 1/COMPACT_FRACTION of rows died */
+#define COMPACT_LAYERS 8
+#define COMPACT_FRACTION 8
+
+/* Pipelined inference: batches per lane, batches queued between two stages, and the end of a lane's batches */
+#define PIPELINE_BATCHES 16
+#define PIPELINE_DEPTH 4
+#define PIPELINE_END UINT32_MAX
+
+/* Tiled inference: L2 cache size if the system does not tell, the fewest rows of a tile, and the growth of rows in a group */
+#define TILE_CACHE_BYTES (1024 * 1024)
+#define TILE_MIN_ROWS 16
+#define TILE_GROWTH 2
+
+/*
+ * Dead image elimination: rows of Y that went to zero stay zero (the SPA never touches them),
+ * so they are dropped. Live rows keep their order, rowIds maps them back to image ids, and 
+ * the SPAs shrink to the live rows. Z needs no remap, the next SpMM rewrites it.
+ */
+template<typename Weight>
+inline void compact_rows(struct CSC<Weight> *Y_CSC, struct CSC<Weight> *Z_CSC, struct SpaVec<Weight> *s,
+                         std::vector<uint32_t> &rowIds, std::vector<uint32_t> &rowMap, uint32_t &nlive, int tid) {
+    uint32_t *JA = Y_CSC->JA;
+    uint32_t *IA = Y_CSC->IA;
+    uint32_t nrows = Y_CSC->nrows;
+    uint32_t ncols = Y_CSC->ncols;
+    
+    #pragma omp for
+    for(uint32_t i = 0; i < nrows; i++) {
+        rowMap[i] = 0;
+    }
+    #pragma omp for
+    for(uint32_t j = 0; j < ncols; j++) {
+        for(uint32_t k = JA[j]; k < JA[j+1]; k++) {
+            rowMap[IA[k]] = 1;
+        }
+    }
+    if(!tid) {
+        uint32_t n = 0;
+        for(uint32_t i = 0; i < nrows; i++) {
+            n += rowMap[i];
+        }
+        nlive = nrows;
+        if((n + (nrows / COMPACT_FRACTION)) <= nrows) {
+            nlive = 0;
+            for(uint32_t i = 0; i < nrows; i++) {
+                if(rowMap[i]) {
+                    rowMap[i] = nlive;
+                    rowIds[nlive] = rowIds[i];
+                    nlive++;
+                }
+            }
+        }
+    }
+    #pragma omp barrier
+    if(nlive == nrows) {
+        return;
+    }
+    #pragma omp for
+    for(uint32_t j = 0; j < ncols; j++) {
+        for(uint32_t k = JA[j]; k < JA[j+1]; k++) {
+            IA[k] = rowMap[IA[k]];
+        }
+    }
+    s->resize(nlive);
+    if(!tid) {
+        Y_CSC->nrows = nlive;
+        Z_CSC->nrows = nlive;
+    }
+    #pragma omp barrier
+}
+
+template<typename Weight>
+void inferenceReLU(std::vector<struct CSC<Weight>*> &layersSpMat, std::vector<struct DenseVec<Weight>*> &biasesDenseVec, 
+                   struct CSC<Weight> *featuresSpMat, std::vector<struct SpaVec<Weight>*> &spa_VEC, std::vector<uint32_t> &rowIds) {    
+    auto &W0 = layersSpMat;
+    uint32_t maxLayers = W0.size();
+    auto &B1 = biasesDenseVec;
+    auto *Y0 = featuresSpMat;
+    
+    uint32_t nrows = Y0->nrows;
+    uint32_t ncols = Y0->ncols;
+    uint64_t nnzmax = (Y0->nnz) ? Y0->nnz : 1;
+    struct CSC<Weight> *Z0 = new struct CSC<Weight>(nrows, ncols, nnzmax);
+    std::vector<struct Segment<Weight>*> segments(Env::nthreads);
+    Env::init_blocks(ncols);
+    std::vector<uint32_t> rowMap(nrows);
+    uint32_t nlive = nrows;
+    uint32_t nlayers = maxLayers;
+    #pragma omp parallel
+    {
+        int nthreads = omp_get_num_threads();
+        int tid = omp_get_thread_num();
+        auto *Y_CSC = Y0;
+        auto *Z_CSC = Z0;
+        segments[tid] = new struct Segment<Weight>((nnzmax / nthreads) + nrows);
+        for(uint32_t r = 0; r < maxLayers; r++) {
+            PROFILE_LAYER(tid, r, Y_CSC->nnz);
+            auto *W_CSC = W0[r]->local(tid);
+            auto *B = B1[r];
+            auto &s = spa_VEC[tid];
+            SpMM_Fused<Weight>(Y_CSC, W_CSC, Z_CSC, s, B, segments, tid);
+            std::swap(Y_CSC, Z_CSC);
+            if(not Y_CSC->nnz) {
+                if(!tid) {
+                    nlayers = r + 1;
+                    printf("INFO: All images died at layer %d, stopping early\n", nlayers);
+                }
+                break;
+            }
+            if((r % COMPACT_LAYERS) == (COMPACT_LAYERS - 1)) {
+                compact_rows<Weight>(Y_CSC, Z_CSC, s, rowIds, rowMap, nlive, tid);
+                PROFILE_PHASE(tid, COMPACT);
+            }
+        }
+        delete segments[tid];
+    } 
+    if(nlayers % 2) {
+        Y0->swap(Z0);
+    }
+    delete Z0;        
+    printf("INFO: Live rows: %d of %d\n", (Y0->nnz) ? Y0->nrows : 0, nrows);
+}
+
+/*
+ * Streaming inference: layers arrive through a bounded queue filled by a loader thread.
+ * The master thread pops layer r while the others wait at a barrier. Used layers are
+ * either released (peak memory is a window of layers) or kept in layersSpMat/biasesDenseVec.
+ */
+template<typename Weight>
+void inferenceReLU(struct LayerQueue<Weight> *layersQueue, uint32_t maxLayers, 
+                   std::vector<struct CSC<Weight>*> &layersSpMat, std::vector<struct DenseVec<Weight>*> &biasesDenseVec, 
+                   struct CSC<Weight> *featuresSpMat, std::vector<struct SpaVec<Weight>*> &spa_VEC, std::vector<uint32_t> &rowIds, bool release) {    
+    auto *Y0 = featuresSpMat;
+    
+    uint32_t nrows = Y0->nrows;
+    uint32_t ncols = Y0->ncols;
+    uint64_t nnzmax = (Y0->nnz) ? Y0->nnz : 1;
+    struct CSC<Weight> *Z0 = new struct CSC<Weight>(nrows, ncols, nnzmax);
+    std::vector<struct Segment<Weight>*> segments(Env::nthreads);
+    Env::init_blocks(ncols);
+    std::vector<uint32_t> rowMap(nrows);
+    uint32_t nlive = nrows;
+    uint32_t nlayers = maxLayers;
+    struct Layer<Weight> layer;
+    #pragma omp parallel
+    {
+        int nthreads = omp_get_num_threads();
+        int tid = omp_get_thread_num();
+        auto *Y_CSC = Y0;
+        auto *Z_CSC = Z0;
+        segments[tid] = new struct Segment<Weight>((nnzmax / nthreads) + nrows);
+        bool dead = false;
+        for(uint32_t r = 0; r < maxLayers; r++) {
+            PROFILE_LAYER(tid, r, Y_CSC->nnz);
+            if(!tid) {
+                layer = layersQueue->pop();
+            }
+            if(not dead) {
+                PROFILE_BARRIER(tid, LOAD);
+                auto *W_CSC = layer.W;
+                auto *B = layer.b;
+                auto &s = spa_VEC[tid];
+                SpMM_Fused<Weight>(Y_CSC, W_CSC, Z_CSC, s, B, segments, tid);
+                std::swap(Y_CSC, Z_CSC);
+                if(not Y_CSC->nnz) {
+                    dead = true;
+                    if(!tid) {
+                        nlayers = r + 1;
+                        printf("INFO: All images died at layer %d, stopping early\n", nlayers);
+                    }
+                }
+                else if((r % COMPACT_LAYERS) == (COMPACT_LAYERS - 1)) {
+                    compact_rows<Weight>(Y_CSC, Z_CSC, s, rowIds, rowMap, nlive, tid);
+                    PROFILE_PHASE(tid, COMPACT);
+                }
+            }
+            if(!tid) {
+                if(release) {
+                    delete layer.W;
+                    delete layer.b;
+                }
+                else {
+                    layersSpMat[layer.layer] = layer.W;
+                    biasesDenseVec[layer.layer] = layer.b;
+                }
+            }
+        }
+        delete segments[tid];
+    } 
+    if(nlayers % 2) {
+        Y0->swap(Z0);
+    }
+    delete Z0;        
+    printf("INFO: Live rows: %d of %d\n", (Y0->nnz) ? Y0->nrows : 0, nrows);
+}
+
+/*
+ * Hybrid inference: Y alternates between two hybrid blocked buffers (see BlockedCSC::reformat), so
+ * each column block is kept as CSC, as a bitmap with packed values, or as dense columns, whichever
+ * its density in this layer makes cheaper. Blocks are computed with SpMM_Block. Dead rows are 
+ * found and dropped on a CSC copy of Y (Y0), which is scattered back to the blocks if rows died.
+ */
+template<typename Weight>
+void inferenceReLU_hybrid(std::vector<struct CSC<Weight>*> &layersSpMat, std::vector<struct DenseVec<Weight>*> &biasesDenseVec, 
+                          struct CSC<Weight> *featuresSpMat, std::vector<struct SpaVec<Weight>*> &spa_VEC, std::vector<uint32_t> &rowIds) {    
+    auto &W0 = layersSpMat;
+    uint32_t maxLayers = W0.size();
+    auto &B1 = biasesDenseVec;
+    auto *Y0 = featuresSpMat;
+    
+    uint32_t nrows = Y0->nrows;
+    uint32_t ncols = Y0->ncols;
+    uint64_t nnzmax = (Y0->nnz) ? Y0->nnz : 1;
+    Env::init_blocks(ncols);
+    uint32_t nblocks = Env::nblocks;
+    uint32_t block_size = Env::block_size;
+    struct BlockedCSC<Weight> *Y[2];
+    Y[0] = new struct BlockedCSC<Weight>(nrows, ncols, block_size, nnzmax, true);
+    Y[1] = new struct BlockedCSC<Weight>(nrows, ncols, block_size, nnzmax, true);
+    Y[0]->scatter(Y0);
+    std::vector<uint64_t> offsets(nblocks + 1);
+    std::vector<uint64_t> blockFormats(3);
+    std::vector<uint32_t> rowMap(nrows);
+    uint32_t nlive = nrows;
+    uint32_t nlayers = maxLayers;
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        auto *Y_BCSC = Y[0];
+        auto *Z_BCSC = Y[1];
+        auto &s = spa_VEC[tid];
+        for(uint32_t r = 0; r < maxLayers; r++) {
+            #pragma omp for schedule(dynamic)
+            for(uint32_t b = 0; b < nblocks; b++) {
+                double t = Trace::now();
+                SpMM_Block<Weight>(Y_BCSC, W0[r]->local(tid), Z_BCSC, s, B1[r], b);
+                Trace::span(tid, Trace::BLOCK, t, r);
+            }
+            std::swap(Y_BCSC, Z_BCSC);
+            if(!tid) {
+                for(uint32_t b = 0; b < nblocks; b++) {
+                    blockFormats[Y_BCSC->formats[b]]++;
+                }
+            }
+            uint64_t nnz = Y_BCSC->count();
+            if(not nnz) {
+                if(!tid) {
+                    nlayers = r + 1;
+                    printf("INFO: All images died at layer %d, stopping early\n", nlayers);
+                }
+                break;
+            }
+            if(((r % COMPACT_LAYERS) == (COMPACT_LAYERS - 1)) or (r == maxLayers - 1)) {
+                double t = Trace::now();
+                if(!tid) {
+                    for(uint32_t b = 0; b < nblocks; b++) {
+                        offsets[b + 1] = offsets[b] + Y_BCSC->nnz[b];
+                    }
+                    Y0->reserve(nnz);
+                    Y0->nnz = nnz;
+                    Y0->idx = nnz;
+                    Y0->JA[0] = 0;
+                }
+                #pragma omp barrier
+                #pragma omp for schedule(dynamic)
+                for(uint32_t b = 0; b < nblocks; b++) {
+                    Y_BCSC->gather(Y0, b, offsets[b]);
+                }
+                if(r == maxLayers - 1) {
+                    break;
+                }
+                uint32_t nrows_ = Y0->nrows;
+                compact_rows<Weight>(Y0, Y0, s, rowIds, rowMap, nlive, tid);
+                if(nlive != nrows_) {
+                    if(!tid) {
+                        Y_BCSC->set_rows(nlive);
+                        Z_BCSC->set_rows(nlive);
+                    }
+                    #pragma omp barrier
+                    #pragma omp for schedule(dynamic)
+                    for(uint32_t b = 0; b < nblocks; b++) {
+                        Y_BCSC->scatter(Y0, b);
+                    }
+                }
+                Trace::span(tid, Phases::COMPACT, t, r);
+            }
+        }
+    }
+    if(nlayers < maxLayers) {
+        Y0->nnz = 0;
+        Y0->idx = 0;
+        memset(Y0->JA, 0, (ncols + 1) * sizeof(uint32_t));
+    }
+    delete Y[0];
+    delete Y[1];
+    uint64_t total = blockFormats[SPARSE_BLOCK] + blockFormats[BITMAP_BLOCK] + blockFormats[DENSE_BLOCK];
+    total = (total) ? total : 1;
+    printf("INFO: Hybrid blocks: sparse %.1f%%, bitmap %.1f%%, dense %.1f%%\n", 100.0 * blockFormats[SPARSE_BLOCK] / total, 
+            100.0 * blockFormats[BITMAP_BLOCK] / total, 100.0 * blockFormats[DENSE_BLOCK] / total);
+    printf("INFO: Live rows: %d of %d\n", (Y0->nnz) ? Y0->nrows : 0, nrows);
+}
+
+/*
+ * Dataflow inference: no barriers between layers. Y alternates between two blocked buffers,
+ * and layer r lives in buffer r % 2. Task (r, b) computes column block b of layer r. It may run 
+ * once every block of layer r-1 that the columns of W[r] in block b read is done, and once every
+ * reader of the layer r-2 block it overwrites is done. Each thread owns a range of blocks and 
+ * runs whichever of them is ready. Tasks only wait on tasks of lower layers, so the oldest 
+ * unfinished task can always run.
+ */
+template<typename Weight>
+void inferenceReLU_dataflow(std::vector<struct CSC<Weight>*> &layersSpMat, std::vector<struct DenseVec<Weight>*> &biasesDenseVec, 
+                            struct CSC<Weight> *featuresSpMat, std::vector<struct SpaVec<Weight>*> &spa_VEC, bool hybrid = false) {    
+    auto &W0 = layersSpMat;
+    uint32_t maxLayers = W0.size();
+    auto &B1 = biasesDenseVec;
+    auto *Y0 = featuresSpMat;
+    
+    uint32_t nrows = Y0->nrows;
+    uint32_t ncols = Y0->ncols;
+    uint64_t nnzmax = (Y0->nnz) ? Y0->nnz : 1;
+    Env::init_blocks(ncols);
+    uint32_t nblocks = Env::nblocks;
+    uint32_t block_size = Env::block_size;
+    struct BlockedCSC<Weight> *Y[2];
+    Y[0] = new struct BlockedCSC<Weight>(nrows, ncols, block_size, nnzmax, hybrid);
+    Y[1] = new struct BlockedCSC<Weight>(nrows, ncols, block_size, nnzmax, hybrid);
+    Y[0]->scatter(Y0);
+    
+    std::vector<uint32_t> nreaders((uint64_t) (maxLayers + 2) * nblocks); // Blocks of layer r reading block d of layer r-1
+    std::atomic<uint32_t> *done = new std::atomic<uint32_t>[nblocks];        // Last layer done by every block
+    std::atomic<uint32_t> *readers = new std::atomic<uint32_t>[2 * nblocks]; // Readers left of every block of both buffers
+    #pragma omp parallel
+    {
+        int nthreads = omp_get_num_threads();
+        int tid = omp_get_thread_num();
+        std::vector<uint64_t> marks(nblocks, 0);
+        uint64_t mark = 0;
+        /* Visit the distinct blocks of layer r-1 read by block b of layer r until f returns false */
+        auto dependencies = [&](uint32_t r, uint32_t b, auto f) -> bool {
+            mark++;
+            uint32_t *W_JA = W0[r-1]->JA;
+            uint32_t *W_IA = W0[r-1]->IA;
+            uint32_t first = b * block_size;
+            uint32_t last = std::min(first + block_size, ncols);
+            for(uint32_t k = W_JA[first]; k < W_JA[last]; k++) {
+                uint32_t d = W_IA[k] / block_size;
+                if(marks[d] != mark) {
+                    marks[d] = mark;
+                    if(not f(d)) {
+                        return(false);
+                    }
+                }
+            }
+            return(true);
+        };
+        
+        #pragma omp for schedule(dynamic)
+        for(uint32_t r = 1; r <= maxLayers; r++) {
+            for(uint32_t b = 0; b < nblocks; b++) {
+                dependencies(r, b, [&](uint32_t d) { nreaders[(uint64_t) r * nblocks + d]++; return(true); });
+            }
+        }
+        #pragma omp for
+        for(uint32_t b = 0; b < nblocks; b++) {
+            done[b] = 0;
+            readers[b] = nreaders[nblocks + b];
+            readers[nblocks + b] = 0;
+        }
+        
+        uint32_t start = ((uint64_t) nblocks * tid) / nthreads;
+        uint32_t end = ((uint64_t) nblocks * (tid + 1)) / nthreads;
+        std::vector<uint32_t> layers(end - start, 1);
+        uint32_t remaining = (maxLayers) ? end - start : 0;
+        auto &s = spa_VEC[tid];
+        double idle = 0; // Since no block of the thread was ready
+        while(remaining) {
+            bool progress = false;
+            for(uint32_t b = start; b < end; b++) {
+                uint32_t r = layers[b - start];
+                if((r > maxLayers) or readers[(r % 2) * nblocks + b].load(std::memory_order_acquire)) {
+                    continue;
+                }
+                if(not dependencies(r, b, [&](uint32_t d) { return(done[d].load(std::memory_order_acquire) >= r - 1); })) {
+                    continue;
+                }
+                if(idle) {
+                    Trace::span(tid, Phases::WAIT, idle);
+                    idle = 0;
+                }
+                double t = Trace::now();
+                SpMM_Block<Weight>(Y[(r - 1) % 2], W0[r-1]->local(tid), Y[r % 2], s, B1[r-1], b);
+                Trace::span(tid, Trace::BLOCK, t, r - 1);
+                dependencies(r, b, [&](uint32_t d) { readers[((r - 1) % 2) * nblocks + d].fetch_sub(1, std::memory_order_acq_rel); return(true); });
+                readers[(r % 2) * nblocks + b].store(nreaders[(uint64_t) (r + 1) * nblocks + b], std::memory_order_relaxed);
+                done[b].store(r, std::memory_order_release);
+                layers[b - start]++;
+                remaining -= (r == maxLayers);
+                progress = true;
+            }
+            if(not progress) {
+                idle = (idle) ? idle : Trace::now();
+                std::this_thread::yield();
+            }
+        }
+    }
+    Y[maxLayers % 2]->gather(Y0);
+    delete[] done;
+    delete[] readers;
+    delete Y[0];
+    delete Y[1];
+}
+
+/* Copy rows [start, end) of Y_CSC to the row block T_CSC, renumbered from 0 */
+template<typename Weight>
+inline void slice_rows(struct CSC<Weight> *Y_CSC, uint32_t start, uint32_t end, struct CSC<Weight> *T_CSC) {
+    uint32_t *JA = Y_CSC->JA;
+    uint32_t *IA = Y_CSC->IA;
+    Weight   *A  = Y_CSC->A;
+    uint32_t ncols = Y_CSC->ncols;
+    uint64_t nnz = 0;
+    for(uint32_t j = 0; j < ncols; j++) {
+        uint32_t *lo = std::lower_bound(IA + JA[j], IA + JA[j+1], start);
+        uint32_t *hi = std::lower_bound(lo, IA + JA[j+1], end);
+        nnz += hi - lo;
+    }
+    T_CSC->nrows = end - start;
+    T_CSC->reserve(nnz);
+    nnz = 0;
+    T_CSC->JA[0] = 0;
+    for(uint32_t j = 0; j < ncols; j++) {
+        uint32_t *lo = std::lower_bound(IA + JA[j], IA + JA[j+1], start);
+        uint32_t *hi = std::lower_bound(lo, IA + JA[j+1], end);
+        for(uint32_t *k = lo; k < hi; k++) {
+            T_CSC->IA[nnz] = *k - start;
+            T_CSC->A[nnz] = A[k - IA];
+            nnz++;
+        }
+        T_CSC->JA[j+1] = nnz;
+    }
+    T_CSC->nnz = nnz;
+    T_CSC->idx = nnz;
+}
+
+/*
+ * Stack the row blocks of tile_rows rows (the last may be shorter) back into Y_CSC, inside a parallel
+ * region. Row i of the stacked blocks becomes row rowMap[i] of Y_CSC, so dead rows can be dropped.
+ */
+template<typename Weight>
+inline void stack_rows(std::vector<struct CSC<Weight>*> &tiles, uint32_t tile_rows, std::vector<uint32_t> &rowMap, struct CSC<Weight> *Y_CSC) {
+    uint32_t ncols = Y_CSC->ncols;
+    uint32_t ntiles = tiles.size();
+    #pragma omp for
+    for(uint32_t j = 0; j < ncols; j++) {
+        uint32_t n = 0;
+        for(uint32_t t = 0; t < ntiles; t++) {
+            n += tiles[t]->JA[j+1] - tiles[t]->JA[j];
+        }
+        Y_CSC->JA[j+1] = n;
+    }
+    #pragma omp single
+    {
+        Y_CSC->JA[0] = 0;
+        for(uint32_t j = 0; j < ncols; j++) {
+            Y_CSC->JA[j+1] += Y_CSC->JA[j];
+        }
+        Y_CSC->reserve(Y_CSC->JA[ncols]);
+        Y_CSC->nnz = Y_CSC->JA[ncols];
+        Y_CSC->idx = Y_CSC->nnz;
+    }
+    #pragma omp for
+    for(uint32_t j = 0; j < ncols; j++) {
+        uint64_t k = Y_CSC->JA[j];
+        for(uint32_t t = 0; t < ntiles; t++) {
+            uint32_t *T_IA = tiles[t]->IA;
+            Weight   *T_A  = tiles[t]->A;
+            uint32_t start = t * tile_rows;
+            for(uint32_t m = tiles[t]->JA[j]; m < tiles[t]->JA[j+1]; m++) {
+                Y_CSC->IA[k] = rowMap[start + T_IA[m]];
+                Y_CSC->A[k] = T_A[m];
+                k++;
+            }
+        }
+    }
+}
+
+/*
+ * Pipelined inference: threads are split into nstages stages of k lanes, and stage s owns the
+ * layers [s*L/nstages, (s+1)*L/nstages). Y is cut into row blocks (batches of images), each with
+ * a Y and a Z buffer of its own. Lane i of stage 0 cuts batches i, i+k, ... out of Y, and every
+ * lane runs its layers on a batch with SpMM_Serial, then hands it to the same lane of the next
+ * stage through a lock-free SPSC queue. Rows of a batch are computed exactly as in the full Y,
+ * so once the last stage is done the batches are stacked back into Y with no row dropped.
+ * Stage utilization is the busy time of its threads over the wall time of the pipeline.
+ */
+template<typename Weight>
+void inferenceReLU_pipeline(std::vector<struct CSC<Weight>*> &layersSpMat, std::vector<struct DenseVec<Weight>*> &biasesDenseVec,
+                            struct CSC<Weight> *featuresSpMat, std::vector<struct SpaVec<Weight>*> &spa_VEC, uint32_t nstages) {
+    auto &W0 = layersSpMat;
+    uint32_t maxLayers = W0.size();
+    auto &B1 = biasesDenseVec;
+    auto *Y0 = featuresSpMat;
+
+    uint32_t nrows = Y0->nrows;
+    uint32_t ncols = Y0->ncols;
+    int nthreads = Env::nthreads;
+    if((nstages < 1) or (nstages > (uint32_t) nthreads)) {
+        fprintf(stderr, "Error: Cannot split %d threads into %d pipeline stages\n", nthreads, nstages);
+        exit(1);
+    }
+    uint32_t nlanes = nthreads / nstages;
+    uint32_t batch_rows = (nrows + (nlanes * PIPELINE_BATCHES) - 1) / (nlanes * PIPELINE_BATCHES);
+    batch_rows = (batch_rows) ? batch_rows : 1;
+    uint32_t nbatches = (nrows + batch_rows - 1) / batch_rows;
+    std::vector<struct CSC<Weight>*> Y(nbatches);
+    std::vector<struct CSC<Weight>*> Z(nbatches);
+    std::vector<struct SpscQueue<uint32_t>*> queues((nstages - 1) * nlanes); // Stage s to s+1, lane i
+    for(uint32_t q = 0; q < queues.size(); q++) {
+        queues[q] = new struct SpscQueue<uint32_t>(PIPELINE_DEPTH);
+    }
+    std::vector<uint32_t> rowMap(nrows);
+    for(uint32_t i = 0; i < nrows; i++) {
+        rowMap[i] = i;
+    }
+    std::vector<double> busy_time(nthreads);
+    double wall_time = omp_get_wtime();
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        uint32_t stage = tid / nlanes;
+        uint32_t lane = tid % nlanes;
+        if(stage < nstages) {
+            uint32_t first = (stage * maxLayers) / nstages;
+            uint32_t last = ((stage + 1) * maxLayers) / nstages;
+            auto &s = spa_VEC[tid];
+            s->resize(batch_rows);
+            double busy = 0;
+            uint32_t b = lane;
+            while(true) {
+                if(stage) {
+                    double t = Trace::now();
+                    b = queues[(stage - 1) * nlanes + lane]->pop();
+                    Trace::span(tid, Phases::WAIT, t);
+                }
+                if((b == PIPELINE_END) or (b >= nbatches)) {
+                    break;
+                }
+                double t = omp_get_wtime();
+                if(not stage) {
+                    uint32_t start = b * batch_rows;
+                    uint32_t end = std::min(start + batch_rows, nrows);
+                    Y[b] = new struct CSC<Weight>(end - start, ncols, 1);
+                    Z[b] = new struct CSC<Weight>(end - start, ncols, 1);
+                    slice_rows<Weight>(Y0, start, end, Y[b]);
+                }
+                for(uint32_t r = first; (r < last) and Y[b]->nnz; r++) { // A batch whose images all died stays zero
+                    double u = Trace::now();
+                    SpMM_Serial<Weight>(Y[b], W0[r]->local(tid), Z[b], s, B1[r]);
+                    std::swap(Y[b], Z[b]);
+                    Trace::span(tid, Trace::BATCH, u, r);
+                }
+                busy += omp_get_wtime() - t;
+                if(stage < (nstages - 1)) {
+                    t = Trace::now();
+                    queues[stage * nlanes + lane]->push(b);
+                    Trace::span(tid, Phases::WAIT, t);
+                }
+                b += (stage) ? 0 : nlanes;
+            }
+            if(stage < (nstages - 1)) {
+                queues[stage * nlanes + lane]->push(PIPELINE_END);
+            }
+            busy_time[tid] = busy;
+        }
+        #pragma omp barrier
+        if(!tid) {
+            wall_time = omp_get_wtime() - wall_time;
+        }
+        stack_rows<Weight>(Y, batch_rows, rowMap, Y0);
+    }
+
+    for(uint32_t s = 0; s < nstages; s++) {
+        double busy = 0;
+        for(uint32_t i = 0; i < nlanes; i++) {
+            busy += busy_time[s * nlanes + i];
+        }
+        printf("INFO: Pipeline stage %d: layers %d-%d, threads %d, utilization %.1f%%\n", s,
+               ((s * maxLayers) / nstages) + 1, ((s + 1) * maxLayers) / nstages, nlanes, (wall_time) ? (100.0 * busy) / (nlanes * wall_time) : 0.0);
+    }
+    printf("INFO: Pipeline batches: %d of %d rows\n", nbatches, batch_rows);
+    for(uint32_t b = 0; b < nbatches; b++) {
+        delete Y[b];
+        delete Z[b];
+    }
+    for(auto *queue : queues) {
+        delete queue;
+    }
+}
+
+/* L2 cache size, half of it holds the layers of a group and the other half a tile */
+inline uint64_t tile_cache_bytes() {
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    return((l2 > 0) ? l2 : TILE_CACHE_BYTES);
+}
+
+/* Layers whose weights fit in half of the L2 cache, as every tile reads them again */
+template<typename Weight>
+inline uint32_t fusion_depth(std::vector<struct CSC<Weight>*> &layersSpMat) {
+    uint32_t maxLayers = layersSpMat.size();
+    uint64_t layer_bytes = 0;
+    for(auto *W : layersSpMat) {
+        layer_bytes += W->nbytes;
+    }
+    layer_bytes = (maxLayers) ? (layer_bytes / maxLayers) : 1;
+    return(std::min<uint64_t>(std::max<uint64_t>((tile_cache_bytes() / 2) / layer_bytes, 1), (maxLayers) ? maxLayers : 1));
+}
+
+/*
+ * Rows of a tile whose Y/Z buffers and SPA fit in half of the L2 cache. Rows fill in as they go
+ * through layers, so a row is sized for TILE_GROWTH times the nonzeros per row of Y now.
+ */
+template<typename Weight>
+inline uint32_t tile_size(struct CSC<Weight> *Y_CSC) {
+    uint64_t row_nnz = (Y_CSC->nrows) ? (TILE_GROWTH * ((Y_CSC->nnz / Y_CSC->nrows) + 1)) : Y_CSC->ncols;
+    row_nnz = std::min<uint64_t>(row_nnz, Y_CSC->ncols);
+    uint64_t row_bytes = (2 * row_nnz * (sizeof(uint32_t) + sizeof(Weight))) + sizeof(uint32_t) + sizeof(Weight);
+    return(std::max<uint64_t>((tile_cache_bytes() / 2) / row_bytes, TILE_MIN_ROWS));
+}
+
+/*
+ * Tiled inference: layers are run in groups of depth layers, and the rows of Y in tiles. A thread
+ * cuts a tile out of Y and runs it through all layers of the group with SpMM_Serial, so the tile,
+ * its SPA (of one item per tile row), and the layers of the group stay in cache, and Y is only
+ * written back once per group. Tiles are then stacked back into Y, dropping dead rows (rowIds
+ * keeps the image ids), and inference stops once every image died. Tile rows and depth that are
+ * 0 are picked from the L2 cache size, the tile rows again for every group as Y fills in.
+ */
+template<typename Weight>
+void inferenceReLU_tiled(std::vector<struct CSC<Weight>*> &layersSpMat, std::vector<struct DenseVec<Weight>*> &biasesDenseVec,
+                         struct CSC<Weight> *featuresSpMat, std::vector<struct SpaVec<Weight>*> &spa_VEC, std::vector<uint32_t> &rowIds,
+                         uint32_t tile_rows, uint32_t depth) {
+    auto &W0 = layersSpMat;
+    uint32_t maxLayers = W0.size();
+    auto &B1 = biasesDenseVec;
+    auto *Y0 = featuresSpMat;
+
+    uint32_t nrows = Y0->nrows;
+    uint32_t ncols = Y0->ncols;
+    bool auto_rows = (not tile_rows);
+    depth = (depth) ? depth : fusion_depth<Weight>(W0);
+    std::vector<struct CSC<Weight>*> tiles;
+    std::vector<struct CSC<Weight>*> Z(Env::nthreads);
+    std::vector<uint32_t> rowMap(nrows);
+    uint32_t nlive = nrows;
+    uint32_t nlayers = maxLayers;
+    uint32_t ntiles = 0;
+    uint32_t min_rows = UINT32_MAX;
+    uint32_t max_rows = 0;
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        auto &s = spa_VEC[tid];
+        Z[tid] = new struct CSC<Weight>(1, ncols, 1);
+        for(uint32_t first = 0; first < maxLayers; first += depth) {
+            uint32_t last = std::min(first + depth, maxLayers);
+            uint32_t rows = Y0->nrows;
+            #pragma omp single
+            {
+                tile_rows = (auto_rows) ? tile_size<Weight>(Y0) : tile_rows;
+                min_rows = std::min(min_rows, tile_rows);
+                max_rows = std::max(max_rows, tile_rows);
+                ntiles = (rows + tile_rows - 1) / tile_rows;
+                while(tiles.size() < ntiles) {
+                    tiles.push_back(new struct CSC<Weight>(1, ncols, 1));
+                }
+            }
+            if(s->nitems != tile_rows) {
+                s->resize(tile_rows);
+            }
+            #pragma omp for schedule(dynamic)
+            for(uint32_t t = 0; t < ntiles; t++) {
+                uint32_t start = t * tile_rows;
+                slice_rows<Weight>(Y0, start, std::min(start + tile_rows, rows), tiles[t]);
+                for(uint32_t r = first; (r < last) and tiles[t]->nnz; r++) {
+                    double u = Trace::now();
+                    Z[tid]->nrows = tiles[t]->nrows;
+                    SpMM_Serial<Weight>(tiles[t], W0[r]->local(tid), Z[tid], s, B1[r]);
+                    std::swap(tiles[t], Z[tid]);
+                    Trace::span(tid, Trace::TILE, u, r);
+                }
+            }
+            double mark = Trace::now();
+            #pragma omp for
+            for(uint32_t i = 0; i < rows; i++) {
+                rowMap[i] = 0;
+            }
+            #pragma omp for
+            for(uint32_t t = 0; t < ntiles; t++) {
+                for(uint32_t k = 0; k < tiles[t]->nnz; k++) {
+                    rowMap[(t * tile_rows) + tiles[t]->IA[k]] = 1;
+                }
+            }
+            #pragma omp single
+            {
+                uint32_t n = 0;
+                for(uint32_t i = 0; i < rows; i++) {
+                    n += rowMap[i];
+                }
+                nlive = 0;
+                bool compact = ((n + (rows / COMPACT_FRACTION)) <= rows);
+                for(uint32_t i = 0; i < rows; i++) {
+                    if(rowMap[i] or (not compact)) {
+                        rowIds[nlive] = rowIds[i];
+                        rowMap[i] = nlive++;
+                    }
+                }
+            }
+            std::vector<struct CSC<Weight>*> group(tiles.begin(), tiles.begin() + ntiles);
+            stack_rows<Weight>(group, tile_rows, rowMap, Y0);
+            Trace::span(tid, Phases::COMPACT, mark, last - 1);
+            #pragma omp single
+            {
+                Y0->nrows = nlive;
+            }
+            if(not Y0->nnz) {
+                #pragma omp single
+                {
+                    nlayers = last;
+                    printf("INFO: All images died by layer %d, stopping early\n", nlayers);
+                }
+                break;
+            }
+        }
+        delete Z[tid];
+    }
+    for(auto *tile : tiles) {
+        delete tile;
+    }
+    printf("INFO: Tiles of %d-%d rows through %d layers at a time (L2 cache %lu KiB)\n", min_rows, max_rows, depth, tile_cache_bytes() >> 10);
+    printf("INFO: Live rows: %d of %d\n", (Y0->nnz) ? Y0->nrows : 0, nrows);
+}
+
+/* Image ids of the rows of Y with a nonzero, in order */
+template<typename Weight>
+std::vector<uint32_t> predict_categories(struct CSC<Weight> *featuresSpMat, std::vector<uint32_t> &rowIds) {
+    auto *Y_CSC = featuresSpMat;
+    uint32_t *JA = Y_CSC->JA;
+    uint32_t *IA = Y_CSC->IA;
+    Weight   *A = Y_CSC->A;
+    uint32_t ncols = Y_CSC->ncols;
+    uint32_t nrows = Y_CSC->nrows;
+
+    std::vector<bool> allCategories(nrows); // Rows with a nonzero (activations are nonnegative, and row sums may overflow fixed point)
+    for(uint32_t j = 0; j < ncols; j++) {
+        for(uint32_t i = JA[j]; i < JA[j+1]; i++) {
+            allCategories[IA[i]] = allCategories[IA[i]] or (bool) A[i];
+        }
+    }
+    
+    std::vector<uint32_t> predictedCategories;
+    for(uint32_t i = 0; i < nrows; i++) {
+        if(allCategories[i])
+            predictedCategories.push_back(rowIds[i]);
+    }
+    return(predictedCategories);
+}
+
+void validate_prediction(std::vector<uint32_t> &predictedCategories, std::vector<uint32_t> &trueCategories) {
+    bool tf = true;
+    if(trueCategories.size() == predictedCategories.size()) {        
+        for(int32_t i = 0; i < trueCategories.size(); i++) {
+            if(predictedCategories[i] != trueCategories[i]) {
+                tf = false;
+                break;
+            }
+        }
+    } 
+    else {
+        tf = false;
+    }
+    
+    if(tf) {
+        printf("INFO: Challenge PASSED\n");
+    }
+    else {
+        printf("INFO: Challenge FAILED\n");
+    }
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * LayerQueue.hpp: Bounded queue of layers between a loader thread (producer)
+ * and the inference threads (consumer), so loading layer r+k overlaps computing layer r
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+ 
+#ifndef LAYERQUEUE_HPP
+#define LAYERQUEUE_HPP
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include "SparseMat.hpp"
+#include "DenseVec.hpp"
+
+template<typename Weight>
+struct Layer {
+    uint32_t layer;
+    struct CSC<Weight> *W;
+    struct DenseVec<Weight> *b;
+};
+
+template<typename Weight>
+struct LayerQueue {
+    public:
+        LayerQueue(uint32_t capacity_) { capacity = (capacity_) ? capacity_ : 1; }
+        ~LayerQueue() {};
+        void push(struct Layer<Weight> layer);
+        struct Layer<Weight> pop();
+        uint32_t capacity;
+        std::deque<struct Layer<Weight>> layers;
+        std::mutex mutex;
+        std::condition_variable not_full;
+        std::condition_variable not_empty;
+};
+
+template<typename Weight>
+void LayerQueue<Weight>::push(struct Layer<Weight> layer) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return(layers.size() < capacity); });
+    layers.push_back(layer);
+    lock.unlock();
+    not_empty.notify_one();
+}
+
+template<typename Weight>
+struct Layer<Weight> LayerQueue<Weight>::pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return(not layers.empty()); });
+    struct Layer<Weight> layer = layers.front();
+    layers.pop_front();
+    lock.unlock();
+    not_full.notify_one();
+    return(layer);
+}
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * Numa.hpp: NUMA placement of buffers
+ * Buffers written by one thread (SPAs, output segments, Y/Z column ranges) are placed by first
+ * touch: they are not cleared on allocation (anonymous mappings are already zero), so a page
+ * lands on the node of the thread that writes it first. Layers, read by all threads, are
+ * interleaved across nodes or replicated on every node. Pages are placed with mbind and
+ * located with move_pages, using the raw system calls so libnuma is not needed.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+
+/* Pages of a buffer located by move_pages, larger buffers are sampled */
+#define NUMA_SAMPLE_PAGES 4096
+
+class Numa {
+    public:
+        /*
+         * NONE: pages are cleared (placed) by the allocating thread.
+         * LOCAL: first touch, shared data stays where it was built.
+         * INTERLEAVE: first touch, layers, biases, and features interleaved over the nodes.
+         * REPLICATE: first touch, a copy of every layer on every node, features interleaved.
+         */
+        enum Placement {NONE, LOCAL, INTERLEAVE, REPLICATE};
+        static int placement;
+        static int nnodes;
+        static std::vector<int> thread_node;
+
+        static void init();
+        static int node();
+        static void place(void *ptr, uint64_t nbytes, int node = -1);
+        static void count_pages(const void *ptr, uint64_t nbytes, std::vector<uint64_t> &node_pages);
+        static void report(std::string name, std::vector<std::vector<uint64_t>> &copies, std::vector<int> &thread_copy);
+};
+int Numa::placement = Numa::NONE;
+int Numa::nnodes = 1;
+std::vector<int> Numa::thread_node;
+
+/* Count the nodes and record the node of every thread (threads should be bound, e.g. OMP_PROC_BIND) */
+void Numa::init() {
+    nnodes = 0;
+    while(not access(("/sys/devices/system/node/node" + std::to_string(nnodes)).c_str(), F_OK)) {
+        nnodes++;
+    }
+    nnodes = (nnodes) ? nnodes : 1;
+    int nthreads = 0;
+    #pragma omp parallel
+    {
+        nthreads = omp_get_num_threads();
+    }
+    thread_node.resize(nthreads);
+    #pragma omp parallel
+    {
+        int n = node();
+        thread_node[omp_get_thread_num()] = (n < nnodes) ? n : 0;
+    }
+}
+
+/* Node of the calling thread */
+int Numa::node() {
+    unsigned int cpu = 0;
+    unsigned int node_ = 0;
+    if(syscall(SYS_getcpu, &cpu, &node_, nullptr) == -1) {
+        return(0);
+    }
+    return(node_);
+}
+
+/* Interleave the pages of a buffer over all nodes (node < 0) or bind them to a node, moving touched pages */
+void Numa::place(void *ptr, uint64_t nbytes, int node) {
+    if((not ptr) or (not nbytes)) {
+        return;
+    }
+    std::vector<unsigned long> mask((nnodes + 63) / 64);
+    for(int n = 0; n < nnodes; n++) {
+        if((node < 0) or (n == node)) {
+            mask[n / 64] |= (1UL << (n % 64));
+        }
+    }
+    int mode = (node < 0) ? MPOL_INTERLEAVE : MPOL_BIND;
+    if(syscall(SYS_mbind, ptr, nbytes, mode, mask.data(), (mask.size() * 64) + 1, MPOL_MF_MOVE) == -1) {
+        fprintf(stderr, "Error: Cannot place memory on NUMA nodes\n");
+        exit(1);
+    }
+}
+
+/* Add the (sampled) pages of a buffer on every node to node_pages, pages not touched yet are not counted */
+void Numa::count_pages(const void *ptr, uint64_t nbytes, std::vector<uint64_t> &node_pages) {
+    if((not ptr) or (not nbytes)) {
+        return;
+    }
+    node_pages.resize(nnodes);
+    uint64_t PAGE_SIZE = sysconf(_SC_PAGESIZE);
+    uint64_t npages = (nbytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t stride = (npages / NUMA_SAMPLE_PAGES) + 1;
+    std::vector<void*> pages;
+    for(uint64_t i = 0; i < npages; i += stride) {
+        pages.push_back((char*) ptr + (i * PAGE_SIZE));
+    }
+    std::vector<int> status(pages.size());
+    if(syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) == -1) {
+        fprintf(stderr, "Error: Cannot locate memory pages\n");
+        exit(1);
+    }
+    for(int s : status) {
+        if((s >= 0) and (s < nnodes)) {
+            node_pages[s]++;
+        }
+    }
+}
+
+/*
+ * Print the pages of a data structure on every node and the share of remote pages: thread t reads
+ * copy thread_copy[t] (the shared data, its own buffer, or the replica of its node) and a page
+ * of it is remote if it is not on the node of t.
+ */
+void Numa::report(std::string name, std::vector<std::vector<uint64_t>> &copies, std::vector<int> &thread_copy) {
+    std::vector<uint64_t> node_pages(nnodes);
+    std::vector<uint64_t> copy_pages(copies.size());
+    for(uint32_t c = 0; c < copies.size(); c++) {
+        copies[c].resize(nnodes);
+        for(int n = 0; n < nnodes; n++) {
+            node_pages[n] += copies[c][n];
+            copy_pages[c] += copies[c][n];
+        }
+    }
+    uint64_t read = 0;
+    uint64_t remote = 0;
+    for(uint32_t t = 0; t < thread_copy.size(); t++) {
+        int c = thread_copy[t];
+        read += copy_pages[c];
+        remote += copy_pages[c] - copies[c][thread_node[t]];
+    }
+    printf("INFO: NUMA %s pages per node:", name.c_str());
+    for(int n = 0; n < nnodes; n++) {
+        printf(" %lu", node_pages[n]);
+    }
+    printf(", remote %.1f%%\n", (read) ? (100.0 * remote) / read : 0.0);
+}
+
+#endif
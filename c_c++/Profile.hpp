@@ -0,0 +1,195 @@
+/*
+ * Profile.hpp: Per-layer, per-thread phase instrumentation (built with -DPROFILE, see make profile)
+ * Every thread keeps a record per layer of the time spent in each phase of SpMM (see Phases), the
+ * time waiting at barriers, the nonzeros of Y and of the part of Z it computed, and the bytes it
+ * allocated and cleared. A thread only writes its own records, timed with one clock read per phase
+ * and barrier. The same hooks read the hardware counters (Counters.hpp) and record the timeline
+ * (Trace.hpp) when they are enabled, so without PROFILE they only check that.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "Counters.hpp"
+#include "Trace.hpp"
+
+#ifdef PROFILE
+class Profile {
+    public:
+        struct Record {
+            uint32_t layer;
+            double time[Phases::NPHASES];
+            uint64_t nnz_in;  // Of Y
+            uint64_t nnz_out; // Of Z, computed by the thread
+            uint64_t allocated;
+            uint64_t cleared;
+        };
+        struct Thread {
+            std::vector<struct Record> records;
+            double mark; // End of the last phase or barrier
+            char padding[THREAD_PADDING];
+        };
+        static std::vector<struct Thread> threads;
+
+        static void init(int nthreads, uint32_t nlayers);
+        static inline void layer(int tid, uint32_t layer, uint64_t nnz_in);
+        static inline struct Record* record(int tid);
+        static inline void phase(int tid, int phase);
+        static inline void nnz_out(int tid, uint64_t nnz);
+        static inline void allocated(uint64_t nbytes);
+        static inline void cleared(uint64_t nbytes);
+        static void report();
+        static void write(std::string path);
+};
+std::vector<struct Profile::Thread> Profile::threads;
+
+void Profile::init(int nthreads, uint32_t nlayers) {
+    threads.resize(nthreads);
+    for(auto &thread : threads) {
+        thread.records.clear();
+        thread.records.reserve(nlayers);
+        thread.mark = omp_get_wtime();
+    }
+}
+
+/* Open the record of a layer, ignored if the profile was not initialized for the thread */
+inline void Profile::layer(int tid, uint32_t layer, uint64_t nnz_in) {
+    if(tid < (int) threads.size()) {
+        struct Record record = {};
+        record.layer = layer;
+        record.nnz_in = nnz_in;
+        threads[tid].records.push_back(record);
+        threads[tid].mark = omp_get_wtime();
+    }
+}
+
+/* The open record of a thread, if any */
+inline struct Profile::Record* Profile::record(int tid) {
+    return(((tid < (int) threads.size()) and (not threads[tid].records.empty())) ? &threads[tid].records.back() : nullptr);
+}
+
+/* Time since the last mark goes to phase */
+inline void Profile::phase(int tid, int phase) {
+    struct Record *r = record(tid);
+    if(r) {
+        double now = omp_get_wtime();
+        r->time[phase] += now - threads[tid].mark;
+        threads[tid].mark = now;
+    }
+}
+
+inline void Profile::nnz_out(int tid, uint64_t nnz) {
+    struct Record *r = record(tid);
+    if(r) {
+        r->nnz_out = nnz;
+    }
+}
+
+/* Bytes allocated by the calling thread, counted in its open layer */
+inline void Profile::allocated(uint64_t nbytes) {
+    struct Record *r = record(omp_get_thread_num());
+    if(r) {
+        r->allocated += nbytes;
+    }
+}
+
+inline void Profile::cleared(uint64_t nbytes) {
+    struct Record *r = record(omp_get_thread_num());
+    if(r) {
+        r->cleared += nbytes;
+    }
+}
+
+/* Time of every phase summed over layers, for the slowest thread, and the mean barrier wait */
+void Profile::report() {
+    std::vector<double> time(Phases::NPHASES);
+    double wait = 0;
+    for(auto &thread : threads) {
+        for(int p = 0; p < Phases::NPHASES; p++) {
+            double t = 0;
+            for(auto &record : thread.records) {
+                t += record.time[p];
+            }
+            time[p] = std::max(time[p], t);
+            wait += (p == Phases::WAIT) ? t : 0;
+        }
+    }
+    printf("INFO: Profile phases (sec, slowest thread):");
+    for(int p = 0; p < Phases::NPHASES; p++) {
+        printf(" %s %f%s", Phases::names[p], time[p], (p < Phases::NPHASES - 1) ? "," : "\n");
+    }
+    printf("INFO: Profile barrier wait (sec): mean %f, max %f\n", (threads.empty()) ? 0 : wait / threads.size(), time[Phases::WAIT]);
+}
+
+/* Records as JSON if path ends with .json, otherwise as CSV */
+void Profile::write(std::string path) {
+    FILE *fd = fopen(path.c_str(), "w");
+    if(not fd) {
+        fprintf(stderr, "Error: Cannot open %s\n", path.c_str());
+        exit(1);
+    }
+    bool json = (path.size() >= 5) and (path.compare(path.size() - 5, 5, ".json") == 0);
+    if(json) {
+        fprintf(fd, "{\"threads\": %lu, \"records\": [\n", threads.size());
+    }
+    else {
+        fprintf(fd, "layer,thread");
+        for(int p = 0; p < Phases::NPHASES; p++) {
+            fprintf(fd, ",%s", Phases::names[p]);
+        }
+        fprintf(fd, ",nnz_in,nnz_out,bytes_allocated,bytes_cleared\n");
+    }
+    bool first = true;
+    for(uint32_t t = 0; t < threads.size(); t++) {
+        for(auto &record : threads[t].records) {
+            if(json) {
+                fprintf(fd, "%s{\"layer\": %d, \"thread\": %d", (first) ? "" : ",\n", record.layer, t);
+                for(int p = 0; p < Phases::NPHASES; p++) {
+                    fprintf(fd, ", \"%s\": %.9f", Phases::names[p], record.time[p]);
+                }
+                fprintf(fd, ", \"nnz_in\": %lu, \"nnz_out\": %lu, \"bytes_allocated\": %lu, \"bytes_cleared\": %lu}",
+                        record.nnz_in, record.nnz_out, record.allocated, record.cleared);
+            }
+            else {
+                fprintf(fd, "%d,%d", record.layer, t);
+                for(int p = 0; p < Phases::NPHASES; p++) {
+                    fprintf(fd, ",%.9f", record.time[p]);
+                }
+                fprintf(fd, ",%lu,%lu,%lu,%lu\n", record.nnz_in, record.nnz_out, record.allocated, record.cleared);
+            }
+            first = false;
+        }
+    }
+    if(json) {
+        fprintf(fd, "\n]}\n");
+    }
+    fclose(fd);
+    printf("INFO: Profile of %lu threads written to %s\n", threads.size(), path.c_str());
+}
+
+#define PROFILE_INIT(nthreads, nlayers) Profile::init(nthreads, nlayers)
+#define PROFILE_LAYER(tid, l, nnz) { Profile::layer(tid, l, nnz); Counters::layer(tid, l); Trace::layer(tid, l); }
+#define PROFILE_PHASE(tid, p) { Profile::phase(tid, Phases::p); Counters::phase(tid, Phases::p); Trace::phase(tid, Phases::p); }
+#define PROFILE_NNZ_OUT(tid, nnz) Profile::nnz_out(tid, nnz)
+#define PROFILE_ALLOCATED(nbytes) Profile::allocated(nbytes)
+#define PROFILE_CLEARED(nbytes) Profile::cleared(nbytes)
+#else
+#define PROFILE_INIT(nthreads, nlayers)
+#define PROFILE_LAYER(tid, l, nnz) { Counters::layer(tid, l); Trace::layer(tid, l); }
+#define PROFILE_PHASE(tid, p) { Counters::phase(tid, Phases::p); Trace::phase(tid, Phases::p); }
+#define PROFILE_NNZ_OUT(tid, nnz)
+#define PROFILE_ALLOCATED(nbytes)
+#define PROFILE_CLEARED(nbytes)
+#endif
+#define PROFILE_BARRIER(tid, p) { PROFILE_PHASE(tid, p); _Pragma("omp barrier") PROFILE_PHASE(tid, WAIT); }
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Reader.hpp: Read challenge files (features, layers, and categories)
+ * TSV files are mapped and split into byte ranges that are parsed in parallel
+ * with a hand-written number parser, so no memory is allocated per line
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+ 
+#ifndef READER_HPP
+#define READER_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <limits>
+#include <cstring>
+
+#include <omp.h>
+
+#include "Triple.hpp"
+#include "Fixed.hpp"
+
+inline std::string features_file(std::string path, uint32_t Nneurons, std::string ext = ".tsv") {
+    return(path + "/sparse-images-" + std::to_string(Nneurons) + ext);
+}
+
+inline std::string layer_file(std::string path, uint32_t Nneurons, uint32_t layer, std::string ext = ".tsv") {
+    return(path + "/neuron" + std::to_string(Nneurons) + "/n" + std::to_string(Nneurons) + "-l" + std::to_string(layer) + ext);
+}
+
+inline std::string category_file(std::string path, uint32_t Nneurons, uint32_t maxLayers) {
+    return(path + "/neuron" + std::to_string(Nneurons) + "-l" + std::to_string(maxLayers) + "-categories.tsv");
+}
+
+inline bool is_space(char c) {
+    return((c == ' ') or (c == '\t') or (c == '\r'));
+}
+
+inline bool is_digit(char c) {
+    return((c >= '0') and (c <= '9'));
+}
+
+inline const char* skip_spaces(const char* p, const char* end) {
+    while((p < end) and is_space(*p)) p++;
+    return(p);
+}
+
+inline const char* parse_uint(const char* p, const char* end, uint32_t &value) {
+    uint32_t v = 0;
+    while((p < end) and is_digit(*p)) {
+        v = (v * 10) + (*p - '0');
+        p++;
+    }
+    value = v;
+    return(p);
+}
+
+/* 
+ * Decimal numbers with a short mantissa are exact after one multiplication/division 
+ * by an exactly representable power of ten, so they round exactly like strtod.
+ * Anything else is handed to strtod from a stack copy of the token.
+ */
+template<typename Weight>
+inline const char* parse_weight(const char* p, const char* end, Weight &value) {
+    static const Weight POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                   1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const uint64_t MANTISSA_MAX = (1ULL << std::numeric_limits<Weight>::digits);
+    const int32_t  EXPONENT_MAX = (std::numeric_limits<Weight>::digits > 24) ? 22 : 10;
+    const char* start = p;
+    bool negative = false;
+    if((p < end) and ((*p == '-') or (*p == '+'))) {
+        negative = (*p == '-');
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int32_t  ndigits = 0;
+    int32_t  exponent = 0;
+    while((p < end) and is_digit(*p)) {
+        mantissa = (mantissa * 10) + (*p - '0');
+        ndigits += (mantissa != 0);
+        p++;
+    }
+    if((p < end) and (*p == '.')) {
+        p++;
+        while((p < end) and is_digit(*p)) {
+            mantissa = (mantissa * 10) + (*p - '0');
+            ndigits += (mantissa != 0);
+            exponent--;
+            p++;
+        }
+    }
+    bool fast = ((p == end) or is_space(*p) or (*p == '\n')) and (ndigits <= 19) and (mantissa < MANTISSA_MAX) and (exponent >= -EXPONENT_MAX);
+    if(fast) {
+        value = (exponent) ? ((Weight) mantissa / POW10[-exponent]) : (Weight) mantissa;
+        value = (negative) ? -value : value;
+    }
+    else {
+        while((p < end) and !is_space(*p) and (*p != '\n')) p++;
+        char token[64];
+        uint64_t length = ((p - start) < (int64_t)(sizeof(token) - 1)) ? (p - start) : (sizeof(token) - 1);
+        memcpy(token, start, length);
+        token[length] = '\0';
+        value = (Weight) strtod(token, nullptr);
+    }
+    return(p);
+}
+
+/* Fixed point weights are parsed as doubles and rounded, they must fit the unsigned range of Fixed */
+template<>
+inline const char* parse_weight<Fixed>(const char* p, const char* end, Fixed &value) {
+    double value_ = 0;
+    p = parse_weight<double>(p, end, value_);
+    if((value_ < 0) or (value_ >= 64)) {
+        fprintf(stderr, "Error: Weight %f is out of the fixed point range [0, 64)\n", value_);
+        exit(1);
+    }
+    value = Fixed(value_);
+    return(p);
+}
+
+/* Parse "row col weight" lines in [p, end) into triples, returns the number of triples */
+template<typename Weight>
+inline uint64_t parse_triples(const char* p, const char* end, struct Triple<Weight> *triples, uint64_t &nrows, uint64_t &ncols) {
+    uint64_t ntriples = 0;
+    struct Triple<Weight> triple;
+    while(p < end) {
+        p = skip_spaces(p, end);
+        if((p < end) and is_digit(*p)) {
+            p = parse_uint(p, end, triple.row);
+            p = skip_spaces(p, end);
+            p = parse_uint(p, end, triple.col);
+            p = skip_spaces(p, end);
+            p = parse_weight<Weight>(p, end, triple.weight);
+            triples[ntriples++] = triple;
+            if(triple.row > nrows)
+                nrows = triple.row;
+            if(triple.col > ncols)
+                ncols = triple.col;
+        }
+        while((p < end) and (*p != '\n')) p++;
+        p++;
+    }
+    return(ntriples);
+}
+
+inline uint64_t count_lines(const char* p, const char* end) {
+    uint64_t nlines = 0;
+    while((p < end) and (p = (const char*) memchr(p, '\n', end - p))) {
+        nlines++;
+        p++;
+    }
+    return(nlines);
+}
+
+/* 
+ * Read a triples file in parallel when called outside a parallel region (unless parallel is false). 
+ * Chunk boundaries are moved forward to the next line start, each chunk counts its lines, 
+ * then parses into its own slice of triples, and slices are compacted at the end.
+ */
+template<typename Weight>
+void read_triples(std::string inputFile, std::vector<struct Triple<Weight>> &triples, uint64_t &nrows, uint64_t &ncols, bool parallel = true) {
+    int fd = open(inputFile.c_str(), O_RDONLY);
+    if(fd == -1) {
+        fprintf(stderr, "Error: Opening %s\n", inputFile.c_str());
+        exit(1);
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error: Reading %s\n", inputFile.c_str());
+        exit(1);
+    }
+    uint64_t nbytes = st.st_size;
+    triples.clear();
+    if(!nbytes) {
+        close(fd);
+        return;
+    }
+    char* buf = nullptr;
+    if((buf = (char*) mmap(nullptr, nbytes, PROT_READ, MAP_PRIVATE, fd, 0)) == (void*) -1) {
+        fprintf(stderr, "Error: Cannot map %s\n", inputFile.c_str());
+        exit(1);
+    }
+    madvise(buf, nbytes, MADV_SEQUENTIAL);
+    close(fd);
+    const char* end = buf + nbytes;
+    
+    const uint64_t MIN_CHUNK = 1 << 20;
+    int nchunks = ((omp_in_parallel()) or (not parallel)) ? 1 : omp_get_max_threads();
+    nchunks = ((nbytes / nchunks) < MIN_CHUNK) ? ((nbytes / MIN_CHUNK) + 1) : nchunks;
+    std::vector<const char*> chunk_start(nchunks + 1);
+    chunk_start[0] = buf;
+    chunk_start[nchunks] = end;
+    for(int i = 1; i < nchunks; i++) {
+        const char* p = buf + ((nbytes / nchunks) * i);
+        p = (const char*) memchr(p, '\n', end - p);
+        chunk_start[i] = (p) ? (p + 1) : end;
+    }
+    
+    std::vector<uint64_t> chunk_offset(nchunks + 1);
+    std::vector<uint64_t> chunk_ntriples(nchunks);
+    std::vector<uint64_t> chunk_nrows(nchunks);
+    std::vector<uint64_t> chunk_ncols(nchunks);
+    #pragma omp parallel for schedule(static, 1) num_threads(nchunks) if(nchunks > 1)
+    for(int i = 0; i < nchunks; i++) {
+        chunk_offset[i + 1] = count_lines(chunk_start[i], chunk_start[i + 1]) + 1; // Last line may lack a newline
+    }
+    for(int i = 0; i < nchunks; i++) {
+        chunk_offset[i + 1] += chunk_offset[i];
+    }
+    triples.resize(chunk_offset[nchunks]);
+    #pragma omp parallel for schedule(static, 1) num_threads(nchunks) if(nchunks > 1)
+    for(int i = 0; i < nchunks; i++) {
+        chunk_nrows[i] = 0;
+        chunk_ncols[i] = 0;
+        chunk_ntriples[i] = parse_triples<Weight>(chunk_start[i], chunk_start[i + 1], triples.data() + chunk_offset[i], chunk_nrows[i], chunk_ncols[i]);
+    }
+    
+    uint64_t ntriples = 0;
+    for(int i = 0; i < nchunks; i++) {
+        if(ntriples != chunk_offset[i]) {
+            memmove(triples.data() + ntriples, triples.data() + chunk_offset[i], chunk_ntriples[i] * sizeof(struct Triple<Weight>));
+        }
+        ntriples += chunk_ntriples[i];
+        nrows = (chunk_nrows[i] > nrows) ? chunk_nrows[i] : nrows;
+        ncols = (chunk_ncols[i] > ncols) ? chunk_ncols[i] : ncols;
+    }
+    triples.resize(ntriples);
+    munmap(buf, nbytes);
+}
+
+inline void read_categories(std::string inputFile, std::vector<uint32_t> &categories) {
+    std::ifstream fin(inputFile.c_str());
+    if(!fin.is_open()) {
+        fprintf(stderr, "Error: Opening %s\n", inputFile.c_str());
+        exit(1);
+    }
+    
+    uint32_t category = 0;
+    std::string line;
+    std::istringstream iss;
+    while (std::getline(fin, line)) {
+        iss.clear();
+        iss.str(line);
+        iss >> category;
+        categories.push_back(category);
+    }
+    fin.close();
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Segment.hpp: Growable output segment of (row, value) pairs 
+ * Each thread appends the columns it computes to its own segment, 
+ * which grows geometrically using mremap
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+ 
+#ifndef SEGMENT_HPP
+#define SEGMENT_HPP
+
+#include "Allocator.hpp"
+
+template<typename Weight>
+struct Segment {
+    public: 
+        Segment() { nnz = 0; nnzmax = 0; nbytes = 0; IA = nullptr; A = nullptr; IA_blk = nullptr; A_blk = nullptr; };
+        Segment(uint64_t nnzmax_);
+        ~Segment();
+        inline void reserve(uint64_t nnz_);
+        inline void reserve_values(uint64_t nnz_);
+        inline void clear() { nnz = 0; };
+        uint64_t nnz;
+        uint64_t nnzmax; // Of IA, A may hold more (see reserve_values)
+        uint64_t nbytes;
+        uint32_t *IA; // Rows
+        Weight   *A;  // Vals
+        struct Data_Block<uint32_t> *IA_blk;
+        struct Data_Block<Weight>   *A_blk;
+};
+
+template<typename Weight>
+Segment<Weight>::Segment(uint64_t nnzmax_) {
+    nnz = 0;
+    nnzmax = (nnzmax_) ? nnzmax_ : 1;
+    IA_blk = new Data_Block<uint32_t>(&IA, nnzmax, nnzmax * sizeof(uint32_t), true);
+    A_blk  = new Data_Block<Weight>(&A, nnzmax, nnzmax * sizeof(Weight), true);
+    nbytes = IA_blk->nbytes + A_blk->nbytes;
+}
+
+template<typename Weight>
+Segment<Weight>::~Segment(){
+    delete IA_blk;
+    IA = nullptr;
+    delete A_blk;
+    A = nullptr;
+}
+
+/* Make room for nnz_ entries in total */
+template<typename Weight>
+inline void Segment<Weight>::reserve(uint64_t nnz_) {
+    if(nnz_ > nnzmax) {
+        nnzmax = ((nnz_ > (2 * nnzmax)) ? nnz_ : (2 * nnzmax));
+        IA_blk->reallocate(&IA, nnzmax, nnzmax * sizeof(uint32_t));
+        if(nnzmax > A_blk->nitems) {
+            A_blk->reallocate(&A, nnzmax, nnzmax * sizeof(Weight));
+        }
+        nbytes = IA_blk->nbytes + A_blk->nbytes;
+    }
+}
+
+/* Make room for nnz_ values in total, for dense columns that have no rows */
+template<typename Weight>
+inline void Segment<Weight>::reserve_values(uint64_t nnz_) {
+    if(nnz_ > A_blk->nitems) {
+        uint64_t nitems = ((nnz_ > (2 * A_blk->nitems)) ? nnz_ : (2 * A_blk->nitems));
+        A_blk->reallocate(&A, nitems, nitems * sizeof(Weight));
+        nbytes = IA_blk->nbytes + A_blk->nbytes;
+    }
+}
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Server.hpp: Requests of the inference server
+ * A request is a batch of images as "row col value" lines (rows from 1 within the request, as in
+ * the features file) ended by an empty line, and its reply is the rows with a category, one per
+ * line, ended by an empty line. Clients connect to a Unix domain socket, or write to stdin.
+ * A reader thread per client parses its requests into a queue, and the inference loop takes as
+ * many of them as fit in a batch once the oldest has waited the latency budget.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Triple.hpp"
+#include "Reader.hpp"
+
+/* Milliseconds between checks for a stop signal while waiting for clients */
+#define SERVER_POLL_MS 100
+
+class Server {
+    public:
+        static std::atomic<bool> stopping; // Set by SIGINT/SIGTERM
+        static void on_signal(int) { stopping = true; }
+        static int listen_socket(std::string path);
+        static bool write_all(int fd, std::string &reply);
+};
+std::atomic<bool> Server::stopping(false);
+
+/* Bind and listen on a Unix domain socket, replacing a stale socket file */
+int Server::listen_socket(std::string path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long\n", path.c_str());
+        exit(1);
+    }
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if((fd == -1) or (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) or (listen(fd, SOMAXCONN) == -1)) {
+        fprintf(stderr, "Error: Cannot listen on %s\n", path.c_str());
+        exit(1);
+    }
+    return(fd);
+}
+
+/* Write a whole reply, false if the client went away */
+bool Server::write_all(int fd, std::string &reply) {
+    const char *p = reply.data();
+    uint64_t n = reply.size();
+    while(n) {
+        ssize_t written = write(fd, p, n);
+        if(written <= 0) {
+            if((written == -1) and (errno == EINTR)) {
+                continue;
+            }
+            return(false);
+        }
+        p += written;
+        n -= written;
+    }
+    return(true);
+}
+
+/* A client, closed once its reader is done and its last reply is written */
+struct Connection {
+    public:
+        Connection(FILE *in_, int out_) { in = in_; out = out_; }
+        ~Connection() { if(out != fileno(in)) close(out); fclose(in); }
+        FILE *in;
+        int out;
+};
+
+template<typename Weight>
+struct Request {
+    std::shared_ptr<struct Connection> connection;
+    uint32_t nrows; // Images, the largest row
+    std::vector<struct Triple<Weight>> triples;
+    std::chrono::steady_clock::time_point arrival;
+};
+
+/* Read the lines of a request up to an empty line, false at the end of input with no lines */
+template<typename Weight>
+bool read_request(FILE *in, struct Request<Weight> &request, uint32_t Nneurons) {
+    char *line = nullptr;
+    size_t capacity = 0;
+    ssize_t length = 0;
+    bool lines = false;
+    uint64_t nrows = 0;
+    uint64_t ncols = 0;
+    request.triples.clear();
+    while((length = getline(&line, &capacity, in)) != -1) {
+        lines = true;
+        if((length <= 1) or (line[0] == '\r')) {
+            break;
+        }
+        struct Triple<Weight> triple;
+        uint64_t row = 0;
+        uint64_t col = 0;
+        if(parse_triples<Weight>(line, line + length, &triple, row, col) and triple.row and triple.col and (triple.col <= Nneurons)) {
+            request.triples.push_back(triple);
+            nrows = std::max(nrows, row);
+            ncols = std::max(ncols, col);
+        }
+        else {
+            fprintf(stderr, "WARN: Skipping request line %s", line);
+        }
+    }
+    free(line);
+    request.nrows = nrows;
+    request.arrival = std::chrono::steady_clock::now();
+    return(lines);
+}
+
+template<typename Weight>
+struct RequestQueue {
+    public:
+        RequestQueue() { nrows = 0; closed = false; }
+        ~RequestQueue() {};
+        void push(struct Request<Weight> &request);
+        bool pop_batch(std::vector<struct Request<Weight>> &batch, uint32_t max_rows, double budget);
+        void close();
+        std::deque<struct Request<Weight>> requests;
+        uint64_t nrows; // Images queued
+        bool closed;
+        std::mutex mutex;
+        std::condition_variable not_empty;
+};
+
+template<typename Weight>
+void RequestQueue<Weight>::push(struct Request<Weight> &request) {
+    std::unique_lock<std::mutex> lock(mutex);
+    nrows += request.nrows;
+    requests.push_back(std::move(request));
+    lock.unlock();
+    not_empty.notify_one();
+}
+
+/*
+ * Wait for a request, then for more until max_rows images are queued or the oldest has waited
+ * budget seconds, and take the requests that fit in max_rows images (at least one). False once
+ * the queue is closed and empty.
+ */
+template<typename Weight>
+bool RequestQueue<Weight>::pop_batch(std::vector<struct Request<Weight>> &batch, uint32_t max_rows, double budget) {
+    batch.clear();
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return((not requests.empty()) or closed); });
+    if(requests.empty()) {
+        return(false);
+    }
+    auto deadline = requests.front().arrival + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(budget));
+    not_empty.wait_until(lock, deadline, [&] { return((nrows >= max_rows) or closed); });
+    uint64_t rows = 0;
+    while((not requests.empty()) and (batch.empty() or ((rows + requests.front().nrows) <= max_rows))) {
+        rows += requests.front().nrows;
+        nrows -= requests.front().nrows;
+        batch.push_back(std::move(requests.front()));
+        requests.pop_front();
+    }
+    return(true);
+}
+
+template<typename Weight>
+void RequestQueue<Weight>::close() {
+    std::unique_lock<std::mutex> lock(mutex);
+    closed = true;
+    lock.unlock();
+    not_empty.notify_all();
+}
+
+/* Queue the requests of a client until it closes its end */
+template<typename Weight>
+void read_requests(std::shared_ptr<struct Connection> connection, std::shared_ptr<struct RequestQueue<Weight>> queue, uint32_t Nneurons) {
+    struct Request<Weight> request;
+    while(read_request<Weight>(connection->in, request, Nneurons)) {
+        request.connection = connection;
+        queue->push(request);
+    }
+}
+
+/*
+ * Feed the queue from stdin (replies go to out), or from every client of a Unix domain socket
+ * until SIGINT/SIGTERM. The queue is closed when the input ends or the server stops.
+ */
+template<typename Weight>
+void accept_requests(std::string path, int out, std::shared_ptr<struct RequestQueue<Weight>> queue, uint32_t Nneurons) {
+    if(path == "-") {
+        read_requests<Weight>(std::make_shared<struct Connection>(stdin, out), queue, Nneurons);
+        queue->close();
+        return;
+    }
+    int fd = Server::listen_socket(path);
+    printf("INFO: Listening on %s\n", path.c_str());
+    fflush(stdout);
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while(not Server::stopping) {
+        if(poll(&pfd, 1, SERVER_POLL_MS) <= 0) {
+            continue;
+        }
+        int client = accept(fd, nullptr, nullptr);
+        FILE *in = (client == -1) ? nullptr : fdopen(client, "r");
+        if(in) {
+            std::thread(read_requests<Weight>, std::make_shared<struct Connection>(in, client), queue, Nneurons).detach();
+        }
+    }
+    close(fd);
+    unlink(path.c_str());
+    queue->close();
+}
+
+#endif
@@ -0,0 +1,552 @@
+/*
+ * Simd.hpp: Vector kernels for the output of a column
+ * Bias, ReLU, and clamp with compaction of the zeros, compaction of the nonzeros of a dense SPA, 
+ * and dense SPA adds of sparse columns (gather/scatter) and of fixed fan-in dense columns.
+ * Sums are Accum<Weight> (Fixed.hpp) and outputs are Weight, the same type except for fixed point.
+ * AVX-512 and AVX2 versions for float, double, and fixed point, scalar otherwise.
+ * Writes may run up to SIMD_SLACK items past the output, so buffers keep that much room.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#include <stdint.h>
+#include "Fixed.hpp"
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#define SIMD_SLACK 16
+
+/* Sparse columns shorter than this are added with scalar code, gather/scatter only pays off on long columns */
+#define SIMD_SCATTER_MIN 512
+
+inline const char* simd_name() {
+    #if defined(__AVX512F__) && defined(__AVX512VL__)
+    return("AVX-512");
+    #elif defined(__AVX2__)
+    return("AVX2");
+    #else
+    return("scalar");
+    #endif
+}
+
+/*
+ * A[k] = min(max(S[k] * scale + bias, ymin), ymax) over n items, keeping nonzero results
+ * and their rows in order, returns their number. S may be A (in place). scale is 1 or a
+ * power of two, so S[k] * scale is exact and a fused multiply-add changes nothing.
+ */
+template<typename Weight>
+inline uint64_t relu_compact_scalar(uint32_t *IA, Accum<Weight> *S, Weight *A, uint64_t n, Accum<Weight> scale, Accum<Weight> bias,
+                                    Accum<Weight> ymin, Accum<Weight> ymax, uint64_t k = 0, uint64_t out = 0) {
+    for(; k < n; k++) {
+        Accum<Weight> value = S[k] * scale + bias;
+        value = (value < ymin) ? ymin : ((value > ymax) ? ymax : value);
+        Weight y = (Weight) value;
+        uint32_t i = IA[k];
+        IA[out] = i;
+        A[out] = y;
+        out += (y != 0);
+    }
+    return(out);
+}
+
+/*
+ * A[k] = min(max(S[k] * scale + bias, ymin), ymax) for the nonzeros of a dense column, zeros
+ * stay zero (as rows a SPA never gathers), returns the number of nonzero results. S may be A.
+ * Same arithmetic as relu_compact, and simple enough for the compiler to vectorize.
+ */
+template<typename Weight>
+inline uint64_t relu_dense(Accum<Weight> *S, Weight *A, uint64_t n, Accum<Weight> scale, Accum<Weight> bias, Accum<Weight> ymin, Accum<Weight> ymax) {
+    uint64_t nnz = 0;
+    Accum<Weight> zero = 0;
+    for(uint64_t k = 0; k < n; k++) {
+        Accum<Weight> value = S[k] * scale + bias;
+        value = (value < ymin) ? ymin : ((value > ymax) ? ymax : value);
+        value = (S[k] != zero) ? value : zero;
+        Weight y = (Weight) value;
+        A[k] = y;
+        nnz += (y != 0);
+    }
+    return(nnz);
+}
+
+/* Move the nonzeros of S[0, n) and their indices in order to IA/A, zero S, returns their number */
+template<typename Weight>
+inline uint64_t spa_compact_scalar(Weight *S, uint64_t n, uint32_t *IA, Weight *A, uint64_t k = 0, uint64_t out = 0) {
+    for(; k < n; k++) {
+        Weight value = S[k];
+        if(value) {
+            IA[out] = k;
+            A[out] = value;
+            out++;
+            S[k] = 0;
+        }
+    }
+    return(out);
+}
+
+/* T[IA[m]] += w * A[m] over n entries of a sparse column, whose rows are distinct */
+template<typename Weight>
+inline void scatter_add_scalar(const uint32_t *IA, const Weight *A, uint64_t n, Weight w, Accum<Weight> *T, uint64_t m = 0) {
+    for(; m < n; m++) {
+        T[IA[m]] += w * A[m];
+    }
+}
+
+/*
+ * T[i] += ws[0] * columns[0][i] + ... + ws[Degree-1] * columns[Degree-1][i] over n rows, adding in 
+ * the order of one axpy per column. Degree is the fan-in of an ELLPACK layer, known at compile time,
+ * so the loop over columns unrolls and T is loaded and stored once instead of Degree times.
+ */
+template<int Degree, typename Weight>
+inline void ell_axpy_scalar(const Weight **columns, const Weight *ws, Accum<Weight> *T, uint64_t n, uint64_t i = 0) {
+    for(; i < n; i++) {
+        Accum<Weight> sum = T[i];
+        for(int k = 0; k < Degree; k++) {
+            sum += ws[k] * columns[k][i];
+        }
+        T[i] = sum;
+    }
+}
+
+template<typename Weight>
+inline void scatter_add(const uint32_t *IA, const Weight *A, uint64_t n, Weight w, Accum<Weight> *T) {
+    scatter_add_scalar<Weight>(IA, A, n, w, T);
+}
+
+template<int Degree, typename Weight>
+inline void ell_axpy(const Weight **columns, const Weight *ws, Accum<Weight> *T, uint64_t n) {
+    ell_axpy_scalar<Degree, Weight>(columns, ws, T, n);
+}
+
+template<typename Weight>
+inline uint64_t relu_compact(uint32_t *IA, Accum<Weight> *S, Weight *A, uint64_t n, Accum<Weight> scale, Accum<Weight> bias, Accum<Weight> ymin, Accum<Weight> ymax) {
+    return(relu_compact_scalar<Weight>(IA, S, A, n, scale, bias, ymin, ymax));
+}
+
+template<typename Weight>
+inline uint64_t spa_compact(Weight *S, uint64_t n, uint32_t *IA, Weight *A) {
+    return(spa_compact_scalar<Weight>(S, n, IA, A));
+}
+
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+template<>
+inline uint64_t relu_compact<double>(uint32_t *IA, double *S, double *A, uint64_t n, double scale, double bias, double ymin, double ymax) {
+    __m512d vscale = _mm512_set1_pd(scale);
+    __m512d vbias = _mm512_set1_pd(bias);
+    __m512d vmin = _mm512_set1_pd(ymin);
+    __m512d vmax = _mm512_set1_pd(ymax);
+    __m512d vzero = _mm512_setzero_pd();
+    uint64_t k = 0;
+    uint64_t out = 0;
+    for(; k + 8 <= n; k += 8) {
+        __m512d v = _mm512_loadu_pd(S + k);
+        __m256i i = _mm256_loadu_si256((__m256i*) (IA + k));
+        v = _mm512_min_pd(_mm512_max_pd(_mm512_fmadd_pd(v, vscale, vbias), vmin), vmax);
+        __mmask8 keep = _mm512_cmp_pd_mask(v, vzero, _CMP_NEQ_OQ);
+        _mm512_mask_compressstoreu_pd(A + out, keep, v);
+        _mm256_mask_compressstoreu_epi32(IA + out, keep, i);
+        out += __builtin_popcount(keep);
+    }
+    return(relu_compact_scalar<double>(IA, S, A, n, scale, bias, ymin, ymax, k, out));
+}
+
+template<>
+inline uint64_t relu_compact<float>(uint32_t *IA, float *S, float *A, uint64_t n, float scale, float bias, float ymin, float ymax) {
+    __m512 vscale = _mm512_set1_ps(scale);
+    __m512 vbias = _mm512_set1_ps(bias);
+    __m512 vmin = _mm512_set1_ps(ymin);
+    __m512 vmax = _mm512_set1_ps(ymax);
+    __m512 vzero = _mm512_setzero_ps();
+    uint64_t k = 0;
+    uint64_t out = 0;
+    for(; k + 16 <= n; k += 16) {
+        __m512 v = _mm512_loadu_ps(S + k);
+        __m512i i = _mm512_loadu_si512((__m512i*) (IA + k));
+        v = _mm512_min_ps(_mm512_max_ps(_mm512_fmadd_ps(v, vscale, vbias), vmin), vmax);
+        __mmask16 keep = _mm512_cmp_ps_mask(v, vzero, _CMP_NEQ_OQ);
+        _mm512_mask_compressstoreu_ps(A + out, keep, v);
+        _mm512_mask_compressstoreu_epi32(IA + out, keep, i);
+        out += __builtin_popcount(keep);
+    }
+    return(relu_compact_scalar<float>(IA, S, A, n, scale, bias, ymin, ymax, k, out));
+}
+
+template<>
+inline uint64_t spa_compact<double>(double *S, uint64_t n, uint32_t *IA, double *A) {
+    __m512d vzero = _mm512_setzero_pd();
+    __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    uint64_t k = 0;
+    uint64_t out = 0;
+    for(; k + 8 <= n; k += 8) {
+        __m512d v = _mm512_loadu_pd(S + k);
+        __mmask8 keep = _mm512_cmp_pd_mask(v, vzero, _CMP_NEQ_UQ);
+        if(keep) {
+            __m256i i = _mm256_add_epi32(_mm256_set1_epi32(k), iota);
+            _mm512_mask_compressstoreu_pd(A + out, keep, v);
+            _mm256_mask_compressstoreu_epi32(IA + out, keep, i);
+            _mm512_storeu_pd(S + k, vzero);
+            out += __builtin_popcount(keep);
+        }
+    }
+    return(spa_compact_scalar<double>(S, n, IA, A, k, out));
+}
+
+template<>
+inline uint64_t spa_compact<float>(float *S, uint64_t n, uint32_t *IA, float *A) {
+    __m512 vzero = _mm512_setzero_ps();
+    __m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    uint64_t k = 0;
+    uint64_t out = 0;
+    for(; k + 16 <= n; k += 16) {
+        __m512 v = _mm512_loadu_ps(S + k);
+        __mmask16 keep = _mm512_cmp_ps_mask(v, vzero, _CMP_NEQ_UQ);
+        if(keep) {
+            __m512i i = _mm512_add_epi32(_mm512_set1_epi32(k), iota);
+            _mm512_mask_compressstoreu_ps(A + out, keep, v);
+            _mm512_mask_compressstoreu_epi32(IA + out, keep, i);
+            _mm512_storeu_ps(S + k, vzero);
+            out += __builtin_popcount(keep);
+        }
+    }
+    return(spa_compact_scalar<float>(S, n, IA, A, k, out));
+}
+
+template<>
+inline void scatter_add<double>(const uint32_t *IA, const double *A, uint64_t n, double w, double *T) {
+    uint64_t m = 0;
+    if(n >= SIMD_SCATTER_MIN) {
+        __m512d vw = _mm512_set1_pd(w);
+        for(; m + 8 <= n; m += 8) {
+            __m256i i = _mm256_loadu_si256((__m256i*) (IA + m));
+            __m512d t = _mm512_i32gather_pd(i, T, 8);
+            t = _mm512_fmadd_pd(vw, _mm512_loadu_pd(A + m), t);
+            _mm512_i32scatter_pd(T, i, t, 8);
+        }
+    }
+    scatter_add_scalar<double>(IA, A, n, w, T, m);
+}
+
+template<>
+inline void scatter_add<float>(const uint32_t *IA, const float *A, uint64_t n, float w, float *T) {
+    uint64_t m = 0;
+    if(n >= SIMD_SCATTER_MIN) {
+        __m512 vw = _mm512_set1_ps(w);
+        for(; m + 16 <= n; m += 16) {
+            __m512i i = _mm512_loadu_si512((__m512i*) (IA + m));
+            __m512 t = _mm512_i32gather_ps(i, T, 4);
+            t = _mm512_fmadd_ps(vw, _mm512_loadu_ps(A + m), t);
+            _mm512_i32scatter_ps(T, i, t, 4);
+        }
+    }
+    scatter_add_scalar<float>(IA, A, n, w, T, m);
+}
+
+/* Fixed point: 32-bit sums are clamped and rounded to 10 fraction bits, then compacted and narrowed to 16 bits */
+template<>
+inline uint64_t relu_compact<Fixed>(uint32_t *IA, FixedSum *S, Fixed *A, uint64_t n, FixedSum scale, FixedSum bias, FixedSum ymin, FixedSum ymax) {
+    uint64_t k = 0;
+    uint64_t out = 0;
+    if(scale.q == FixedSum::ONE) {
+        __m512i vbias = _mm512_set1_epi32(bias.q);
+        __m512i vmin = _mm512_set1_epi32(ymin.q);
+        __m512i vmax = _mm512_set1_epi32(ymax.q);
+        __m512i vhalf = _mm512_set1_epi32(Fixed::ONE / 2);
+        for(; k + 16 <= n; k += 16) {
+            __m512i v = _mm512_loadu_si512((__m512i*) (S + k));
+            __m512i i = _mm512_loadu_si512((__m512i*) (IA + k));
+            v = _mm512_min_epi32(_mm512_max_epi32(_mm512_add_epi32(v, vbias), vmin), vmax);
+            v = _mm512_srai_epi32(_mm512_add_epi32(v, vhalf), Fixed::FRACTION_BITS);
+            __mmask16 keep = _mm512_test_epi32_mask(v, v);
+            _mm256_storeu_si256((__m256i*) (A + out), _mm512_cvtepi32_epi16(_mm512_maskz_compress_epi32(keep, v)));
+            _mm512_mask_compressstoreu_epi32(IA + out, keep, i);
+            out += __builtin_popcount(keep);
+        }
+    }
+    return(relu_compact_scalar<Fixed>(IA, S, A, n, scale, bias, ymin, ymax, k, out));
+}
+
+template<>
+inline uint64_t spa_compact<FixedSum>(FixedSum *S, uint64_t n, uint32_t *IA, FixedSum *A) {
+    __m512i vzero = _mm512_setzero_si512();
+    __m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    uint64_t k = 0;
+    uint64_t out = 0;
+    for(; k + 16 <= n; k += 16) {
+        __m512i v = _mm512_loadu_si512((__m512i*) (S + k));
+        __mmask16 keep = _mm512_test_epi32_mask(v, v);
+        if(keep) {
+            __m512i i = _mm512_add_epi32(_mm512_set1_epi32(k), iota);
+            _mm512_mask_compressstoreu_epi32(A + out, keep, v);
+            _mm512_mask_compressstoreu_epi32(IA + out, keep, i);
+            _mm512_storeu_si512((__m512i*) (S + k), vzero);
+            out += __builtin_popcount(keep);
+        }
+    }
+    return(spa_compact_scalar<FixedSum>(S, n, IA, A, k, out));
+}
+
+/* Products of 16-bit values are exact in the low 32 bits, as in Fixed::operator* */
+template<>
+inline void scatter_add<Fixed>(const uint32_t *IA, const Fixed *A, uint64_t n, Fixed w, FixedSum *T) {
+    uint64_t m = 0;
+    if(n >= SIMD_SCATTER_MIN) {
+        __m512i vw = _mm512_set1_epi32(w.q);
+        for(; m + 16 <= n; m += 16) {
+            __m512i i = _mm512_loadu_si512((__m512i*) (IA + m));
+            __m512i a = _mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i*) (A + m)));
+            __m512i t = _mm512_i32gather_epi32(i, T, 4);
+            _mm512_i32scatter_epi32(T, i, _mm512_add_epi32(t, _mm512_mullo_epi32(a, vw)), 4);
+        }
+    }
+    scatter_add_scalar<Fixed>(IA, A, n, w, T, m);
+}
+
+template<int Degree>
+inline void ell_axpy(const double **columns, const double *ws, double *T, uint64_t n) {
+    uint64_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m512d sum0 = _mm512_loadu_pd(T + i);
+        __m512d sum1 = _mm512_loadu_pd(T + i + 8);
+        for(int k = 0; k < Degree; k++) {
+            __m512d w = _mm512_set1_pd(ws[k]);
+            sum0 = _mm512_fmadd_pd(w, _mm512_loadu_pd(columns[k] + i), sum0);
+            sum1 = _mm512_fmadd_pd(w, _mm512_loadu_pd(columns[k] + i + 8), sum1);
+        }
+        _mm512_storeu_pd(T + i, sum0);
+        _mm512_storeu_pd(T + i + 8, sum1);
+    }
+    ell_axpy_scalar<Degree, double>(columns, ws, T, n, i);
+}
+
+template<int Degree>
+inline void ell_axpy(const float **columns, const float *ws, float *T, uint64_t n) {
+    uint64_t i = 0;
+    for(; i + 32 <= n; i += 32) {
+        __m512 sum0 = _mm512_loadu_ps(T + i);
+        __m512 sum1 = _mm512_loadu_ps(T + i + 16);
+        for(int k = 0; k < Degree; k++) {
+            __m512 w = _mm512_set1_ps(ws[k]);
+            sum0 = _mm512_fmadd_ps(w, _mm512_loadu_ps(columns[k] + i), sum0);
+            sum1 = _mm512_fmadd_ps(w, _mm512_loadu_ps(columns[k] + i + 16), sum1);
+        }
+        _mm512_storeu_ps(T + i, sum0);
+        _mm512_storeu_ps(T + i + 16, sum1);
+    }
+    ell_axpy_scalar<Degree, float>(columns, ws, T, n, i);
+}
+
+#elif defined(__AVX2__)
+/*
+ * AVX2 has no compress store: a table maps the keep mask to a permutation that moves kept
+ * lanes to the front, the whole vector is stored, and the output advances by the kept count
+ */
+struct Simd_Tables {
+    Simd_Tables() {
+        for(uint32_t mask = 0; mask < 256; mask++) {
+            uint32_t n = 0;
+            for(uint32_t lane = 0; lane < 8; lane++) {
+                if(mask & (1 << lane)) {
+                    lanes32[mask][n] = lane;
+                    if(mask < 16) {
+                        lanes64[mask][2 * n] = 2 * lane;
+                        lanes64[mask][2 * n + 1] = 2 * lane + 1;
+                    }
+                    n++;
+                }
+            }
+        }
+    }
+    alignas(32) int32_t lanes32[256][8] = {}; // 8 x 32-bit lanes
+    alignas(32) int32_t lanes64[16][8] = {};  // 4 x 64-bit lanes as pairs of 32-bit lanes
+};
+
+inline const struct Simd_Tables& simd_tables() {
+    static const struct Simd_Tables tables;
+    return(tables);
+}
+
+template<>
+inline uint64_t relu_compact<double>(uint32_t *IA, double *S, double *A, uint64_t n, double scale, double bias, double ymin, double ymax) {
+    const struct Simd_Tables &tables = simd_tables();
+    __m256d vscale = _mm256_set1_pd(scale);
+    __m256d vbias = _mm256_set1_pd(bias);
+    __m256d vmin = _mm256_set1_pd(ymin);
+    __m256d vmax = _mm256_set1_pd(ymax);
+    __m256d vzero = _mm256_setzero_pd();
+    uint64_t k = 0;
+    uint64_t out = 0;
+    for(; k + 4 <= n; k += 4) {
+        __m256d v = _mm256_loadu_pd(S + k);
+        __m256i i = _mm256_castsi128_si256(_mm_loadu_si128((__m128i*) (IA + k)));
+        v = _mm256_min_pd(_mm256_max_pd(_mm256_fmadd_pd(v, vscale, vbias), vmin), vmax);
+        int keep = _mm256_movemask_pd(_mm256_cmp_pd(v, vzero, _CMP_NEQ_OQ));
+        __m256i p64 = _mm256_load_si256((__m256i*) tables.lanes64[keep]);
+        __m256i p32 = _mm256_load_si256((__m256i*) tables.lanes32[keep]);
+        v = _mm256_castps_pd(_mm256_permutevar8x32_ps(_mm256_castpd_ps(v), p64));
+        i = _mm256_permutevar8x32_epi32(i, p32);
+        _mm256_storeu_pd(A + out, v);
+        _mm_storeu_si128((__m128i*) (IA + out), _mm256_castsi256_si128(i));
+        out += __builtin_popcount(keep);
+    }
+    return(relu_compact_scalar<double>(IA, S, A, n, scale, bias, ymin, ymax, k, out));
+}
+
+template<>
+inline uint64_t relu_compact<float>(uint32_t *IA, float *S, float *A, uint64_t n, float scale, float bias, float ymin, float ymax) {
+    const struct Simd_Tables &tables = simd_tables();
+    __m256 vscale = _mm256_set1_ps(scale);
+    __m256 vbias = _mm256_set1_ps(bias);
+    __m256 vmin = _mm256_set1_ps(ymin);
+    __m256 vmax = _mm256_set1_ps(ymax);
+    __m256 vzero = _mm256_setzero_ps();
+    uint64_t k = 0;
+    uint64_t out = 0;
+    for(; k + 8 <= n; k += 8) {
+        __m256 v = _mm256_loadu_ps(S + k);
+        __m256i i = _mm256_loadu_si256((__m256i*) (IA + k));
+        v = _mm256_min_ps(_mm256_max_ps(_mm256_fmadd_ps(v, vscale, vbias), vmin), vmax);
+        int keep = _mm256_movemask_ps(_mm256_cmp_ps(v, vzero, _CMP_NEQ_OQ));
+        __m256i p32 = _mm256_load_si256((__m256i*) tables.lanes32[keep]);
+        _mm256_storeu_ps(A + out, _mm256_permutevar8x32_ps(v, p32));
+        _mm256_storeu_si256((__m256i*) (IA + out), _mm256_permutevar8x32_epi32(i, p32));
+        out += __builtin_popcount(keep);
+    }
+    return(relu_compact_scalar<float>(IA, S, A, n, scale, bias, ymin, ymax, k, out));
+}
+
+template<>
+inline uint64_t spa_compact<double>(double *S, uint64_t n, uint32_t *IA, double *A) {
+    const struct Simd_Tables &tables = simd_tables();
+    __m256d vzero = _mm256_setzero_pd();
+    __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 0, 0, 0, 0);
+    uint64_t k = 0;
+    uint64_t out = 0;
+    for(; k + 4 <= n; k += 4) {
+        __m256d v = _mm256_loadu_pd(S + k);
+        int keep = _mm256_movemask_pd(_mm256_cmp_pd(v, vzero, _CMP_NEQ_UQ));
+        if(keep) {
+            __m256i p64 = _mm256_load_si256((__m256i*) tables.lanes64[keep]);
+            __m256i p32 = _mm256_load_si256((__m256i*) tables.lanes32[keep]);
+            __m256i i = _mm256_permutevar8x32_epi32(_mm256_add_epi32(_mm256_set1_epi32(k), iota), p32);
+            _mm256_storeu_pd(A + out, _mm256_castps_pd(_mm256_permutevar8x32_ps(_mm256_castpd_ps(v), p64)));
+            _mm_storeu_si128((__m128i*) (IA + out), _mm256_castsi256_si128(i));
+            _mm256_storeu_pd(S + k, vzero);
+            out += __builtin_popcount(keep);
+        }
+    }
+    return(spa_compact_scalar<double>(S, n, IA, A, k, out));
+}
+
+template<>
+inline uint64_t spa_compact<float>(float *S, uint64_t n, uint32_t *IA, float *A) {
+    const struct Simd_Tables &tables = simd_tables();
+    __m256 vzero = _mm256_setzero_ps();
+    __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    uint64_t k = 0;
+    uint64_t out = 0;
+    for(; k + 8 <= n; k += 8) {
+        __m256 v = _mm256_loadu_ps(S + k);
+        int keep = _mm256_movemask_ps(_mm256_cmp_ps(v, vzero, _CMP_NEQ_UQ));
+        if(keep) {
+            __m256i p32 = _mm256_load_si256((__m256i*) tables.lanes32[keep]);
+            __m256i i = _mm256_permutevar8x32_epi32(_mm256_add_epi32(_mm256_set1_epi32(k), iota), p32);
+            _mm256_storeu_ps(A + out, _mm256_permutevar8x32_ps(v, p32));
+            _mm256_storeu_si256((__m256i*) (IA + out), i);
+            _mm256_storeu_ps(S + k, vzero);
+            out += __builtin_popcount(keep);
+        }
+    }
+    return(spa_compact_scalar<float>(S, n, IA, A, k, out));
+}
+
+/* Fixed point: 32-bit sums are clamped and rounded to 10 fraction bits, then compacted and packed to 16 bits */
+template<>
+inline uint64_t relu_compact<Fixed>(uint32_t *IA, FixedSum *S, Fixed *A, uint64_t n, FixedSum scale, FixedSum bias, FixedSum ymin, FixedSum ymax) {
+    const struct Simd_Tables &tables = simd_tables();
+    uint64_t k = 0;
+    uint64_t out = 0;
+    if(scale.q == FixedSum::ONE) {
+        __m256i vbias = _mm256_set1_epi32(bias.q);
+        __m256i vmin = _mm256_set1_epi32(ymin.q);
+        __m256i vmax = _mm256_set1_epi32(ymax.q);
+        __m256i vhalf = _mm256_set1_epi32(Fixed::ONE / 2);
+        __m256i vzero = _mm256_setzero_si256();
+        for(; k + 8 <= n; k += 8) {
+            __m256i v = _mm256_loadu_si256((__m256i*) (S + k));
+            __m256i i = _mm256_loadu_si256((__m256i*) (IA + k));
+            v = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(v, vbias), vmin), vmax);
+            v = _mm256_srai_epi32(_mm256_add_epi32(v, vhalf), Fixed::FRACTION_BITS);
+            int keep = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, vzero))) ^ 0xFF;
+            __m256i p32 = _mm256_load_si256((__m256i*) tables.lanes32[keep]);
+            v = _mm256_permutevar8x32_epi32(v, p32);
+            _mm_storeu_si128((__m128i*) (A + out), _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+            _mm256_storeu_si256((__m256i*) (IA + out), _mm256_permutevar8x32_epi32(i, p32));
+            out += __builtin_popcount(keep);
+        }
+    }
+    return(relu_compact_scalar<Fixed>(IA, S, A, n, scale, bias, ymin, ymax, k, out));
+}
+
+template<>
+inline uint64_t spa_compact<FixedSum>(FixedSum *S, uint64_t n, uint32_t *IA, FixedSum *A) {
+    const struct Simd_Tables &tables = simd_tables();
+    __m256i vzero = _mm256_setzero_si256();
+    __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    uint64_t k = 0;
+    uint64_t out = 0;
+    for(; k + 8 <= n; k += 8) {
+        __m256i v = _mm256_loadu_si256((__m256i*) (S + k));
+        int keep = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, vzero))) ^ 0xFF;
+        if(keep) {
+            __m256i p32 = _mm256_load_si256((__m256i*) tables.lanes32[keep]);
+            __m256i i = _mm256_permutevar8x32_epi32(_mm256_add_epi32(_mm256_set1_epi32(k), iota), p32);
+            _mm256_storeu_si256((__m256i*) (A + out), _mm256_permutevar8x32_epi32(v, p32));
+            _mm256_storeu_si256((__m256i*) (IA + out), i);
+            _mm256_storeu_si256((__m256i*) (S + k), vzero);
+            out += __builtin_popcount(keep);
+        }
+    }
+    return(spa_compact_scalar<FixedSum>(S, n, IA, A, k, out));
+}
+
+/* AVX2 has gathers but no scatter, so only the fixed fan-in adds are vectorized */
+template<int Degree>
+inline void ell_axpy(const double **columns, const double *ws, double *T, uint64_t n) {
+    uint64_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m256d sum0 = _mm256_loadu_pd(T + i);
+        __m256d sum1 = _mm256_loadu_pd(T + i + 4);
+        for(int k = 0; k < Degree; k++) {
+            __m256d w = _mm256_set1_pd(ws[k]);
+            sum0 = _mm256_fmadd_pd(w, _mm256_loadu_pd(columns[k] + i), sum0);
+            sum1 = _mm256_fmadd_pd(w, _mm256_loadu_pd(columns[k] + i + 4), sum1);
+        }
+        _mm256_storeu_pd(T + i, sum0);
+        _mm256_storeu_pd(T + i + 4, sum1);
+    }
+    ell_axpy_scalar<Degree, double>(columns, ws, T, n, i);
+}
+
+template<int Degree>
+inline void ell_axpy(const float **columns, const float *ws, float *T, uint64_t n) {
+    uint64_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256 sum0 = _mm256_loadu_ps(T + i);
+        __m256 sum1 = _mm256_loadu_ps(T + i + 8);
+        for(int k = 0; k < Degree; k++) {
+            __m256 w = _mm256_set1_ps(ws[k]);
+            sum0 = _mm256_fmadd_ps(w, _mm256_loadu_ps(columns[k] + i), sum0);
+            sum1 = _mm256_fmadd_ps(w, _mm256_loadu_ps(columns[k] + i + 8), sum1);
+        }
+        _mm256_storeu_ps(T + i, sum0);
+        _mm256_storeu_ps(T + i + 8, sum1);
+    }
+    ell_axpy_scalar<Degree, float>(columns, ws, T, n, i);
+}
+#endif
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * SpaVec.hpp: Sparse accumulator (SPA)
+ * Dense vector of values with a list of the touched indices. Gathering orders the list 
+ * through a bitmap, skipping empty words, so a column costs O(nnz + nitems/64) instead of 
+ * O(nitems). Columns with more flops than 2 x nitems are not worth tracking, so they
+ * use plain adds and are gathered by scanning the values. Values are sums (Accum<Data_Type>),
+ * wider than Data_Type for fixed point, where a staging buffer holds gathered sums until they
+ * are narrowed by relu_compact.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+ 
+#ifndef SPAVEC_HPP
+#define SPAVEC_HPP
+
+#include "Allocator.hpp"
+#include "Simd.hpp"
+#include <type_traits>
+
+template<typename Data_Type>
+struct SpaVec {
+    public: 
+        SpaVec() { nitems = 0; nwords = 0; nnz = 0; nbytes = 0; dense = false; A = nullptr; IA = nullptr; bitmap = nullptr; G = nullptr; A_blk = nullptr; IA_blk = nullptr; bitmap_blk = nullptr; G_blk = nullptr; };
+        SpaVec(uint32_t nitems_);
+        ~SpaVec();
+        inline bool densify(uint64_t nflops, bool force = false);
+        inline void insert(uint32_t i);
+        inline void insert_dense(uint32_t i);
+        inline void add(uint32_t i, Accum<Data_Type> value);
+        inline void add_dense(uint32_t i, Accum<Data_Type> value);
+        inline uint64_t count_reset();
+        template<typename Function>
+        inline void gather_reset(Function f);
+        inline uint64_t gather_reset(uint32_t *IA_out, Accum<Data_Type> *A_out);
+        inline uint64_t gather_relu_reset(uint32_t *IA_out, Data_Type *A_out, Accum<Data_Type> scale, Accum<Data_Type> bias, Accum<Data_Type> ymin, Accum<Data_Type> ymax);
+        inline Accum<Data_Type>* staging(Data_Type *A_out);
+        inline void clear();
+        inline void resize(uint32_t nitems_);
+        uint64_t nitems;
+        uint64_t nwords;
+        uint64_t nnz;
+        uint64_t nbytes;
+        bool dense;
+        Accum<Data_Type> *A; // Values
+        uint32_t  *IA;     // Touched indices
+        uint64_t  *bitmap; // Touched indices in order (only used while gathering)
+        Accum<Data_Type> *G; // Gathered sums before narrowing (only if Accum<Data_Type> is not Data_Type)
+        struct Data_Block<Accum<Data_Type>> *A_blk;
+        struct Data_Block<uint32_t>  *IA_blk;
+        struct Data_Block<uint64_t>  *bitmap_blk;
+        struct Data_Block<Accum<Data_Type>> *G_blk;
+    private:
+        inline void allocate();
+};
+
+template<typename Data_Type>
+inline void SpaVec<Data_Type>::allocate() {
+    A_blk = new Data_Block<Accum<Data_Type>>(&A, nitems, nitems * sizeof(Accum<Data_Type>));
+    IA_blk = new Data_Block<uint32_t>(&IA, nitems, nitems * sizeof(uint32_t));
+    bitmap_blk = new Data_Block<uint64_t>(&bitmap, nwords, nwords * sizeof(uint64_t));
+    nbytes = A_blk->nbytes + IA_blk->nbytes + bitmap_blk->nbytes;
+    G = nullptr;
+    G_blk = nullptr;
+    if(not std::is_same<Accum<Data_Type>, Data_Type>::value) {
+        G_blk = new Data_Block<Accum<Data_Type>>(&G, nitems + SIMD_SLACK, (nitems + SIMD_SLACK) * sizeof(Accum<Data_Type>));
+        nbytes += G_blk->nbytes;
+    }
+}
+
+template<typename Data_Type>
+SpaVec<Data_Type>::SpaVec(uint32_t nitems_) {
+    nitems = nitems_;
+    nwords = (nitems + 63) / 64;
+    nnz = 0;
+    dense = false;
+    allocate();
+}
+
+template<typename Data_Type>
+SpaVec<Data_Type>::~SpaVec(){
+    delete A_blk;
+    A = nullptr;
+    delete IA_blk;
+    IA = nullptr;
+    delete bitmap_blk;
+    bitmap = nullptr;
+    delete G_blk;
+    G = nullptr;
+}
+
+/* Choose the mode of the next column from its number of flops (an upper bound on its nnz), or force dense adds */
+template<typename Data_Type>
+inline bool SpaVec<Data_Type>::densify(uint64_t nflops, bool force) {
+    dense = force or (nflops >= (2 * nitems));
+    return(dense);
+}
+
+/* Symbolic pass: values are used as touched flags */
+template<typename Data_Type>
+inline void SpaVec<Data_Type>::insert(uint32_t i) {
+    IA[nnz] = i;
+    nnz += (A[i] == 0);
+    A[i] = 1;
+}
+
+template<typename Data_Type>
+inline void SpaVec<Data_Type>::insert_dense(uint32_t i) {
+    A[i] = 1;
+}
+
+/* 
+ * Numeric pass: an index is listed when its value is zero before the add. A sum that
+ * cancels to zero may get listed twice, so the list stops growing once it is full
+ * and gathering then falls back to a scan. 
+ */
+template<typename Data_Type>
+inline void SpaVec<Data_Type>::add(uint32_t i, Accum<Data_Type> value) {
+    IA[nnz] = i;
+    nnz += ((A[i] == 0) & (nnz < (nitems - 1)));
+    A[i] += value;
+}
+
+template<typename Data_Type>
+inline void SpaVec<Data_Type>::add_dense(uint32_t i, Accum<Data_Type> value) {
+    A[i] += value;
+}
+
+/* Number of touched indices (symbolic pass), zeros the touched flags */
+template<typename Data_Type>
+inline uint64_t SpaVec<Data_Type>::count_reset() {
+    uint64_t nnz_ = 0;
+    if(dense) {
+        for(uint32_t i = 0; i < nitems; i++) {
+            if(A[i]) {
+                nnz_++;
+                A[i] = 0;
+            }
+        }
+    }
+    else {
+        for(uint64_t k = 0; k < nnz; k++) {
+            A[IA[k]] = 0;
+        }
+        nnz_ = nnz;
+    }
+    nnz = 0;
+    return(nnz_);
+}
+
+/* Call f(i, A[i]) for nonzero values in ascending index order (numeric pass), then zero them */
+template<typename Data_Type>
+template<typename Function>
+inline void SpaVec<Data_Type>::gather_reset(Function f) {
+    if((not dense) and (nnz < (nitems - 1))) {
+        for(uint64_t k = 0; k < nnz; k++) {
+            uint32_t i = IA[k];
+            bitmap[i >> 6] |= (1ULL << (i & 63));
+        }
+        for(uint64_t w = 0; w < nwords; w++) {
+            uint64_t word = bitmap[w];
+            if(word) {
+                bitmap[w] = 0;
+                do {
+                    uint32_t i = (w << 6) + __builtin_ctzll(word);
+                    if(A[i]) {
+                        f(i, A[i]);
+                        A[i] = 0;
+                    }
+                    word &= (word - 1);
+                } while(word);
+            }
+        }
+    }
+    else {
+        for(uint32_t i = 0; i < nitems; i++) {
+            if(A[i]) {
+                f(i, A[i]);
+                A[i] = 0;
+            }
+        }
+    }
+    nnz = 0;
+}
+
+/* 
+ * Move nonzero values and their indices in ascending index order to IA_out/A_out (numeric pass),
+ * returns their number. Scans use the vector compaction kernel, so outputs need SIMD_SLACK room.
+ */
+template<typename Data_Type>
+inline uint64_t SpaVec<Data_Type>::gather_reset(uint32_t *IA_out, Accum<Data_Type> *A_out) {
+    uint64_t n = 0;
+    if((not dense) and (nnz < (nitems - 1))) {
+        for(uint64_t k = 0; k < nnz; k++) {
+            uint32_t i = IA[k];
+            bitmap[i >> 6] |= (1ULL << (i & 63));
+        }
+        for(uint64_t w = 0; w < nwords; w++) {
+            uint64_t word = bitmap[w];
+            if(word) {
+                bitmap[w] = 0;
+                do {
+                    uint32_t i = (w << 6) + __builtin_ctzll(word);
+                    IA_out[n] = i;
+                    A_out[n] = A[i];
+                    n += (A[i] != 0);
+                    A[i] = 0;
+                    word &= (word - 1);
+                } while(word);
+            }
+        }
+    }
+    else {
+        n = spa_compact<Accum<Data_Type>>(A, nitems, IA_out, A_out);
+    }
+    nnz = 0;
+    return(n);
+}
+
+/* Where sums of a column go before bias, ReLU, and clamp: A_out itself, or G if they are wider than Data_Type */
+template<typename Data_Type>
+inline Accum<Data_Type>* SpaVec<Data_Type>::staging(Data_Type *A_out) {
+    return((G) ? G : (Accum<Data_Type>*) A_out);
+}
+
+/* gather_reset, then bias, ReLU, and clamp (relu_compact) of the gathered sums into A_out, returns the number of nonzeros */
+template<typename Data_Type>
+inline uint64_t SpaVec<Data_Type>::gather_relu_reset(uint32_t *IA_out, Data_Type *A_out, Accum<Data_Type> scale, Accum<Data_Type> bias, Accum<Data_Type> ymin, Accum<Data_Type> ymax) {
+    Accum<Data_Type> *S = staging(A_out);
+    uint64_t n = gather_reset(IA_out, S);
+    return(relu_compact<Data_Type>(IA_out, S, A_out, n, scale, bias, ymin, ymax));
+}
+
+template<typename Data_Type>
+inline void SpaVec<Data_Type>::clear(){
+    A_blk->clear();
+    IA_blk->clear();
+    bitmap_blk->clear();
+    nnz = 0;
+}
+
+/* Resize to nitems_ indices (e.g. when dead rows are dropped), values start at zero */
+template<typename Data_Type>
+inline void SpaVec<Data_Type>::resize(uint32_t nitems_) {
+    delete A_blk;
+    delete IA_blk;
+    delete bitmap_blk;
+    delete G_blk;
+    nitems = nitems_;
+    nwords = (nitems + 63) / 64;
+    nnz = 0;
+    dense = false;
+    allocate();
+}
+#endif
@@ -1,392 +1,719 @@
-/*
- * SparseMat.hpp: Sparse Matrix formats
- * Compressed Sparse Column (CSC)
- * (c) Mohammad Hasanzadeh Mofrad, 2019
- * (e) m.hasanzadeh.mofrad@gmail.com
- */
- 
-#ifndef SPARSEMAT_HPP
-#define SPARSEMAT_HPP
-
-#include <numeric>
-
-#include "Allocator.hpp"
-#include "Triple.hpp"
-#include "Env.hpp"
-
-template<typename Weight>
-struct CSC {
-    public:
-        CSC() { nrows = 0, ncols = 0; nnz = 0;  nbytes = 0; idx = 0; JA = nullptr; IA = nullptr; A = nullptr; }
-        CSC(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_, bool page_aligned_ = true);
-        CSC(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_, std::vector<struct Triple<Weight>> &triples, bool page_aligned_ = true);
-        ~CSC();
-        inline void initialize(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_);
-        inline void reinitialize(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_);
-        inline void prepopulate(std::vector<struct Triple<Weight>> &triples);
-        inline void populate(std::vector<struct Triple<Weight>> &triples);
-        inline void postpopulate_t(int tid);
-        inline void repopulate(struct CSC<Weight> *other_csc);
-        inline void repopulate(struct CSC<Weight> *other_csc, int tid);
-        inline void spapopulate(struct DenseVec<Weight> *x_vector, struct DenseVec<Weight> *spa_vector, uint32_t col_idx);
-        inline void spapopulate(struct DenseVec<Weight> *spa_vector, uint32_t col_idx);
-        inline void spapopulate_t(struct DenseVec<Weight> *x_vector, struct DenseVec<Weight> *spa_vector, uint32_t col_idx, int tid);
-        inline void walk();
-        inline uint64_t numnonzeros() const { return(nnz); };
-        inline uint32_t numrows()   const { return(nrows); };
-        inline uint32_t numcols()   const { return(ncols); };
-        inline uint64_t size()        const { return(nbytes); };
-        inline void clear();
-        uint32_t nrows;
-        uint32_t ncols;
-        uint64_t nnz;
-        uint64_t nnzmax;
-        uint64_t nbytes;
-        uint64_t idx;
-        uint32_t *JA; // Cols
-        uint32_t *IA; // Rows
-        Weight   *A;  // Vals
-        struct Data_Block<uint32_t> *IA_blk;
-        struct Data_Block<uint32_t> *JA_blk;
-        struct Data_Block<Weight>  *A_blk;
-        bool page_aligned;
-};
-
-template<typename Weight>
-CSC<Weight>::CSC(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_, bool page_aligned_) {
-    nrows = nrows_;
-    ncols = ncols_;
-    nnz   = nnz_;
-    nnzmax   = nnz_;
-    page_aligned = page_aligned_;
-    JA = nullptr;
-    IA = nullptr;
-    A  = nullptr;
-    if(nrows and ncols and nnz) {
-        JA_blk = new Data_Block<uint32_t>(&JA, (ncols + 1), (ncols + 1) * sizeof(uint32_t), page_aligned);
-        IA_blk = new Data_Block<uint32_t>(&IA, nnz, nnz * sizeof(uint32_t), page_aligned);
-        A_blk  = new Data_Block<Weight>(&A,  nnz, nnz * sizeof(Weight), page_aligned);
-        nbytes = IA_blk->nbytes + JA_blk->nbytes + A_blk->nbytes;
-        JA[0] = 0;
-    }
-    idx = 0;
-}
-
-template<typename Weight>
-CSC<Weight>::CSC(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_, std::vector<struct Triple<Weight>> &triples, bool page_aligned_) {
-    nrows = nrows_;
-    ncols = ncols_;
-    nnz   = nnz_;
-    nnzmax   = nnz_;
-    nbytes = 0;
-    page_aligned = page_aligned_;
-    JA = nullptr;
-    IA = nullptr;
-    A  = nullptr;
-    prepopulate(triples);
-    if(nrows and ncols and nnz) {
-        JA_blk = new Data_Block<uint32_t>(&JA, (ncols + 1), (ncols + 1) * sizeof(uint32_t), page_aligned);
-        IA_blk = new Data_Block<uint32_t>(&IA, nnz, nnz * sizeof(uint32_t), page_aligned);
-        A_blk  = new Data_Block<Weight>(&A,  nnz, nnz * sizeof(Weight), page_aligned);
-        nbytes = IA_blk->nbytes + JA_blk->nbytes  + A_blk->nbytes;
-    }
-    JA[0] = 0;
-    idx = 0;
-    populate(triples);
-}
-
-template<typename Weight>
-CSC<Weight>::~CSC(){
-    delete JA_blk;
-    JA = nullptr;
-    delete IA_blk;
-    IA = nullptr;
-    delete  A_blk;
-    A  = nullptr;
-}
-
-template<typename Weight>
-inline void CSC<Weight>::initialize(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_) {    
-    if(nnz) {
-        nrows = nrows_;
-        ncols = ncols_;
-        nnz = nnz_;
-        nnzmax = nnz_;
-        JA_blk->reallocate(&JA, (ncols + 1), ((ncols + 1) * sizeof(uint32_t)));
-        IA_blk->reallocate(&IA, nnz, (nnz * sizeof(Weight)));
-        A_blk->reallocate(&A, nnz, (nnz * sizeof(Weight)));
-        nbytes = JA_blk->nbytes + IA_blk->nbytes + A_blk->nbytes;
-        JA[0] = 0;
-        idx = 0;
-        clear();
-    }
-    else {
-        nrows = nrows_;
-        ncols = ncols_;
-        nnz = nnz_;
-        nnzmax = nnz_;
-        JA_blk = new Data_Block<uint32_t>(&JA, (ncols + 1), (ncols + 1) * sizeof(uint32_t), page_aligned);
-        IA_blk = new Data_Block<uint32_t>(&IA, nnz, nnz * sizeof(uint32_t), page_aligned);
-        A_blk  = new Data_Block<Weight>(&A,  nnz, nnz * sizeof(Weight), page_aligned);
-        nbytes = IA_blk->nbytes + JA_blk->nbytes + A_blk->nbytes;
-        JA[0] = 0;
-        idx = 0;
-    }
-}
-
-template<typename Weight>
-inline void CSC<Weight>::prepopulate(std::vector<struct Triple<Weight>> &triples) {
-    uint64_t triples_size = triples.size();
-    if(triples_size) {
-        ColSort<Weight> f_col;
-        std::sort(triples.begin(), triples.end(), f_col);
-        for(uint64_t i = 1; i < triples_size; i++) {
-            if(triples[i-1].col == triples[i].col) {
-                if(triples[i-1].row == triples[i].row) {
-                    triples[i].weight += triples[i-1].weight;
-                    triples.erase(triples.begin()+i-1);
-                }
-            }
-        }
-        nnz = triples.size();
-    }
-}
-
-
-template<typename Weight>
-inline void CSC<Weight>::populate(std::vector<struct Triple<Weight>> &triples) {
-    if(ncols and nnz and triples.size()) {
-        uint32_t i = 0;
-        uint32_t j = 1;        
-        JA[0] = 0;
-        for(auto &triple : triples) {
-            while((j - 1) != triple.col) {
-                j++;
-                JA[j] = JA[j - 1];
-            }                  
-            JA[j]++;
-            IA[i] = triple.row;
-            A[i] = triple.weight;
-            i++;
-        }
-        while((j + 1) <= ncols) {
-            j++;
-            JA[j] = JA[j - 1];
-        }
-    }
-}
-
-template<typename Weight>
-inline void CSC<Weight>::spapopulate(struct DenseVec<Weight> *x_vector, struct DenseVec<Weight> *spa_vector, uint32_t col_idx) {
-    Weight YMIN = 0;
-    Weight YMAX = 32;
-    Weight   *x_A = x_vector->A;
-    Weight   *spa_A = spa_vector->A;
-    Weight value = 0;
-    JA[col_idx+1] += JA[col_idx];
-    for(uint32_t i = 0; i < nrows; i++) {
-        if(spa_A[i]) {
-            JA[col_idx+1]++;
-            IA[idx] = i;
-            spa_A[i] += x_A[col_idx];
-            if(spa_A[i] < YMIN) {
-                A[idx] = YMIN;
-            }
-            else if(spa_A[i] > YMAX) {
-                A[idx] = YMAX;
-            }
-            else {
-                A[idx] = spa_A[i];
-            }
-            idx++;
-            spa_A[i] = 0;
-        }
-    }
-}
-
-template<typename Weight>
-inline void CSC<Weight>::spapopulate(struct DenseVec<Weight> *spa_vector, uint32_t col_idx) {
-    Weight YMIN = 0;
-    Weight YMAX = 32;
-    Weight   *spa_A = spa_vector->A;
-    Weight value = 0;
-    JA[col_idx+1] += JA[col_idx];
-    for(uint32_t i = 0; i < nrows; i++) {
-        if(spa_A[i]) {
-            JA[col_idx+1]++;
-            IA[idx] = i;
-            A[idx] = spa_A[i];
-            idx++;
-            spa_A[i] = 0;
-        }
-    }
-}
-
-template<typename Weight>
-inline void CSC<Weight>::repopulate(struct CSC<Weight> *other_csc){
-    uint32_t o_ncols = other_csc->numcols();
-    uint32_t o_nnz = other_csc->numnonzeros();
-    uint32_t *o_IA = other_csc->IA;
-    uint32_t *o_JA = other_csc->JA;
-    Weight   *o_A  = other_csc->A;
-    if(ncols != o_ncols) {
-        fprintf(stderr, "Error: Cannot repopulate CSC\n");
-        exit(1);
-    }
-    if(nnz < o_nnz) {
-        IA_blk->reallocate(&IA, o_nnz, (o_nnz * sizeof(uint32_t)));
-        A_blk->reallocate(&A, o_nnz, (o_nnz * sizeof(Weight)));
-    }
-    clear();
-    idx = 0;
-    for(uint32_t j = 0; j < o_ncols; j++) {
-        JA[j+1] = JA[j];
-        for(uint32_t i = o_JA[j]; i < o_JA[j + 1]; i++) {
-            if(o_A[i]) {
-                JA[j+1]++;
-                IA[idx] = o_IA[i];
-                A[idx]  = o_A[i];
-                idx++;
-            }
-        }
-    }
-    nnz = idx;
-}
-
-template<typename Weight>
-inline void CSC<Weight>::spapopulate_t(struct DenseVec<Weight> *x_vector, struct DenseVec<Weight> *spa_vector, uint32_t col_idx, int tid) {
-    Weight YMIN = 0;
-    Weight YMAX = 32;
-    Weight   *x_A = x_vector->A;
-    Weight   *spa_A = spa_vector->A;
-    Weight value = 0;
-    auto &idx = Env::offset_nnz[tid];
-    
-    for(uint32_t i = 0; i < nrows; i++) {
-        if(spa_A[i]) {
-            spa_A[i] += x_A[col_idx];
-            if(spa_A[i] < YMIN) {
-                spa_A[i] = YMIN;
-            }
-            else if(spa_A[i] > YMAX) {
-                spa_A[i] = YMAX;
-            }
-            if(spa_A[i]) {
-                JA[col_idx+1]++;
-                IA[idx] = i;
-                A[idx] = spa_A[i];
-                idx++;
-                spa_A[i] = 0;
-            }
-        }
-    }
-}
-
-template<typename Weight>
-inline void CSC<Weight>::postpopulate_t(int tid) {
-    uint32_t start_col = Env::start_col[tid];
-    uint32_t end_col = Env::end_col[tid];
-    
-    if(tid == 0) {
-        JA[0] = 0;
-        for(uint32_t j = start_col+1; j < end_col; j++) {
-            JA[j] += JA[j-1];
-        }
-    }
-    else {
-        JA[start_col] = 0;
-        for(int32_t i = 0; i < tid; i++) {
-            JA[start_col] += (Env::offset_nnz[i] - Env::start_nnz[i]);
-        }
-        
-        for(uint32_t j = start_col+1; j < end_col; j++) {
-            JA[j] += JA[j-1];
-        }
-    }
-    
-    if((tid == Env::nthreads - 1)) {
-        JA[end_col] += JA[end_col-1];
-    }
-    
-    
-    if(tid == 0) {
-        idx = 0;
-        for(uint32_t i = 0; i < Env::nthreads; i++) {    
-            idx += (Env::offset_nnz[i] - Env::start_nnz[i]);
-        }
-    }
-}
-
-template<typename Weight>
-inline void CSC<Weight>::repopulate(struct CSC<Weight> *other_csc, int tid){
-    uint32_t o_ncols = other_csc->numcols();
-    uint32_t o_nnz = other_csc->numnonzeros();
-    uint32_t o_idx = other_csc->idx;
-    uint32_t *o_JA = other_csc->JA;
-    uint32_t *o_IA = other_csc->IA;
-    Weight   *o_A  = other_csc->A;
-    
-    if(ncols != o_ncols) {
-        fprintf(stderr, "Error: Cannot repopulate CSC\n");
-        exit(1);
-    }
-    
-    if(!tid) {
-        nnz = o_idx;
-        nnzmax = o_idx;
-        IA_blk->reallocate(&IA, nnz, (nnz * sizeof(uint32_t)));
-        A_blk->reallocate(&A, nnz, (nnz * sizeof(Weight)));            
-        clear();
-    }
-    #pragma omp barrier
-
-    uint32_t start_col = Env::start_col[tid];
-    uint32_t end_col = Env::end_col[tid];
-    uint64_t offset = 0;
-    uint64_t idx = 0;
-    JA[start_col] = 0;
-    if(tid) {
-        JA[start_col] = o_JA[start_col];
-        for(int32_t i = 0; i < tid; i++) {
-            //JA[start_col] += (Env::offset_nnz[i] - Env::start_nnz[i]);
-            offset += (Env::end_nnz[i] - Env::offset_nnz[i]);
-        }
-        idx = JA[start_col];
-    }
-
-    for(uint32_t j = start_col; j < end_col; j++) {
-        JA[j+1] = JA[j];
-        for(uint32_t i = o_JA[j] + offset; i < o_JA[j + 1] + offset; i++) {
-            JA[j+1]++;
-            IA[idx] = o_IA[i];
-            A[idx]  = o_A[i];
-            idx++;
-        }
-    }
-}
-
-template<typename Weight>
-inline void CSC<Weight>::clear() {
-    JA_blk->clear();
-    IA_blk->clear();
-    A_blk->clear();
-}    
-
-template<typename Weight>
-inline void CSC<Weight>::walk() {
-    double sum = 0;
-    uint64_t k = 0;
-    for(uint32_t j = 0; j < ncols; j++) {
-        printf("j=%d: %d\n", j, JA[j + 1] - JA[j]);
-        for(uint32_t i = JA[j]; i < JA[j + 1]; i++) {
-            IA[i];
-            A[i];
-            sum += A[i];
-            k++;
-            std::cout << "    i=" << IA[i] << ",j=" << j <<  ",value=" << A[i] << std::endl;
-        }
-    }
-    printf("Checksum=%f, Count=%lu\n", sum, k);
-}
-
-#endif
+/*
+ * SparseMat.hpp: Sparse Matrix formats
+ * Compressed Sparse Column (CSC)
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+ 
+#ifndef SPARSEMAT_HPP
+#define SPARSEMAT_HPP
+
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+
+#include "Allocator.hpp"
+#include "Triple.hpp"
+#include "SpaVec.hpp"
+#include "Env.hpp"
+
+/* How values are stored: one per nonzero, one for all nonzeros, or one power of two for all nonzeros */
+enum Values {GENERAL_VALUES, UNIFORM_VALUES, POW2_VALUES};
+
+/* How row indices are stored: IA, rows - 1 as uint16_t, or varint deltas of the rows of every column (see compact) */
+enum Indices {WIDE_INDICES, SHORT_INDICES, DELTA_INDICES};
+
+template<typename Weight>
+struct CSC {
+    public:
+        CSC() { nrows = 0, ncols = 0; nnz = 0; nnzmax = 0; nbytes = 0; idx = 0; JA = nullptr; IA = nullptr; A = nullptr; JA_blk = nullptr; IA_blk = nullptr; A_blk = nullptr; page_aligned = true; values = GENERAL_VALUES; value = 0; degree = 0; indices = WIDE_INDICES; IC = nullptr; JC = nullptr; IC_blk = nullptr; JC_blk = nullptr; }
+        CSC(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_, bool page_aligned_ = true);
+        CSC(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_, std::vector<struct Triple<Weight>> &triples, bool page_aligned_ = true);
+        ~CSC();
+        inline void initialize(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_);
+        inline void reinitialize(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_);
+        inline void reserve(uint64_t nnz_);
+        inline void swap(struct CSC<Weight> *other_csc);
+        inline bool unify();
+        inline uint32_t ellpack();
+        inline int compact(int indices_);
+        inline void place(int node = -1);
+        inline void count_pages(std::vector<uint64_t> &node_pages);
+        inline void replicate();
+        inline struct CSC<Weight>* local(int tid) { return((replicas.empty()) ? this : replicas[Numa::thread_node[tid]]); };
+        inline void populate(std::vector<struct Triple<Weight>> &triples);
+        inline void postpopulate_t(int tid);
+        inline void repopulate(struct CSC<Weight> *other_csc);
+        inline void repopulate(struct CSC<Weight> *other_csc, int tid);
+        inline void spapopulate(struct DenseVec<Weight> *x_vector, struct DenseVec<Weight> *spa_vector, uint32_t col_idx);
+        inline void spapopulate(struct DenseVec<Weight> *spa_vector, uint32_t col_idx);
+        inline void spapopulate_t(struct DenseVec<Weight> *x_vector, struct SpaVec<Weight> *spa_vector, uint32_t col_idx, int tid);
+        inline void walk();
+        inline uint64_t numnonzeros() const { return(nnz); };
+        inline uint32_t numrows()   const { return(nrows); };
+        inline uint32_t numcols()   const { return(ncols); };
+        inline uint64_t size()        const { return(nbytes); };
+        inline void clear();
+        uint32_t nrows;
+        uint32_t ncols;
+        uint64_t nnz;
+        uint64_t nnzmax;
+        uint64_t nbytes;
+        uint64_t idx;
+        uint32_t *JA; // Cols
+        uint32_t *IA; // Rows
+        Weight   *A;  // Vals
+        struct Data_Block<uint32_t> *IA_blk;
+        struct Data_Block<uint32_t> *JA_blk;
+        struct Data_Block<Weight>  *A_blk;
+        bool page_aligned;
+        int values;   // GENERAL_VALUES, UNIFORM_VALUES (A is not stored), or POW2_VALUES (A is not stored)
+        Weight value; // The value of all nonzeros if A is not stored
+        uint32_t degree; // Entries of every nonempty column if they all have the same number (ELLPACK), otherwise 0
+        int indices;  // WIDE_INDICES, SHORT_INDICES or DELTA_INDICES (IC holds the rows and IA is not stored)
+        uint8_t  *IC; // Compact rows
+        uint32_t *JC; // Byte offset of every column in IC (DELTA_INDICES)
+        struct Data_Block<uint8_t>  *IC_blk;
+        struct Data_Block<uint32_t> *JC_blk;
+        std::vector<struct CSC<Weight>*> replicas; // Copy on every NUMA node, if replicated
+};
+
+/* The rows of column j of a matrix in order, next() decodes one for the Indices of the matrix */
+template<int Indices>
+struct RowStream;
+
+template<>
+struct RowStream<WIDE_INDICES> {
+    template<typename Weight>
+    RowStream(struct CSC<Weight> *csc, uint32_t j) { p = csc->IA + csc->JA[j]; }
+    inline uint32_t next() { return(*p++); }
+    const uint32_t *p;
+};
+
+template<>
+struct RowStream<SHORT_INDICES> {
+    template<typename Weight>
+    RowStream(struct CSC<Weight> *csc, uint32_t j) { p = ((const uint16_t*) csc->IC) + csc->JA[j]; }
+    inline uint32_t next() { return(1 + (uint32_t) *p++); }
+    const uint16_t *p;
+};
+
+template<>
+struct RowStream<DELTA_INDICES> {
+    template<typename Weight>
+    RowStream(struct CSC<Weight> *csc, uint32_t j) { p = csc->IC + csc->JC[j]; row = 0; }
+    inline uint32_t next() {
+        uint32_t byte = *p++;
+        uint32_t delta = byte & 0x7F;
+        for(uint32_t shift = 7; byte & 0x80; shift += 7) {
+            byte = *p++;
+            delta |= (byte & 0x7F) << shift;
+        }
+        row += delta;
+        return(row);
+    }
+    const uint8_t *p;
+    uint32_t row;
+};
+
+template<typename Weight>
+CSC<Weight>::CSC(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_, bool page_aligned_) {
+    nrows = nrows_;
+    ncols = ncols_;
+    nnz   = nnz_;
+    nnzmax   = nnz_;
+    page_aligned = page_aligned_;
+    JA = nullptr;
+    IA = nullptr;
+    A  = nullptr;
+    JA_blk = nullptr;
+    IA_blk = nullptr;
+    A_blk  = nullptr;
+    nbytes = 0;
+    values = GENERAL_VALUES;
+    value = 0;
+    degree = 0;
+    indices = WIDE_INDICES;
+    IC = nullptr;
+    JC = nullptr;
+    IC_blk = nullptr;
+    JC_blk = nullptr;
+    if(nrows and ncols and nnz) {
+        JA_blk = new Data_Block<uint32_t>(&JA, (ncols + 1), (ncols + 1) * sizeof(uint32_t), page_aligned);
+        IA_blk = new Data_Block<uint32_t>(&IA, nnz, nnz * sizeof(uint32_t), page_aligned);
+        A_blk  = new Data_Block<Weight>(&A,  nnz, nnz * sizeof(Weight), page_aligned);
+        nbytes = IA_blk->nbytes + JA_blk->nbytes + A_blk->nbytes;
+        JA[0] = 0;
+    }
+    idx = 0;
+}
+
+template<typename Weight>
+CSC<Weight>::CSC(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_, std::vector<struct Triple<Weight>> &triples, bool page_aligned_) {
+    nrows = nrows_;
+    ncols = ncols_;
+    nnz   = nnz_;
+    nnzmax   = nnz_;
+    nbytes = 0;
+    page_aligned = page_aligned_;
+    JA = nullptr;
+    IA = nullptr;
+    A  = nullptr;
+    JA_blk = nullptr;
+    IA_blk = nullptr;
+    A_blk  = nullptr;
+    values = GENERAL_VALUES;
+    value = 0;
+    degree = 0;
+    indices = WIDE_INDICES;
+    IC = nullptr;
+    JC = nullptr;
+    IC_blk = nullptr;
+    JC_blk = nullptr;
+    if(nrows and ncols and nnz) {
+        JA_blk = new Data_Block<uint32_t>(&JA, (ncols + 1), (ncols + 1) * sizeof(uint32_t), page_aligned);
+        IA_blk = new Data_Block<uint32_t>(&IA, nnz, nnz * sizeof(uint32_t), page_aligned);
+        A_blk  = new Data_Block<Weight>(&A,  nnz, nnz * sizeof(Weight), page_aligned);
+        nbytes = IA_blk->nbytes + JA_blk->nbytes  + A_blk->nbytes;
+        JA[0] = 0;
+    }
+    idx = 0;
+    populate(triples);
+}
+
+template<typename Weight>
+CSC<Weight>::~CSC(){
+    for(auto *replica : replicas) {
+        delete replica;
+    }
+    delete JA_blk;
+    JA = nullptr;
+    delete IA_blk;
+    IA = nullptr;
+    delete  A_blk;
+    A  = nullptr;
+    delete IC_blk;
+    IC = nullptr;
+    delete JC_blk;
+    JC = nullptr;
+}
+
+/* 
+ * Reuse the buffers for nnz_ entries: IA/A only grow (see reserve), and only JA is 
+ * cleared, as columns counts are added to it. Entries past nnz are never read.
+ */
+template<typename Weight>
+inline void CSC<Weight>::initialize(uint32_t nrows_, uint32_t ncols_, uint64_t nnz_) {    
+    if(JA_blk) {
+        nrows = nrows_;
+        if(ncols != ncols_) {
+            ncols = ncols_;
+            JA_blk->reallocate(&JA, (ncols + 1), ((ncols + 1) * sizeof(uint32_t)));
+        }
+        reserve(nnz_);
+        nnz = nnz_;
+        nbytes = JA_blk->nbytes + IA_blk->nbytes + A_blk->nbytes;
+        memset(JA, 0, (ncols + 1) * sizeof(uint32_t));
+        PROFILE_CLEARED((ncols + 1) * sizeof(uint32_t));
+        idx = 0;
+    }
+    else {
+        nrows = nrows_;
+        ncols = ncols_;
+        nnz = nnz_;
+        nnzmax = nnz_;
+        JA_blk = new Data_Block<uint32_t>(&JA, (ncols + 1), (ncols + 1) * sizeof(uint32_t), page_aligned);
+        IA_blk = new Data_Block<uint32_t>(&IA, nnz, nnz * sizeof(uint32_t), page_aligned);
+        A_blk  = new Data_Block<Weight>(&A,  nnz, nnz * sizeof(Weight), page_aligned);
+        nbytes = IA_blk->nbytes + JA_blk->nbytes + A_blk->nbytes;
+        JA[0] = 0;
+        idx = 0;
+    }
+}
+
+/* 
+ * Grow IA/A to hold nnz_ entries, existing entries are kept and nothing is cleared. 
+ * nnzmax is a high-water mark that at least doubles, so Y/Z stop growing after a few layers.
+ */
+template<typename Weight>
+inline void CSC<Weight>::reserve(uint64_t nnz_) {
+    if(nnz_ > nnzmax) {
+        nnzmax = ((nnz_ > (2 * nnzmax)) ? nnz_ : (2 * nnzmax));
+        IA_blk->reallocate(&IA, nnzmax, (nnzmax * sizeof(uint32_t)));
+        A_blk->reallocate(&A, nnzmax, (nnzmax * sizeof(Weight)));
+        nbytes = JA_blk->nbytes + IA_blk->nbytes + A_blk->nbytes;
+    }
+}
+
+/* Exchange contents with other_csc without copying */
+template<typename Weight>
+inline void CSC<Weight>::swap(struct CSC<Weight> *other_csc) {
+    std::swap(nrows, other_csc->nrows);
+    std::swap(ncols, other_csc->ncols);
+    std::swap(nnz, other_csc->nnz);
+    std::swap(nnzmax, other_csc->nnzmax);
+    std::swap(nbytes, other_csc->nbytes);
+    std::swap(idx, other_csc->idx);
+    std::swap(JA, other_csc->JA);
+    std::swap(IA, other_csc->IA);
+    std::swap(A, other_csc->A);
+    std::swap(JA_blk, other_csc->JA_blk);
+    std::swap(IA_blk, other_csc->IA_blk);
+    std::swap(A_blk, other_csc->A_blk);
+    std::swap(page_aligned, other_csc->page_aligned);
+    std::swap(values, other_csc->values);
+    std::swap(value, other_csc->value);
+    std::swap(degree, other_csc->degree);
+    std::swap(indices, other_csc->indices);
+    std::swap(IC, other_csc->IC);
+    std::swap(JC, other_csc->JC);
+    std::swap(IC_blk, other_csc->IC_blk);
+    std::swap(JC_blk, other_csc->JC_blk);
+    std::swap(replicas, other_csc->replicas);
+}
+
+/* 
+ * If all nonzeros have the same value keep only that value and drop A. A power of 
+ * two value can be factored out of column sums exactly (barring underflow), but only
+ * in floating point: Fixed sums keep the weight in every product, so the integer ReLU
+ * kernels never see a scale.
+ */
+template<typename Weight>
+inline bool CSC<Weight>::unify() {
+    if((values != GENERAL_VALUES) or (not nnz) or (not A)) {
+        return(values != GENERAL_VALUES);
+    }
+    Weight value_ = A[0];
+    for(uint64_t i = 1; i < nnz; i++) {
+        if(A[i] != value_) {
+            return(false);
+        }
+    }
+    int exponent = 0;
+    value = value_;
+    values = ((std::is_floating_point<Weight>::value) and (std::fabs(std::frexp((double) value, &exponent)) == 0.5)) ? POW2_VALUES : UNIFORM_VALUES;
+    nbytes -= A_blk->nbytes;
+    delete A_blk;
+    A_blk = nullptr;
+    A = nullptr;
+    return(true);
+}
+
+/*
+ * Fixed fan-in: if every nonempty column has the same number of entries, IA/A already are the
+ * column major ELLPACK arrays (SELL-C-sigma with C = 1, no sorting and no padding), so only the
+ * degree is kept for the fixed fan-in kernels. Returns the degree, 0 if columns differ.
+ */
+template<typename Weight>
+inline uint32_t CSC<Weight>::ellpack() {
+    degree = 0;
+    if(not nnz) {
+        return(degree);
+    }
+    for(uint32_t j = 0; j < ncols; j++) {
+        uint32_t length = JA[j+1] - JA[j];
+        if(length and degree and (length != degree)) {
+            degree = 0;
+            break;
+        }
+        degree = (length) ? length : degree;
+    }
+    return(degree);
+}
+
+/*
+ * Compact rows for matrices only read as B of SpMM (layers), through RowStream. SHORT_INDICES
+ * keeps rows - 1 as uint16_t, so up to 65536 rows. DELTA_INDICES keeps for every column the
+ * differences of its rows (the first from 0) as varints, 7 bits a byte with the low bits first
+ * and the top bit set on all but the last byte, and the byte offset of every column in JC.
+ * IA is dropped. Returns the indices used, WIDE_INDICES if the rows do not fit or are unsorted.
+ */
+template<typename Weight>
+inline int CSC<Weight>::compact(int indices_) {
+    if((indices != WIDE_INDICES) or (indices_ == WIDE_INDICES) or (not nnz) or (not IA)) {
+        return(indices);
+    }
+    uint64_t nbytes_ = 0;
+    for(uint32_t j = 0; j < ncols; j++) {
+        uint32_t row = 0;
+        for(uint32_t k = JA[j]; k < JA[j+1]; k++) {
+            if((not IA[k]) or (IA[k] < row) or ((indices_ == SHORT_INDICES) and (IA[k] > 65536))) {
+                return(indices);
+            }
+            uint32_t delta = IA[k] - row;
+            nbytes_ += (indices_ == SHORT_INDICES) ? sizeof(uint16_t) : 1 + (delta >= (1 << 7)) + (delta >= (1 << 14)) + (delta >= (1 << 21)) + (delta >= (1 << 28));
+            row = IA[k];
+        }
+    }
+    if(nbytes_ > UINT32_MAX) {
+        return(indices);
+    }
+    IC_blk = new Data_Block<uint8_t>(&IC, nbytes_, nbytes_, page_aligned);
+    if(indices_ == SHORT_INDICES) {
+        uint16_t *IS = (uint16_t*) IC;
+        for(uint64_t k = 0; k < nnz; k++) {
+            IS[k] = IA[k] - 1;
+        }
+    }
+    else {
+        JC_blk = new Data_Block<uint32_t>(&JC, (ncols + 1), (ncols + 1) * sizeof(uint32_t), page_aligned);
+        uint8_t *p = IC;
+        for(uint32_t j = 0; j < ncols; j++) {
+            JC[j] = p - IC;
+            uint32_t row = 0;
+            for(uint32_t k = JA[j]; k < JA[j+1]; k++) {
+                uint32_t delta = IA[k] - row;
+                while(delta >= 0x80) {
+                    *p++ = (delta & 0x7F) | 0x80;
+                    delta >>= 7;
+                }
+                *p++ = delta;
+                row = IA[k];
+            }
+        }
+        JC[ncols] = p - IC;
+        nbytes += JC_blk->nbytes;
+    }
+    nbytes += IC_blk->nbytes - IA_blk->nbytes;
+    delete IA_blk;
+    IA_blk = nullptr;
+    IA = nullptr;
+    indices = indices_;
+    return(indices);
+}
+
+/* Interleave the pages over the NUMA nodes (node < 0) or move them to a node */
+template<typename Weight>
+inline void CSC<Weight>::place(int node) {
+    if(JA_blk) JA_blk->place(node);
+    if(IA_blk) IA_blk->place(node);
+    if(A_blk)  A_blk->place(node);
+    if(IC_blk) IC_blk->place(node);
+    if(JC_blk) JC_blk->place(node);
+}
+
+template<typename Weight>
+inline void CSC<Weight>::count_pages(std::vector<uint64_t> &node_pages) {
+    if(JA_blk) JA_blk->count_pages(node_pages);
+    if(IA_blk) IA_blk->count_pages(node_pages);
+    if(A_blk)  A_blk->count_pages(node_pages);
+    if(IC_blk) IC_blk->count_pages(node_pages);
+    if(JC_blk) JC_blk->count_pages(node_pages);
+}
+
+/* Copy the matrix to every NUMA node, threads read the copy of their node through local(tid) */
+template<typename Weight>
+inline void CSC<Weight>::replicate() {
+    for(int n = 0; n < Numa::nnodes; n++) {
+        struct CSC<Weight> *csc = new struct CSC<Weight>(nrows, ncols, nnz, page_aligned);
+        csc->place(n);
+        if(csc->JA) {
+            memcpy(csc->JA, JA, (ncols + 1) * sizeof(uint32_t));
+            if(IA) {
+                memcpy(csc->IA, IA, nnz * sizeof(uint32_t));
+            }
+            else {
+                csc->nbytes -= csc->IA_blk->nbytes;
+                delete csc->IA_blk;
+                csc->IA_blk = nullptr;
+                csc->IA = nullptr;
+                csc->IC_blk = new Data_Block<uint8_t>(&csc->IC, IC_blk->nitems, IC_blk->nitems, page_aligned);
+                csc->IC_blk->place(n);
+                memcpy(csc->IC, IC, IC_blk->nitems);
+                csc->nbytes += csc->IC_blk->nbytes;
+                if(JC) {
+                    csc->JC_blk = new Data_Block<uint32_t>(&csc->JC, (ncols + 1), (ncols + 1) * sizeof(uint32_t), page_aligned);
+                    csc->JC_blk->place(n);
+                    memcpy(csc->JC, JC, (ncols + 1) * sizeof(uint32_t));
+                    csc->nbytes += csc->JC_blk->nbytes;
+                }
+            }
+            if(A) {
+                memcpy(csc->A, A, nnz * sizeof(Weight));
+            }
+            else {
+                csc->nbytes -= csc->A_blk->nbytes;
+                delete csc->A_blk;
+                csc->A_blk = nullptr;
+                csc->A = nullptr;
+            }
+        }
+        csc->idx = idx;
+        csc->values = values;
+        csc->value = value;
+        csc->degree = degree;
+        csc->indices = indices;
+        replicas.push_back(csc);
+    }
+}
+
+/* 
+ * Counting sort the triples by column straight into JA/IA/A, then sort the rows 
+ * of each column (only if they are out of order) and merge duplicate entries 
+ */
+template<typename Weight>
+inline void CSC<Weight>::populate(std::vector<struct Triple<Weight>> &triples) {
+    if(ncols and nnz and triples.size()) {
+        for(uint32_t j = 0; j <= ncols; j++) {
+            JA[j] = 0;
+        }
+        for(auto &triple : triples) {
+            JA[triple.col + 1]++;
+        }
+        for(uint32_t j = 0; j < ncols; j++) {
+            JA[j + 1] += JA[j];
+        }
+        for(auto &triple : triples) {
+            uint32_t k = JA[triple.col]++;
+            IA[k] = triple.row;
+            A[k] = triple.weight;
+        }
+        for(uint32_t j = ncols; j > 0; j--) {
+            JA[j] = JA[j - 1];
+        }
+        JA[0] = 0;
+        
+        std::vector<std::pair<uint32_t, Weight>> column;
+        uint64_t k = 0;
+        for(uint32_t j = 0; j < ncols; j++) {
+            uint32_t start = JA[j];
+            uint32_t end = JA[j + 1];
+            bool sorted = true;
+            for(uint32_t i = start + 1; (i < end) and sorted; i++) {
+                sorted = (IA[i - 1] <= IA[i]);
+            }
+            if(not sorted) {
+                column.clear();
+                for(uint32_t i = start; i < end; i++) {
+                    column.push_back(std::make_pair(IA[i], A[i]));
+                }
+                std::stable_sort(column.begin(), column.end(), [](const std::pair<uint32_t, Weight> &a, const std::pair<uint32_t, Weight> &b) { return(a.first < b.first); });
+                for(uint32_t i = start; i < end; i++) {
+                    IA[i] = column[i - start].first;
+                    A[i] = column[i - start].second;
+                }
+            }
+            JA[j] = k;
+            for(uint32_t i = start; i < end; i++) {
+                if((k > JA[j]) and (IA[k - 1] == IA[i])) {
+                    A[k - 1] += A[i];
+                }
+                else {
+                    IA[k] = IA[i];
+                    A[k] = A[i];
+                    k++;
+                }
+            }
+        }
+        JA[ncols] = k;
+        nnz = k;
+        nnzmax = k;
+    }
+}
+
+template<typename Weight>
+inline void CSC<Weight>::spapopulate(struct DenseVec<Weight> *x_vector, struct DenseVec<Weight> *spa_vector, uint32_t col_idx) {
+    Weight YMIN = 0;
+    Weight YMAX = 32;
+    Weight   *x_A = x_vector->A;
+    Weight   *spa_A = spa_vector->A;
+    Weight value = 0;
+    JA[col_idx+1] += JA[col_idx];
+    for(uint32_t i = 0; i < nrows; i++) {
+        if(spa_A[i]) {
+            JA[col_idx+1]++;
+            IA[idx] = i;
+            spa_A[i] += x_A[col_idx];
+            if(spa_A[i] < YMIN) {
+                A[idx] = YMIN;
+            }
+            else if(spa_A[i] > YMAX) {
+                A[idx] = YMAX;
+            }
+            else {
+                A[idx] = spa_A[i];
+            }
+            idx++;
+            spa_A[i] = 0;
+        }
+    }
+}
+
+template<typename Weight>
+inline void CSC<Weight>::spapopulate(struct DenseVec<Weight> *spa_vector, uint32_t col_idx) {
+    Weight YMIN = 0;
+    Weight YMAX = 32;
+    Weight   *spa_A = spa_vector->A;
+    Weight value = 0;
+    JA[col_idx+1] += JA[col_idx];
+    for(uint32_t i = 0; i < nrows; i++) {
+        if(spa_A[i]) {
+            JA[col_idx+1]++;
+            IA[idx] = i;
+            A[idx] = spa_A[i];
+            idx++;
+            spa_A[i] = 0;
+        }
+    }
+}
+
+template<typename Weight>
+inline void CSC<Weight>::repopulate(struct CSC<Weight> *other_csc){
+    uint32_t o_ncols = other_csc->numcols();
+    uint32_t o_nnz = other_csc->numnonzeros();
+    uint32_t *o_IA = other_csc->IA;
+    uint32_t *o_JA = other_csc->JA;
+    Weight   *o_A  = other_csc->A;
+    if(ncols != o_ncols) {
+        fprintf(stderr, "Error: Cannot repopulate CSC\n");
+        exit(1);
+    }
+    reserve(o_nnz);
+    JA[0] = 0;
+    idx = 0;
+    for(uint32_t j = 0; j < o_ncols; j++) {
+        JA[j+1] = JA[j];
+        for(uint32_t i = o_JA[j]; i < o_JA[j + 1]; i++) {
+            if(o_A[i]) {
+                JA[j+1]++;
+                IA[idx] = o_IA[i];
+                A[idx]  = o_A[i];
+                idx++;
+            }
+        }
+    }
+    nnz = idx;
+}
+
+template<typename Weight>
+inline void CSC<Weight>::spapopulate_t(struct DenseVec<Weight> *x_vector, struct SpaVec<Weight> *spa_vector, uint32_t col_idx, int tid) {
+    Accum<Weight> YMIN = 0;
+    Accum<Weight> YMAX = 32;
+    Accum<Weight> *x_A = x_vector->A;
+    auto &idx = Env::offset_nnz[tid];
+    
+    spa_vector->gather_reset([&](uint32_t i, Accum<Weight> value) {
+        if(value) {
+            value += x_A[col_idx];
+            if(value < YMIN) {
+                value = YMIN;
+            }
+            else if(value > YMAX) {
+                value = YMAX;
+            }
+            if(value) {
+                JA[col_idx+1]++;
+                IA[idx] = i;
+                A[idx] = (Weight) value;
+                idx++;
+            }
+        }
+    });
+}
+
+template<typename Weight>
+inline void CSC<Weight>::postpopulate_t(int tid) {
+    uint32_t start_col = Env::start_col[tid];
+    uint32_t end_col = Env::end_col[tid];
+    
+    if(tid == 0) {
+        JA[0] = 0;
+        for(uint32_t j = start_col+1; j < end_col; j++) {
+            JA[j] += JA[j-1];
+        }
+    }
+    else {
+        JA[start_col] = 0;
+        for(int32_t i = 0; i < tid; i++) {
+            JA[start_col] += (Env::offset_nnz[i] - Env::start_nnz[i]);
+        }
+        
+        for(uint32_t j = start_col+1; j < end_col; j++) {
+            JA[j] += JA[j-1];
+        }
+    }
+    
+    if((tid == Env::nthreads - 1)) {
+        JA[end_col] += JA[end_col-1];
+    }
+    
+    
+    if(tid == 0) {
+        idx = 0;
+        for(uint32_t i = 0; i < Env::nthreads; i++) {    
+            idx += (Env::offset_nnz[i] - Env::start_nnz[i]);
+        }
+    }
+}
+
+template<typename Weight>
+inline void CSC<Weight>::repopulate(struct CSC<Weight> *other_csc, int tid){
+    uint32_t o_ncols = other_csc->numcols();
+    uint32_t o_nnz = other_csc->numnonzeros();
+    uint32_t o_idx = other_csc->idx;
+    uint32_t *o_JA = other_csc->JA;
+    uint32_t *o_IA = other_csc->IA;
+    Weight   *o_A  = other_csc->A;
+    
+    if(ncols != o_ncols) {
+        fprintf(stderr, "Error: Cannot repopulate CSC\n");
+        exit(1);
+    }
+    
+    if(!tid) { // Every thread writes JA and IA/A of its columns, so nothing is cleared
+        reserve(o_idx);
+        nnz = o_idx;
+    }
+    PROFILE_BARRIER(tid, REPOPULATE);
+
+    uint32_t start_col = Env::start_col[tid];
+    uint32_t end_col = Env::end_col[tid];
+    uint64_t offset = 0;
+    uint64_t idx = 0;
+    JA[start_col] = 0;
+    if(tid) {
+        JA[start_col] = o_JA[start_col];
+        for(int32_t i = 0; i < tid; i++) {
+            //JA[start_col] += (Env::offset_nnz[i] - Env::start_nnz[i]);
+            offset += (Env::end_nnz[i] - Env::offset_nnz[i]);
+        }
+        idx = JA[start_col];
+    }
+
+    for(uint32_t j = start_col; j < end_col; j++) {
+        JA[j+1] = JA[j];
+        for(uint32_t i = o_JA[j] + offset; i < o_JA[j + 1] + offset; i++) {
+            JA[j+1]++;
+            IA[idx] = o_IA[i];
+            A[idx]  = o_A[i];
+            idx++;
+        }
+    }
+}
+
+template<typename Weight>
+inline void CSC<Weight>::clear() {
+    JA_blk->clear();
+    IA_blk->clear();
+    A_blk->clear();
+}    
+
+template<typename Weight>
+inline void CSC<Weight>::walk() {
+    double sum = 0;
+    uint64_t k = 0;
+    for(uint32_t j = 0; j < ncols; j++) {
+        printf("j=%d: %d\n", j, JA[j + 1] - JA[j]);
+        for(uint32_t i = JA[j]; i < JA[j + 1]; i++) {
+            IA[i];
+            A[i];
+            sum += A[i];
+            k++;
+            std::cout << "    i=" << IA[i] << ",j=" << j <<  ",value=" << A[i] << std::endl;
+        }
+    }
+    printf("Checksum=%f, Count=%lu\n", sum, k);
+}
+
+#endif
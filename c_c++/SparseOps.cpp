@@ -1,121 +1,639 @@
-/*
- * SparseOps.cpp: Sparse Matrix operations
- * Sparse Matrix - Sparse Matrix (SpMM)
- * (c) Mohammad Hasanzadeh Mofrad, 2019
- * (e) m.hasanzadeh.mofrad@gmail.com
- */
- 
-#ifndef SPARSEOPS_CPP
-#define SPARSEOPS_CPP
-
-#include "Env.hpp"
-
-template<typename Weight>
-inline void SpMM_Sym(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, struct CSC<Weight> *C_CSC, 
-                     struct DenseVec<Weight> *s, int tid) { 
-    uint32_t *A_JA = A_CSC->JA;
-    uint32_t *A_IA = A_CSC->IA;      
-    Weight   *A_A  = A_CSC->A;
-    uint32_t A_nrows = A_CSC->nrows;  
-    uint32_t A_ncols = A_CSC->ncols;
-    
-    uint32_t *B_JA = B_CSC->JA;
-    uint32_t *B_IA = B_CSC->IA;      
-    Weight   *B_A  = B_CSC->A;
-    uint32_t B_nrows = B_CSC->nrows;  
-    uint32_t B_ncols = B_CSC->ncols;
-    
-    auto *s_A = s->A;
-    
-    uint64_t nnzmax = 0;        
-    if(A_ncols != B_nrows) {
-        fprintf(stderr, "Error: SpMM dimensions do not agree A[%d %d] B[%d %d]\n", A_nrows, A_ncols, B_nrows, B_ncols);
-        exit(1);
-    }
-
-    Env::env_unset(tid);
-    int nthreads = omp_get_num_threads();
-    uint32_t length = B_ncols;
-    uint32_t chunk = length/nthreads;
-    uint32_t start = chunk * tid;
-    uint32_t end = start + chunk;
-    end = (tid == nthreads - 1) ? length : end;
-    uint64_t nnzmax_local = 0;
-    
-    for(uint32_t j = start; j < end; j++) {
-        for(uint32_t k = B_JA[j]; k < B_JA[j+1]; k++) {
-            uint32_t l = B_IA[k];
-            for(uint32_t m = A_JA[l]; m < A_JA[l+1]; m++) {
-                s_A[A_IA[m]] = 1;
-            }
-        }
-        for(uint32_t i = 0; i < A_nrows; i++) {
-            if(s_A[i]) {
-                nnzmax_local++;
-                s_A[i] = 0;
-            }
-        }
-    }
-    Env::start_col[tid] = start;
-    Env::end_col[tid] = end;
-    Env::length_nnz[tid] = nnzmax_local;
-        
-    #pragma omp barrier
-    if(!tid) {
-        nnzmax = Env::env_set();
-        uint32_t nrows = A_CSC->nrows;
-        uint32_t ncols = B_CSC->ncols;        
-        C_CSC->initialize(nrows, ncols, nnzmax);
-    }
-    #pragma omp barrier
-}
-
-template<typename Weight>
-inline void SpMM(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, struct CSC<Weight> *C_CSC,
-                  struct DenseVec<Weight> *s, struct DenseVec<Weight> *b, int tid) {  
-    uint32_t *A_JA = A_CSC->JA;
-    uint32_t *A_IA = A_CSC->IA;      
-    Weight   *A_A  = A_CSC->A;
-    uint32_t A_nrows = A_CSC->nrows;  
-    uint32_t A_ncols = A_CSC->ncols;    
-    
-    uint32_t *B_JA = B_CSC->JA;
-    uint32_t *B_IA = B_CSC->IA;      
-    Weight   *B_A  = B_CSC->A;
-    uint32_t B_nrows = B_CSC->nrows;
-    uint32_t B_ncols = B_CSC->ncols;
-
-    uint32_t C_nrows = C_CSC->nrows;
-    uint32_t C_ncols = C_CSC->ncols;;       
-                 
-    uint32_t b_nitems = b->nitems;
-    
-    if((A_ncols != B_nrows) or (A_nrows != C_nrows) or (B_ncols != C_ncols)) {
-        fprintf(stderr, "Error: SpMM dimensions do not agree C[%d %d] != A[%d %d] B[%d %d]\n", C_nrows, C_ncols, A_nrows, A_ncols, B_nrows, B_ncols);
-        exit(1);
-    }
-    
-    if(C_ncols != b_nitems) {
-        fprintf(stderr, "Error: SpMV_EW dimensions do not agree [%d != %d]\n", C_ncols, b_nitems);
-        exit(1);
-    }
-
-    uint32_t start = Env::start_col[tid];
-    uint32_t end = Env::end_col[tid];
-    auto *s_A = s->A;
-
-    for(uint32_t j = start; j < end; j++) {
-        for(uint32_t k = B_JA[j]; k < B_JA[j+1]; k++) {
-            uint32_t l = B_IA[k];
-            for(uint32_t m = A_JA[l]; m < A_JA[l+1]; m++) {
-                s_A[A_IA[m]] += B_A[k] * A_A[m];
-            }
-        }
-        C_CSC->spapopulate_t(b, s, j, tid);
-    }
-    #pragma omp barrier
-    C_CSC->postpopulate_t(tid);
-    A_CSC->repopulate(C_CSC, tid);
-    #pragma omp barrier
-}
+/*
+ * SparseOps.cpp: Sparse Matrix operations
+ * Sparse Matrix - Sparse Matrix (SpMM)
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+ 
+#ifndef SPARSEOPS_CPP
+#define SPARSEOPS_CPP
+
+#include "SpaVec.hpp"
+#include "Segment.hpp"
+#include "BlockedMat.hpp"
+#include "Env.hpp"
+
+/* Fan-in the ELLPACK kernels are compiled for (RadiX-Net layers), layers with another fan-in use the CSC kernels */
+#define ELL_DEGREE 32
+
+/* 
+ * Accumulate column j of A*B into the SPA, returns the number of flops (an upper bound on its nnz).
+ * Values tells how B stores its values: with UNIFORM_VALUES every product uses B_value, and 
+ * with POW2_VALUES the SPA sums A alone, the caller scales the sums by B_value (see SpMM_Scale).
+ * A nonzero Degree is the fixed fan-in of B (see CSC::ellpack), so the loops over column j of B
+ * have a compile time trip count. The rows of column j are read twice from B_rows, decoded on
+ * the fly if B has compact indices (see CSC::compact). Dense adds go through the gather/scatter kernel.
+ */
+template<typename Weight, int Values, int Degree, int Indices>
+inline uint64_t SpMM_Col(uint32_t *A_JA, uint32_t *A_IA, Weight *A_A, uint32_t *B_JA, struct RowStream<Indices> B_rows, Weight *B_A, Weight B_value,
+                         uint32_t j, struct SpaVec<Weight> *s) {
+    uint32_t first = B_JA[j];
+    uint32_t last = (Degree) ? first + Degree : B_JA[j+1];
+    if(Degree and (B_JA[j+1] == first)) {
+        return(0);
+    }
+    uint64_t nflops = 0;
+    struct RowStream<Indices> rows = B_rows;
+    for(uint32_t k = first; k < last; k++) {
+        uint32_t l = rows.next();
+        nflops += A_JA[l+1] - A_JA[l];
+    }
+    rows = B_rows;
+    if(s->densify(nflops)) {
+        Weight one = 1;
+        for(uint32_t k = first; k < last; k++) {
+            uint32_t l = rows.next();
+            Weight w = (Values == GENERAL_VALUES) ? B_A[k] : ((Values == POW2_VALUES) ? one : B_value);
+            scatter_add<Weight>(A_IA + A_JA[l], A_A + A_JA[l], A_JA[l+1] - A_JA[l], w, s->A);
+        }
+    }
+    else {
+        for(uint32_t k = first; k < last; k++) {
+            uint32_t l = rows.next();
+            Weight w = (Values == GENERAL_VALUES) ? B_A[k] : B_value;
+            for(uint32_t m = A_JA[l]; m < A_JA[l+1]; m++) {
+                s->add(A_IA[m], (Values == POW2_VALUES) ? A_A[m] : w * A_A[m]);
+            }
+        }
+    }
+    return(nflops);
+}
+
+/* Accumulate column j of A*B with the kernel for the values of B */
+template<typename Weight, int Degree, int Indices>
+inline uint64_t SpMM_Col(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, uint32_t j, struct SpaVec<Weight> *s) {
+    struct RowStream<Indices> rows(B_CSC, j);
+    switch(B_CSC->values) {
+        case UNIFORM_VALUES: 
+            return(SpMM_Col<Weight, UNIFORM_VALUES, Degree, Indices>(A_CSC->JA, A_CSC->IA, A_CSC->A, B_CSC->JA, rows, B_CSC->A, B_CSC->value, j, s));
+        case POW2_VALUES:
+            return(SpMM_Col<Weight, POW2_VALUES, Degree, Indices>(A_CSC->JA, A_CSC->IA, A_CSC->A, B_CSC->JA, rows, B_CSC->A, B_CSC->value, j, s));
+        default:
+            return(SpMM_Col<Weight, GENERAL_VALUES, Degree, Indices>(A_CSC->JA, A_CSC->IA, A_CSC->A, B_CSC->JA, rows, B_CSC->A, B_CSC->value, j, s));
+    }
+}
+
+/* Accumulate column j of A*B with the kernel for the values and the indices of B */
+template<typename Weight, int Degree>
+inline uint64_t SpMM_Col(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, uint32_t j, struct SpaVec<Weight> *s) {
+    switch(B_CSC->indices) {
+        case SHORT_INDICES:
+            return(SpMM_Col<Weight, Degree, SHORT_INDICES>(A_CSC, B_CSC, j, s));
+        case DELTA_INDICES:
+            return(SpMM_Col<Weight, Degree, DELTA_INDICES>(A_CSC, B_CSC, j, s));
+        default:
+            return(SpMM_Col<Weight, Degree, WIDE_INDICES>(A_CSC, B_CSC, j, s));
+    }
+}
+
+/* Accumulate column j of A*B with the kernel for the values, the indices, and the fan-in of B */
+template<typename Weight>
+inline uint64_t SpMM_Col(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, uint32_t j, struct SpaVec<Weight> *s) {
+    if(B_CSC->degree == ELL_DEGREE) {
+        return(SpMM_Col<Weight, ELL_DEGREE>(A_CSC, B_CSC, j, s));
+    }
+    return(SpMM_Col<Weight, 0>(A_CSC, B_CSC, j, s));
+}
+
+/* Call f(l) for the rows l of column j of B in order */
+template<typename Weight, int Indices, typename Function>
+inline void SpMM_Rows(struct CSC<Weight> *B_CSC, uint32_t j, Function f) {
+    struct RowStream<Indices> rows(B_CSC, j);
+    for(uint32_t k = B_CSC->JA[j]; k < B_CSC->JA[j+1]; k++) {
+        f(rows.next());
+    }
+}
+
+template<typename Weight, typename Function>
+inline void SpMM_Rows(struct CSC<Weight> *B_CSC, uint32_t j, Function f) {
+    switch(B_CSC->indices) {
+        case SHORT_INDICES: SpMM_Rows<Weight, SHORT_INDICES>(B_CSC, j, f); break;
+        case DELTA_INDICES: SpMM_Rows<Weight, DELTA_INDICES>(B_CSC, j, f); break;
+        default:            SpMM_Rows<Weight, WIDE_INDICES>(B_CSC, j, f);
+    }
+}
+
+/* Flops of column j of A*B, the lengths of the columns of A it reads */
+template<typename Weight>
+inline uint64_t SpMM_Flops(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, uint32_t j) {
+    uint32_t *A_JA = A_CSC->JA;
+    uint64_t nflops = 0;
+    SpMM_Rows<Weight>(B_CSC, j, [&](uint32_t l) { nflops += A_JA[l+1] - A_JA[l]; });
+    return(nflops);
+}
+
+/* Scale of the column sums of the SPA, B_value if it was factored out of them */
+template<typename Weight>
+inline Accum<Weight> SpMM_Scale(struct CSC<Weight> *B_CSC) {
+    return((B_CSC->values == POW2_VALUES) ? B_CSC->value : 1);
+}
+
+/*
+ * Partition the column blocks of B among threads. STATIC gives every thread the same number
+ * of blocks. BALANCED and STEALING estimate the cost of each block from the pattern of B and 
+ * the column lengths of A (the flops of SpMM_Col plus a gather scan), then cut the prefix sum 
+ * of costs into equal parts. Every thread computes the same cut, so one barrier is enough.
+ */
+template<typename Weight>
+inline void SpMM_Schedule(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, int tid) {
+    uint32_t A_nrows = A_CSC->nrows;
+    uint32_t *B_JA = B_CSC->JA;
+    uint32_t B_ncols = B_CSC->ncols;
+    
+    int nthreads = omp_get_num_threads();
+    uint32_t nblocks = Env::nblocks;
+    uint32_t block_size = Env::block_size;
+    if(((uint64_t) nblocks * block_size < B_ncols) or ((uint64_t) (nblocks - 1) * block_size >= B_ncols)) {
+        fprintf(stderr, "Error: Column blocks do not cover %d columns [%d x %d]\n", B_ncols, nblocks, block_size);
+        exit(1);
+    }
+    
+    uint32_t start = ((uint64_t) nblocks * tid) / nthreads;
+    uint32_t end = ((uint64_t) nblocks * (tid + 1)) / nthreads;
+    if(Env::scheduling != Env::STATIC) {
+        uint32_t gather = (A_nrows / 64) + 1;
+        for(uint32_t b = start; b < end; b++) {
+            uint32_t first = b * block_size;
+            uint32_t last = std::min(first + block_size, B_ncols);
+            uint64_t work = 0;
+            for(uint32_t j = first; j < last; j++) {
+                work += gather + B_JA[j+1] - B_JA[j] + SpMM_Flops<Weight>(A_CSC, B_CSC, j);
+            }
+            Env::block_work[b] = work;
+        }
+        PROFILE_BARRIER(tid, SYMBOLIC);
+        uint64_t total = 0;
+        for(uint32_t b = 0; b < nblocks; b++) {
+            total += Env::block_work[b];
+        }
+        /* Block b goes to the thread whose share of the total holds the work before b */
+        uint64_t prefix = 0;
+        start = nblocks;
+        end = nblocks;
+        for(uint32_t b = 0; b < nblocks; b++) {
+            if((start == nblocks) and (prefix * nthreads >= total * tid)) {
+                start = b;
+            }
+            if(prefix * nthreads >= total * (tid + 1)) {
+                end = b;
+                break;
+            }
+            prefix += Env::block_work[b];
+        }
+        end = (tid == nthreads - 1) ? nblocks : end;
+        start = (start > end) ? end : start;
+    }
+    Env::start_block[tid] = start;
+    Env::end_block[tid] = end;
+    Env::start_col[tid] = std::min(start * block_size, B_ncols);
+    Env::end_col[tid] = std::min(end * block_size, B_ncols);
+    Env::block_queue[tid].store(((uint64_t) start << 32) | end, std::memory_order_release);
+}
+
+template<typename Weight>
+inline void SpMM_Sym(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, struct CSC<Weight> *C_CSC, 
+                     struct SpaVec<Weight> *s, int tid) { 
+    uint32_t *A_JA = A_CSC->JA;
+    uint32_t *A_IA = A_CSC->IA;      
+    Weight   *A_A  = A_CSC->A;
+    uint32_t A_nrows = A_CSC->nrows;  
+    uint32_t A_ncols = A_CSC->ncols;
+    
+    uint32_t B_nrows = B_CSC->nrows;  
+    uint32_t B_ncols = B_CSC->ncols;
+    
+    uint64_t nnzmax = 0;        
+    if(A_ncols != B_nrows) {
+        fprintf(stderr, "Error: SpMM dimensions do not agree A[%d %d] B[%d %d]\n", A_nrows, A_ncols, B_nrows, B_ncols);
+        exit(1);
+    }
+
+    Env::env_unset(tid);
+    SpMM_Schedule<Weight>(A_CSC, B_CSC, tid);
+    uint32_t start = Env::start_col[tid];
+    uint32_t end = Env::end_col[tid];
+    uint64_t nnzmax_local = 0;
+    
+    for(uint32_t j = start; j < end; j++) {
+        uint64_t nflops = SpMM_Flops<Weight>(A_CSC, B_CSC, j);
+        if(s->densify(nflops)) {
+            SpMM_Rows<Weight>(B_CSC, j, [&](uint32_t l) {
+                for(uint32_t m = A_JA[l]; m < A_JA[l+1]; m++) {
+                    s->insert_dense(A_IA[m]);
+                }
+            });
+        }
+        else {
+            SpMM_Rows<Weight>(B_CSC, j, [&](uint32_t l) {
+                for(uint32_t m = A_JA[l]; m < A_JA[l+1]; m++) {
+                    s->insert(A_IA[m]);
+                }
+            });
+        }
+        nnzmax_local += s->count_reset();
+    }
+    Env::length_nnz[tid] = nnzmax_local;
+        
+    PROFILE_BARRIER(tid, SYMBOLIC);
+    if(!tid) {
+        double begin = Trace::now();
+        nnzmax = Env::env_set();
+        Trace::span(tid, Trace::ENV_SET, begin);
+        uint32_t nrows = A_CSC->nrows;
+        uint32_t ncols = B_CSC->ncols;        
+        begin = Trace::now();
+        C_CSC->initialize(nrows, ncols, nnzmax);
+        Trace::span(tid, Trace::INITIALIZE, begin);
+    }
+    PROFILE_BARRIER(tid, SYMBOLIC);
+}
+
+template<typename Weight>
+inline void SpMM(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, struct CSC<Weight> *C_CSC,
+                  struct SpaVec<Weight> *s, struct DenseVec<Weight> *b, int tid) {  
+    uint32_t A_nrows = A_CSC->nrows;  
+    uint32_t A_ncols = A_CSC->ncols;    
+    
+    uint32_t B_nrows = B_CSC->nrows;
+    uint32_t B_ncols = B_CSC->ncols;
+
+    uint32_t C_nrows = C_CSC->nrows;
+    uint32_t C_ncols = C_CSC->ncols;;       
+                 
+    uint32_t b_nitems = b->nitems;
+    
+    if((A_ncols != B_nrows) or (A_nrows != C_nrows) or (B_ncols != C_ncols)) {
+        fprintf(stderr, "Error: SpMM dimensions do not agree C[%d %d] != A[%d %d] B[%d %d]\n", C_nrows, C_ncols, A_nrows, A_ncols, B_nrows, B_ncols);
+        exit(1);
+    }
+    
+    if(C_ncols != b_nitems) {
+        fprintf(stderr, "Error: SpMV_EW dimensions do not agree [%d != %d]\n", C_ncols, b_nitems);
+        exit(1);
+    }
+
+    uint32_t start = Env::start_col[tid];
+    uint32_t end = Env::end_col[tid];
+
+    if(B_CSC->values == POW2_VALUES) {
+        fprintf(stderr, "Error: SpMM cannot scale factored column sums\n");
+        exit(1);
+    }
+    for(uint32_t j = start; j < end; j++) {
+        SpMM_Col<Weight>(A_CSC, B_CSC, j, s);
+        C_CSC->spapopulate_t(b, s, j, tid);
+    }
+    PROFILE_NNZ_OUT(tid, Env::offset_nnz[tid] - Env::start_nnz[tid]);
+    PROFILE_BARRIER(tid, NUMERIC);
+    C_CSC->postpopulate_t(tid);
+    PROFILE_PHASE(tid, POPULATE);
+    A_CSC->repopulate(C_CSC, tid);
+    PROFILE_BARRIER(tid, REPOPULATE);
+}
+
+/*
+ * Fused SpMM: a single numeric pass with no symbolic pass and no repopulate copy.
+ * Columns are processed in blocks (see SpMM_Schedule). Each thread appends the columns of 
+ * a block (bias, ReLU, and clamp applied) to its own segment, records where the block went,
+ * and leaves column counts in C_JA. With STEALING an idle thread takes blocks from the back
+ * of other threads' ranges. Then the master prefix sums block sizes, grows C to the total nnz,
+ * and every thread copies the blocks of its range from whichever segment holds them to their
+ * offset in C and prefix sums C_JA over them, so C is in column order whoever ran a block.
+ * A is only read and C is only written, so the caller can swap them for the next layer.
+ */
+template<typename Weight>
+inline void SpMM_Fused(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, struct CSC<Weight> *C_CSC,
+                       struct SpaVec<Weight> *s, struct DenseVec<Weight> *b, 
+                       std::vector<struct Segment<Weight>*> &segments, int tid) {  
+    uint32_t A_nrows = A_CSC->nrows;  
+    uint32_t A_ncols = A_CSC->ncols;    
+    
+    uint32_t B_nrows = B_CSC->nrows;
+    uint32_t B_ncols = B_CSC->ncols;
+
+    uint32_t C_nrows = C_CSC->nrows;
+    uint32_t C_ncols = C_CSC->ncols;
+    uint32_t *C_JA = C_CSC->JA;
+                 
+    uint32_t b_nitems = b->nitems;
+    Accum<Weight> *b_A = b->A;
+    
+    if((A_ncols != B_nrows) or (A_nrows != C_nrows) or (B_ncols != C_ncols)) {
+        fprintf(stderr, "Error: SpMM dimensions do not agree C[%d %d] != A[%d %d] B[%d %d]\n", C_nrows, C_ncols, A_nrows, A_ncols, B_nrows, B_ncols);
+        exit(1);
+    }
+    
+    if(C_ncols != b_nitems) {
+        fprintf(stderr, "Error: SpMV_EW dimensions do not agree [%d != %d]\n", C_ncols, b_nitems);
+        exit(1);
+    }
+    
+    SpMM_Schedule<Weight>(A_CSC, B_CSC, tid);
+    PROFILE_PHASE(tid, SYMBOLIC);
+    
+    int nthreads = omp_get_num_threads();
+    uint32_t block_size = Env::block_size;
+    struct Segment<Weight> *segment = segments[tid];
+    Accum<Weight> YMIN = 0;
+    Accum<Weight> YMAX = 32;
+    Accum<Weight> scale = SpMM_Scale<Weight>(B_CSC);
+    auto run_block = [&](uint32_t block) {
+        uint32_t first = block * block_size;
+        uint32_t last = std::min(first + block_size, B_ncols);
+        Env::block_tid[block] = tid;
+        Env::block_offset[block] = segment->nnz;
+        for(uint32_t j = first; j < last; j++) {
+            uint64_t nflops = SpMM_Col<Weight>(A_CSC, B_CSC, j, s);
+            segment->reserve(segment->nnz + ((nflops < A_nrows) ? nflops : A_nrows) + SIMD_SLACK);
+            uint32_t *seg_IA = segment->IA + segment->nnz;
+            Weight   *seg_A  = segment->A + segment->nnz;
+            uint64_t n = s->gather_relu_reset(seg_IA, seg_A, scale, b_A[j], YMIN, YMAX);
+            C_JA[j+1] = n;
+            segment->nnz += n;
+        }
+        Env::block_nnz[block] = segment->nnz - Env::block_offset[block];
+    };
+    
+    double time = omp_get_wtime();
+    segment->clear();
+    uint32_t block = 0;
+    while(Env::pop_block(tid, block, false)) {
+        run_block(block);
+    }
+    if(Env::scheduling == Env::STEALING) {
+        for(int i = 1; i < nthreads; i++) {
+            int victim = (tid + i) % nthreads;
+            while(Env::pop_block(victim, block, true)) {
+                run_block(block);
+                Env::stolen_blocks[tid]++;
+            }
+        }
+    }
+    Env::busy_time[tid] = omp_get_wtime() - time;
+    PROFILE_NNZ_OUT(tid, segment->nnz);
+    
+    PROFILE_BARRIER(tid, NUMERIC);
+    if(!tid) {
+        uint64_t nnz = 0;
+        for(uint32_t i = 0; i < Env::nblocks; i++) {
+            Env::block_out[i] = nnz;
+            nnz += Env::block_nnz[i];
+        }
+        Env::block_out[Env::nblocks] = nnz;
+        double begin = Trace::now();
+        C_CSC->reserve(nnz);
+        Trace::span(tid, Trace::RESERVE, begin);
+        C_CSC->nnz = nnz;
+        C_CSC->idx = nnz;
+        C_JA[0] = 0;
+        Env::imbalance();
+    }
+    PROFILE_BARRIER(tid, POPULATE);
+    
+    for(uint32_t i = Env::start_block[tid]; i < Env::end_block[tid]; i++) {
+        struct Segment<Weight> *source = segments[Env::block_tid[i]];
+        uint64_t offset = Env::block_out[i];
+        memcpy(C_CSC->IA + offset, source->IA + Env::block_offset[i], Env::block_nnz[i] * sizeof(uint32_t));
+        memcpy(C_CSC->A + offset, source->A + Env::block_offset[i], Env::block_nnz[i] * sizeof(Weight));
+        uint32_t first = i * block_size;
+        uint32_t last = std::min(first + block_size, B_ncols);
+        for(uint32_t j = first; j < last; j++) {
+            offset += C_JA[j+1];
+            C_JA[j+1] = offset;
+        }
+    }
+    PROFILE_BARRIER(tid, REPOPULATE);
+}
+
+/*
+ * Serial SpMM: one thread computes all columns of C straight into C (bias, ReLU, and clamp
+ * applied), for A and C private to the thread (a row block of Y in the pipelined executor).
+ * Columns are accumulated and compacted as in SpMM_Fused, so results are the same.
+ */
+template<typename Weight>
+inline void SpMM_Serial(struct CSC<Weight> *A_CSC, struct CSC<Weight> *B_CSC, struct CSC<Weight> *C_CSC,
+                        struct SpaVec<Weight> *s, struct DenseVec<Weight> *b) {
+    uint32_t A_nrows = A_CSC->nrows;
+    uint32_t A_ncols = A_CSC->ncols;
+    uint32_t B_nrows = B_CSC->nrows;
+    uint32_t B_ncols = B_CSC->ncols;
+    uint32_t C_nrows = C_CSC->nrows;
+    uint32_t C_ncols = C_CSC->ncols;
+    uint32_t b_nitems = b->nitems;
+    Accum<Weight> *b_A = b->A;
+
+    if((A_ncols != B_nrows) or (A_nrows != C_nrows) or (B_ncols != C_ncols)) {
+        fprintf(stderr, "Error: SpMM dimensions do not agree C[%d %d] != A[%d %d] B[%d %d]\n", C_nrows, C_ncols, A_nrows, A_ncols, B_nrows, B_ncols);
+        exit(1);
+    }
+
+    if(C_ncols != b_nitems) {
+        fprintf(stderr, "Error: SpMV_EW dimensions do not agree [%d != %d]\n", C_ncols, b_nitems);
+        exit(1);
+    }
+
+    Accum<Weight> YMIN = 0;
+    Accum<Weight> YMAX = 32;
+    Accum<Weight> scale = SpMM_Scale<Weight>(B_CSC);
+    uint64_t nnz = 0;
+    C_CSC->JA[0] = 0;
+    for(uint32_t j = 0; j < B_ncols; j++) {
+        uint64_t nflops = SpMM_Col<Weight>(A_CSC, B_CSC, j, s);
+        C_CSC->reserve(nnz + ((nflops < A_nrows) ? nflops : A_nrows) + SIMD_SLACK);
+        uint32_t *C_IA = C_CSC->IA + nnz;
+        Weight   *C_A  = C_CSC->A + nnz;
+        nnz += s->gather_relu_reset(C_IA, C_A, scale, b_A[j], YMIN, YMAX);
+        C_CSC->JA[j+1] = nnz;
+    }
+    C_CSC->nnz = nnz;
+    C_CSC->idx = nnz;
+}
+
+/*
+ * Call f(i, value) for the stored entries of column l of a blocked A, whatever the format of its block.
+ * Dense blocks give every row, zeros included, so f must be an add (zeros leave sums unchanged).
+ */
+template<typename Weight, typename Function>
+inline void SpMM_Visit(struct BlockedCSC<Weight> *A_BCSC, uint32_t l, Function f) {
+    uint32_t block = l / A_BCSC->block_size;
+    uint32_t c = l % A_BCSC->block_size;
+    uint32_t *A_JA = A_BCSC->JA[block].data();
+    struct Segment<Weight> *A_segment = A_BCSC->segments[block];
+    uint32_t *A_IA = A_segment->IA;
+    Weight   *A_A  = A_segment->A;
+    if(A_BCSC->formats[block] == SPARSE_BLOCK) {
+        for(uint32_t m = A_JA[c]; m < A_JA[c+1]; m++) {
+            f(A_IA[m], A_A[m]);
+        }
+    }
+    else if(A_BCSC->formats[block] == BITMAP_BLOCK) {
+        uint32_t nwords = A_BCSC->nwords;
+        uint64_t *words = A_BCSC->bitmaps[block].data() + (uint64_t) c * nwords;
+        uint32_t m = A_JA[c];
+        for(uint32_t w = 0; w < nwords; w++) {
+            for(uint64_t word = words[w]; word; word &= (word - 1)) {
+                f((w << 6) + __builtin_ctzll(word), A_A[m]);
+                m++;
+            }
+        }
+    }
+    else {
+        uint32_t nrows = A_BCSC->nrows;
+        Weight *column = A_A + A_JA[c];
+        for(uint32_t i = 0; i < nrows; i++) {
+            f(i, column[i]);
+        }
+    }
+}
+
+/* 
+ * Accumulate column j of A*B into the dense vector T, A in column blocks (sparse-W x dense-Y is an axpy per entry of W),
+ * returns the number of flops. With a fixed fan-in Degree and all the columns of A it reads dense, the axpys are 
+ * fused into one pass over T.
+ */
+template<typename Weight, int Values, int Degree>
+inline uint64_t SpMM_Col(struct BlockedCSC<Weight> *A_BCSC, uint32_t *B_JA, uint32_t *B_IA, Weight *B_A, Weight B_value,
+                         uint32_t j, Accum<Weight> *T) {
+    if(Degree) {
+        uint32_t first = B_JA[j];
+        if(B_JA[j+1] == first) {
+            return(0);
+        }
+        uint32_t A_block_size = A_BCSC->block_size;
+        const Weight *columns[(Degree) ? Degree : 1];
+        Weight ws[(Degree) ? Degree : 1];
+        bool dense = true;
+        for(uint32_t k = 0; k < Degree; k++) {
+            uint32_t l = B_IA[first + k];
+            uint32_t block = l / A_block_size;
+            dense = dense and (A_BCSC->formats[block] == DENSE_BLOCK);
+            columns[k] = A_BCSC->segments[block]->A + A_BCSC->JA[block][l % A_block_size];
+            ws[k] = (Values == GENERAL_VALUES) ? B_A[first + k] : ((Values == POW2_VALUES) ? 1 : B_value);
+        }
+        if(dense) {
+            ell_axpy<Degree>(columns, ws, T, A_BCSC->nrows);
+            return((uint64_t) Degree * A_BCSC->nrows);
+        }
+    }
+    uint64_t nflops = 0;
+    for(uint32_t k = B_JA[j]; k < B_JA[j+1]; k++) {
+        Weight w = (Values == GENERAL_VALUES) ? B_A[k] : B_value;
+        SpMM_Visit<Weight>(A_BCSC, B_IA[k], [&](uint32_t i, Weight value) { T[i] += (Values == POW2_VALUES) ? value : w * value; nflops++; });
+    }
+    return(nflops);
+}
+
+/* SpMM_Col with A in column blocks, the SPA adds densely if any column of A it reads is dense */
+template<typename Weight, int Values, int Degree>
+inline uint64_t SpMM_Col(struct BlockedCSC<Weight> *A_BCSC, uint32_t *B_JA, uint32_t *B_IA, Weight *B_A, Weight B_value,
+                         uint32_t j, struct SpaVec<Weight> *s) {
+    uint32_t A_block_size = A_BCSC->block_size;
+    uint64_t nflops = 0;
+    bool dense_input = false;
+    for(uint32_t k = B_JA[j]; k < B_JA[j+1]; k++) {
+        uint32_t l = B_IA[k];
+        uint32_t *A_JA = A_BCSC->JA[l / A_block_size].data();
+        uint32_t c = l % A_block_size;
+        nflops += A_JA[c+1] - A_JA[c];
+        dense_input = dense_input or (A_BCSC->formats[l / A_block_size] == DENSE_BLOCK);
+    }
+    if(s->densify(nflops, dense_input)) {
+        SpMM_Col<Weight, Values, Degree>(A_BCSC, B_JA, B_IA, B_A, B_value, j, s->A);
+    }
+    else {
+        for(uint32_t k = B_JA[j]; k < B_JA[j+1]; k++) {
+            Weight w = (Values == GENERAL_VALUES) ? B_A[k] : B_value;
+            SpMM_Visit<Weight>(A_BCSC, B_IA[k], [&](uint32_t i, Weight value) { s->add(i, (Values == POW2_VALUES) ? value : w * value); });
+        }
+    }
+    return(nflops);
+}
+
+template<typename Weight, int Degree, typename Target>
+inline uint64_t SpMM_Col(struct BlockedCSC<Weight> *A_BCSC, struct CSC<Weight> *B_CSC, uint32_t j, Target t) {
+    switch(B_CSC->values) {
+        case UNIFORM_VALUES: 
+            return(SpMM_Col<Weight, UNIFORM_VALUES, Degree>(A_BCSC, B_CSC->JA, B_CSC->IA, B_CSC->A, B_CSC->value, j, t));
+        case POW2_VALUES:
+            return(SpMM_Col<Weight, POW2_VALUES, Degree>(A_BCSC, B_CSC->JA, B_CSC->IA, B_CSC->A, B_CSC->value, j, t));
+        default:
+            return(SpMM_Col<Weight, GENERAL_VALUES, Degree>(A_BCSC, B_CSC->JA, B_CSC->IA, B_CSC->A, B_CSC->value, j, t));
+    }
+}
+
+/* Accumulate column j of A*B into the SPA s, or into the dense vector T (returns 0) */
+template<typename Weight, typename Target>
+inline uint64_t SpMM_Col(struct BlockedCSC<Weight> *A_BCSC, struct CSC<Weight> *B_CSC, uint32_t j, Target t) {
+    if(B_CSC->degree == ELL_DEGREE) {
+        return(SpMM_Col<Weight, ELL_DEGREE, Target>(A_BCSC, B_CSC, j, t));
+    }
+    return(SpMM_Col<Weight, 0, Target>(A_BCSC, B_CSC, j, t));
+}
+
+/*
+ * Block SpMM for the blocked executors: computes the columns of one block of C = A*B 
+ * (bias, ReLU, and clamp applied) from a blocked A into the same block of a blocked C.
+ * Columns are accumulated in the same order as SpMM_Col, so the values are identical.
+ * A block that was dense the last time is accumulated straight into its dense columns with 
+ * no SPA round trip, other blocks go through the SPA as CSC. Then the block is reformatted
+ * for its density (a no-op unless C is hybrid).
+ */
+template<typename Weight>
+inline void SpMM_Block(struct BlockedCSC<Weight> *A_BCSC, struct CSC<Weight> *B_CSC, struct BlockedCSC<Weight> *C_BCSC,
+                       struct SpaVec<Weight> *s, struct DenseVec<Weight> *b, uint32_t block) {
+    uint32_t A_nrows = A_BCSC->nrows;
+    uint32_t A_ncols = A_BCSC->ncols;
+    
+    uint32_t B_nrows = B_CSC->nrows;
+    uint32_t B_ncols = B_CSC->ncols;
+    
+    uint32_t C_nrows = C_BCSC->nrows;
+    uint32_t C_ncols = C_BCSC->ncols;
+    uint32_t *C_JA = C_BCSC->JA[block].data();
+    struct Segment<Weight> *segment = C_BCSC->segments[block];
+    
+    Accum<Weight> *b_A = b->A;
+    
+    if((A_ncols != B_nrows) or (A_nrows != C_nrows) or (B_ncols != C_ncols) or (C_ncols != b->nitems)) {
+        fprintf(stderr, "Error: SpMM dimensions do not agree C[%d %d] != A[%d %d] B[%d %d]\n", C_nrows, C_ncols, A_nrows, A_ncols, B_nrows, B_ncols);
+        exit(1);
+    }
+    
+    Accum<Weight> YMIN = 0;
+    Accum<Weight> YMAX = 32;
+    Accum<Weight> scale = SpMM_Scale<Weight>(B_CSC);
+    uint32_t first = C_BCSC->block_first(block);
+    uint32_t last = C_BCSC->block_last(block);
+    segment->clear();
+    C_JA[0] = 0;
+    if(C_BCSC->formats[block] == DENSE_BLOCK) {
+        uint64_t nnz = 0;
+        segment->reserve_values((uint64_t) (last - first) * C_nrows);
+        for(uint32_t j = first; j < last; j++) {
+            Weight *column = segment->A + ((uint64_t) (j - first) * C_nrows);
+            Accum<Weight> *T = s->staging(column);
+            for(uint32_t i = 0; i < C_nrows; i++) {
+                T[i] = 0;
+            }
+            SpMM_Col<Weight>(A_BCSC, B_CSC, j, T);
+            nnz += relu_dense<Weight>(T, column, C_nrows, scale, b_A[j], YMIN, YMAX);
+            C_JA[j - first + 1] = (j - first + 1) * C_nrows;
+        }
+        segment->nnz = (uint64_t) (last - first) * C_nrows;
+        C_BCSC->nnz[block] = nnz;
+    }
+    else {
+        for(uint32_t j = first; j < last; j++) {
+            uint64_t nflops = SpMM_Col<Weight>(A_BCSC, B_CSC, j, s);
+            segment->reserve(segment->nnz + ((nflops < A_nrows) ? nflops : A_nrows) + SIMD_SLACK);
+            uint32_t *seg_IA = segment->IA + segment->nnz;
+            Weight   *seg_A  = segment->A + segment->nnz;
+            segment->nnz += s->gather_relu_reset(seg_IA, seg_A, scale, b_A[j], YMIN, YMAX);
+            C_JA[j - first + 1] = segment->nnz;
+        }
+        C_BCSC->formats[block] = SPARSE_BLOCK;
+        C_BCSC->nnz[block] = segment->nnz;
+    }
+    C_BCSC->reformat(block);
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,55 @@
+/*
+ * SpscQueue.hpp: Bounded lock-free queue between one producer and one consumer thread
+ * A ring of slots with a head owned by the consumer and a tail owned by the producer.
+ * A full or empty queue yields the thread, so stages also work with more threads than cores.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef SPSCQUEUE_HPP
+#define SPSCQUEUE_HPP
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+template<typename Data_Type>
+struct SpscQueue {
+    public:
+        SpscQueue(uint32_t capacity_) { capacity = ((capacity_) ? capacity_ : 1) + 1; slots.resize(capacity); head = 0; tail = 0; };
+        ~SpscQueue() {};
+        inline void push(Data_Type item);
+        inline Data_Type pop();
+        uint32_t capacity; // One slot stays empty to tell full from empty
+        std::vector<Data_Type> slots;
+        /* 64 bytes between fields so head and tail never share a cache line (new does not honour alignas(64) in C++14) */
+        char padding0[64];
+        std::atomic<uint32_t> head; // Next slot to pop
+        char padding1[64];
+        std::atomic<uint32_t> tail; // Next slot to push
+        char padding2[64];
+};
+
+template<typename Data_Type>
+inline void SpscQueue<Data_Type>::push(Data_Type item) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    uint32_t next = (t + 1) % capacity;
+    while(next == head.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+    slots[t] = item;
+    tail.store(next, std::memory_order_release);
+}
+
+template<typename Data_Type>
+inline Data_Type SpscQueue<Data_Type>::pop() {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    while(h == tail.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+    Data_Type item = slots[h];
+    head.store((h + 1) % capacity, std::memory_order_release);
+    return(item);
+}
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * Trace.hpp: Timeline of the run as Chrome trace events (-T), for chrome://tracing or Perfetto
+ * Every OpenMP thread, and the layer reader, keeps a ring of its last TRACE_EVENTS events: layers,
+ * the phases of SpMM and the waits at barriers (from the profile hooks, see Profile.hpp), and spans
+ * of serial work such as reading a layer, Env::env_set, and sizing C. Master-only sections show
+ * up as waits on the other threads. The blocked, pipelined, and tiled executors record a span per
+ * column block, batch, or tile of a layer, their row compaction, and their waits on other threads
+ * or queues. Only the calling thread writes its ring, so no locks.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+
+#include "Counters.hpp"
+
+/* Events kept per thread (a power of 2), older events are overwritten */
+#define TRACE_EVENTS (1 << 16)
+
+class Trace {
+    public:
+        /* Phases::Phase, then layers and spans */
+        enum Event {LAYER = Phases::NPHASES, READ, ENV_SET, INITIALIZE, RESERVE, BLOCK, BATCH, TILE, NEVENTS};
+        struct Record {
+            uint32_t event;
+            int32_t layer;
+            double begin;
+            double end;
+        };
+        struct Thread {
+            std::vector<struct Record> records;
+            uint64_t count; // Events ever recorded
+            double mark;    // End of the last phase or barrier
+            double start;   // Of the open layer
+            int32_t layer;  // Open layer, -1 if none
+            char padding[THREAD_PADDING];
+        };
+        static bool enabled;
+        static double origin;
+        static std::vector<struct Thread> threads; // OpenMP threads, then the reader
+        static const char *names[NEVENTS - Phases::NPHASES];
+
+        static void init(int nthreads);
+        static inline int reader() { return(threads.size() - 1); }
+        static inline double now() { return((enabled) ? omp_get_wtime() : 0); }
+        static inline void record(int tid, uint32_t event, int32_t layer, double begin, double end);
+        static inline void layer(int tid, int32_t layer);
+        static inline void phase(int tid, int phase);
+        static inline void span(int tid, int event, double begin, int32_t layer = -1);
+        static void write(std::string path);
+        static const char* name(uint32_t event);
+};
+bool Trace::enabled = false;
+double Trace::origin = 0;
+std::vector<struct Trace::Thread> Trace::threads;
+const char *Trace::names[Trace::NEVENTS - Phases::NPHASES] = {"layer", "read layer", "env_set", "initialize", "reserve", "block", "batch", "tile"};
+
+/* Rings of nthreads OpenMP threads and the reader, time starts now */
+void Trace::init(int nthreads) {
+    origin = omp_get_wtime();
+    threads.resize(nthreads + 1);
+    for(auto &thread : threads) {
+        thread.records.resize(TRACE_EVENTS);
+        thread.count = 0;
+        thread.mark = origin;
+        thread.layer = -1;
+    }
+}
+
+inline void Trace::record(int tid, uint32_t event, int32_t layer, double begin, double end) {
+    auto &thread = threads[tid];
+    struct Record &r = thread.records[thread.count & (TRACE_EVENTS - 1)];
+    r.event = event;
+    r.layer = layer;
+    r.begin = begin;
+    r.end = end;
+    thread.count++;
+}
+
+/* Close the open layer of a thread and open the next one */
+inline void Trace::layer(int tid, int32_t layer) {
+    if((not enabled) or (tid >= (int) threads.size())) {
+        return;
+    }
+    auto &thread = threads[tid];
+    double now = omp_get_wtime();
+    if(thread.layer != -1) {
+        record(tid, LAYER, thread.layer, thread.start, now);
+    }
+    thread.layer = layer;
+    thread.start = now;
+    thread.mark = now;
+}
+
+/* Time since the last mark goes to phase */
+inline void Trace::phase(int tid, int phase) {
+    if((not enabled) or (tid >= (int) threads.size()) or (threads[tid].layer == -1)) {
+        return;
+    }
+    auto &thread = threads[tid];
+    double now = omp_get_wtime();
+    record(tid, phase, thread.layer, thread.mark, now);
+    thread.mark = now;
+}
+
+/* Serial work from begin (see now) until now, in the open layer of the thread if layer is -1 */
+inline void Trace::span(int tid, int event, double begin, int32_t layer) {
+    if((not enabled) or (tid >= (int) threads.size())) {
+        return;
+    }
+    record(tid, event, (layer == -1) ? threads[tid].layer : layer, begin, omp_get_wtime());
+}
+
+const char* Trace::name(uint32_t event) {
+    return((event < Phases::NPHASES) ? Phases::names[event] : names[event - Phases::NPHASES]);
+}
+
+/* Events of all threads as complete ("X") events in microseconds, open layers are closed at their last mark */
+void Trace::write(std::string path) {
+    FILE *fd = fopen(path.c_str(), "w");
+    if(not fd) {
+        fprintf(stderr, "Error: Cannot open %s\n", path.c_str());
+        exit(1);
+    }
+    fprintf(fd, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    uint64_t nevents = 0;
+    uint64_t dropped = 0;
+    for(uint32_t t = 0; t < threads.size(); t++) {
+        auto &thread = threads[t];
+        if(thread.layer != -1) {
+            record(t, LAYER, thread.layer, thread.start, thread.mark);
+            thread.layer = -1;
+        }
+        std::string threadName = (t == threads.size() - 1) ? "reader" : "thread " + std::to_string(t);
+        fprintf(fd, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                (t) ? ",\n" : "", t, threadName.c_str());
+        uint64_t first = (thread.count > TRACE_EVENTS) ? thread.count - TRACE_EVENTS : 0;
+        for(uint64_t i = first; i < thread.count; i++) {
+            struct Record &r = thread.records[i & (TRACE_EVENTS - 1)];
+            fprintf(fd, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"layer\": %d}}",
+                    (r.event == LAYER) ? ("layer " + std::to_string(r.layer)).c_str() : name(r.event),
+                    (r.event < Phases::NPHASES) ? "phase" : name(r.event), t, (r.begin - origin) * 1e6, (r.end - r.begin) * 1e6, r.layer);
+        }
+        nevents += thread.count - first;
+        dropped += first;
+    }
+    fprintf(fd, "\n]}\n");
+    fclose(fd);
+    printf("INFO: Trace of %lu events (%lu dropped) of %lu threads written to %s\n", nevents, dropped, threads.size() - 1, path.c_str());
+}
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * bench.cpp: Micro-benchmarks of the SpMM kernels on synthetic RadiX-Net layers and images
+ * Times SpMM_Sym, SpMM, and the phases of SpMM (SpMM_Col, spapopulate_t, postpopulate_t,
+ * repopulate) for every thread count and image density, and the whole inference over -l layers.
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include "Triple.hpp"
+#include "DenseVec.hpp"
+#include "SpaVec.hpp"
+#include "SparseMat.hpp"
+#include "InferenceReLU.cpp"
+#include "Generator.hpp"
+#include "Fixed.hpp"
+#include "Env.hpp"
+#include "Simd.hpp"
+#include "Numa.hpp"
+
+/* Command line options */
+struct Options {
+    uint32_t Nneurons = 1024;
+    uint32_t maxLayers = 0; // Layers of the whole inference, 0 skips it
+    uint32_t fanin = 32;
+    uint32_t nimages = 4096;
+    double bias = -0.3;
+    uint32_t repeats = 5;
+    uint64_t seed = 1;
+    int indices = WIDE_INDICES; // Row indices of layers
+    std::vector<double> densities = {0.1, 0.2, 0.3};
+    std::vector<int> threads; // Powers of two up to the OpenMP maximum by default
+    std::string precision = "double";
+};
+
+/* Times of a kernel over the repeats */
+struct Timing {
+    double min = 0;
+    double sum = 0;
+    uint32_t count = 0;
+    void add(double t) { min = (count and (min < t)) ? min : t; sum += t; count++; }
+};
+
+/* Comma separated numbers */
+template<typename Data_Type>
+std::vector<Data_Type> parse_list(const char *arg) {
+    std::vector<Data_Type> list;
+    std::stringstream stream(arg);
+    std::string item;
+    while(std::getline(stream, item, ',')) {
+        list.push_back((Data_Type) atof(item.c_str()));
+    }
+    return(list);
+}
+
+inline double seconds(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point finish) {
+    return((double)(std::chrono::duration_cast< std::chrono::nanoseconds>(finish-start).count())/1e9);
+}
+
+/*
+ * One SpMM of images Y0 by W, repeated: SpMM_Sym and SpMM timed whole, then a second pass
+ * times the phases of SpMM. SpMM_Col and spapopulate_t interleave per column, so they are
+ * summed per thread (a clock read per column) and the slowest thread counts.
+ */
+template<typename WGT>
+void bench_spmm(struct Options &options, struct CSC<WGT> *Y0, struct CSC<WGT> *W, struct DenseVec<WGT> *b,
+                std::vector<struct SpaVec<WGT>*> &spa_VEC, std::vector<struct Timing> &timings) {
+    int nthreads = Env::nthreads;
+    struct CSC<WGT> *Y = new struct CSC<WGT>(Y0->nrows, Y0->ncols, Y0->nnz);
+    struct CSC<WGT> *Z = new struct CSC<WGT>(Y0->nrows, Y0->ncols, Y0->nnz);
+    std::vector<double> colTime(nthreads);
+    std::vector<double> gatherTime(nthreads);
+    for(uint32_t r = 0; r < options.repeats; r++) {
+        Y->repopulate(Y0);
+        #pragma omp parallel
+        {
+            int tid = omp_get_thread_num();
+            auto &s = spa_VEC[tid];
+            auto t0 = std::chrono::steady_clock::now();
+            SpMM_Sym<WGT>(Y, W, Z, s, tid);
+            auto t1 = std::chrono::steady_clock::now();
+            SpMM<WGT>(Y, W, Z, s, b, tid);
+            auto t2 = std::chrono::steady_clock::now();
+            if(!tid) {
+                timings[0].add(seconds(t0, t1));
+                timings[1].add(seconds(t1, t2));
+                Y->repopulate(Y0);
+            }
+            #pragma omp barrier
+            SpMM_Sym<WGT>(Y, W, Z, s, tid);
+            colTime[tid] = 0;
+            gatherTime[tid] = 0;
+            for(uint32_t j = Env::start_col[tid]; j < Env::end_col[tid]; j++) {
+                auto c0 = std::chrono::steady_clock::now();
+                SpMM_Col<WGT>(Y, W, j, s);
+                auto c1 = std::chrono::steady_clock::now();
+                Z->spapopulate_t(b, s, j, tid);
+                auto c2 = std::chrono::steady_clock::now();
+                colTime[tid] += seconds(c0, c1);
+                gatherTime[tid] += seconds(c1, c2);
+            }
+            #pragma omp barrier
+            auto t3 = std::chrono::steady_clock::now();
+            Z->postpopulate_t(tid);
+            #pragma omp barrier
+            auto t4 = std::chrono::steady_clock::now();
+            Y->repopulate(Z, tid);
+            #pragma omp barrier
+            auto t5 = std::chrono::steady_clock::now();
+            if(!tid) {
+                timings[2].add(*std::max_element(colTime.begin(), colTime.end()));
+                timings[3].add(*std::max_element(gatherTime.begin(), gatherTime.end()));
+                timings[4].add(seconds(t3, t4));
+                timings[5].add(seconds(t4, t5));
+            }
+        }
+    }
+    delete Y;
+    delete Z;
+}
+
+/* Multiply-adds of Y0 x W */
+template<typename WGT>
+uint64_t spmm_flops(struct CSC<WGT> *Y0, struct CSC<WGT> *W) {
+    uint64_t nflops = 0;
+    for(uint32_t j = 0; j < W->ncols; j++) {
+        nflops += SpMM_Flops<WGT>(Y0, W, j);
+    }
+    return(nflops);
+}
+
+template<typename WGT>
+int bench(struct Options &options) {
+    uint32_t Nneurons = options.Nneurons;
+    uint32_t maxLayers = options.maxLayers;
+    const char *kernels[] = {"SpMM_Sym", "SpMM", "SpMM_Col", "spapopulate_t", "postpopulate_t", "repopulate"};
+    uint32_t nkernels = sizeof(kernels) / sizeof(kernels[0]);
+
+    auto start = std::chrono::steady_clock::now();
+    uint32_t nlayers = std::max(maxLayers, (uint32_t) 1);
+    std::vector<struct CSC<WGT>*> layersSpMat(nlayers);
+    std::vector<struct DenseVec<WGT>*> biasesDenseVec(nlayers);
+    uint64_t DNNedges = 0;
+    uint64_t indexBytes = 0;
+    for(uint32_t i = 0; i < nlayers; i++) {
+        layersSpMat[i] = radixnet_layer<WGT>(Nneurons, options.fanin, i, GENERATOR_WEIGHT);
+        layersSpMat[i]->compact(options.indices);
+        indexBytes += (layersSpMat[i]->IC_blk) ? layersSpMat[i]->IC_blk->nitems : layersSpMat[i]->nnz * sizeof(uint32_t);
+        biasesDenseVec[i] = new struct DenseVec<WGT>(Nneurons + 1);
+        for(uint32_t j = 1; j < Nneurons + 1; j++) {
+            biasesDenseVec[i]->A[j] = options.bias;
+        }
+        DNNedges += layersSpMat[i]->nnz;
+    }
+    std::vector<struct CSC<WGT>*> imagesSpMat;
+    for(double density : options.densities) {
+        imagesSpMat.push_back(sparse_images<WGT>(options.nimages, Nneurons, density, options.seed));
+    }
+    auto finish = std::chrono::steady_clock::now();
+    printf("INFO: Generated %d layers of %d neurons with fan-in %d (edges:%lu), and %d images at %lu densities in %f sec\n",
+            nlayers, Nneurons, options.fanin, DNNedges, options.nimages, options.densities.size(), seconds(start, finish));
+    const char *indicesNames[] = {"wide", "short", "delta"};
+    printf("INFO: Layers with %s row indices: %d of %d, %.2f bytes per row index\n", indicesNames[options.indices],
+            (uint32_t) std::count_if(layersSpMat.begin(), layersSpMat.end(), [&](struct CSC<WGT> *W) { return(W->indices == options.indices); }),
+            nlayers, (double) indexBytes / DNNedges);
+
+    printf("INFO: %-15s %7s %8s %12s %12s %12s\n", "kernel", "threads", "density", "min (ms)", "mean (ms)", "GFLOP/s");
+    for(int nthreads : options.threads) {
+        omp_set_num_threads(nthreads);
+        Numa::init();
+        Env::init();
+        Env::init_blocks(Nneurons + 1);
+        std::vector<struct SpaVec<WGT>*> spa_VEC(Env::nthreads);
+        #pragma omp parallel
+        {
+            int tid = omp_get_thread_num();
+            spa_VEC[tid] = new struct SpaVec<WGT>(options.nimages + 1);
+        }
+        for(uint32_t d = 0; d < options.densities.size(); d++) {
+            auto *Y0 = imagesSpMat[d];
+            uint64_t nflops = spmm_flops<WGT>(Y0, layersSpMat[0]);
+            std::vector<struct Timing> timings(nkernels);
+            bench_spmm<WGT>(options, Y0, layersSpMat[0], biasesDenseVec[0], spa_VEC, timings);
+            for(uint32_t k = 0; k < nkernels; k++) {
+                std::string gflops = (k == 1) ? std::to_string((2.0 * nflops) / timings[k].min / 1e9) : "";
+                printf("INFO: %-15s %7d %8.3f %12.4f %12.4f %12s\n", kernels[k], nthreads, options.densities[d],
+                        1e3 * timings[k].min, 1e3 * timings[k].sum / timings[k].count, gflops.c_str());
+            }
+            if(maxLayers) {
+                struct CSC<WGT> *featuresSpMat = new struct CSC<WGT>(Y0->nrows, Y0->ncols, Y0->nnz);
+                featuresSpMat->repopulate(Y0);
+                #pragma omp parallel
+                {
+                    int tid = omp_get_thread_num();
+                    spa_VEC[tid]->resize(options.nimages + 1); // Shrunk by dead image elimination
+                }
+                std::vector<uint32_t> rowIds(featuresSpMat->nrows);
+                for(uint32_t i = 0; i < featuresSpMat->nrows; i++) {
+                    rowIds[i] = i;
+                }
+                start = std::chrono::steady_clock::now();
+                inferenceReLU<WGT>(layersSpMat, biasesDenseVec, featuresSpMat, spa_VEC, rowIds);
+                finish = std::chrono::steady_clock::now();
+                double runTime = seconds(start, finish);
+                printf("INFO: %-15s %7d %8.3f %12.4f %12s %12s run rate (edges/sec): %f\n", "inferenceReLU", nthreads, options.densities[d],
+                        1e3 * runTime, "", "", options.nimages * (DNNedges / runTime));
+                delete featuresSpMat;
+            }
+        }
+        for(auto *s : spa_VEC) {
+            delete s;
+        }
+    }
+
+    for(uint32_t i = 0; i < nlayers; i++) {
+        delete layersSpMat[i];
+        delete biasesDenseVec[i];
+    }
+    for(auto *Y0 : imagesSpMat) {
+        delete Y0;
+    }
+    return(0);
+}
+
+void usage(char *name) {
+    fprintf(stderr, "USAGE: %s [-n <Nneurons>] [-k <fanin>] [-l <maxLayers>] [-i <images>] [-d <densities>] [-t <threads>] [-r <repeats>] [-x <bias>] [-s <seed>] [-z <indices>] [-p <precision>] [-b <scheduling>]\n", name);
+    fprintf(stderr, "    -n <Nneurons>  : Neurons per layer (default 1024)\n");
+    fprintf(stderr, "    -k <fanin>     : Connections into every neuron (default 32)\n");
+    fprintf(stderr, "    -l <maxLayers> : Also time the whole inference over <maxLayers> layers (default 0, skipped)\n");
+    fprintf(stderr, "    -i <images>    : Images (default 4096)\n");
+    fprintf(stderr, "    -d <densities> : Comma separated shares of pixels set (default 0.1,0.2,0.3)\n");
+    fprintf(stderr, "    -t <threads>   : Comma separated thread counts (default powers of two up to OMP_NUM_THREADS)\n");
+    fprintf(stderr, "    -r <repeats>   : Runs of every kernel, the fastest and the mean are printed (default 5)\n");
+    fprintf(stderr, "    -x <bias>      : Bias of every neuron (default -0.3)\n");
+    fprintf(stderr, "    -s <seed>      : Seed of the images (default 1)\n");
+    fprintf(stderr, "    -z <indices>   : Row indices of layers wide|short|delta (default wide)\n");
+    fprintf(stderr, "    -p <precision> : Weights and activations in float|double|fixed (default double)\n");
+    fprintf(stderr, "    -b <scheduling>: Column scheduling static|balanced|stealing (default stealing)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct Options options;
+    printf("INFO: Welcome to Sparse Deep Neural Network Micro-benchmarks\n");
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:k:l:i:d:t:r:x:s:z:p:b:")) != -1) {
+        switch(opt) {
+            case 'n': options.Nneurons = atoi(optarg); break;
+            case 'k': options.fanin = atoi(optarg); break;
+            case 'l': options.maxLayers = atoi(optarg); break;
+            case 'i': options.nimages = atoi(optarg); if(not options.nimages) usage(argv[0]); break;
+            case 'd': options.densities = parse_list<double>(optarg); break;
+            case 't': options.threads = parse_list<int>(optarg); break;
+            case 'r': options.repeats = atoi(optarg); if(not options.repeats) usage(argv[0]); break;
+            case 'x': options.bias = atof(optarg); break;
+            case 's': options.seed = strtoull(optarg, nullptr, 10); break;
+            case 'z':
+                if(!strcmp(optarg, "wide")) options.indices = WIDE_INDICES;
+                else if(!strcmp(optarg, "short")) options.indices = SHORT_INDICES;
+                else if(!strcmp(optarg, "delta")) options.indices = DELTA_INDICES;
+                else usage(argv[0]);
+                break;
+            case 'p':
+                options.precision = optarg;
+                if((options.precision != "float") and (options.precision != "double") and (options.precision != "fixed")) usage(argv[0]);
+                break;
+            case 'b':
+                if(!strcmp(optarg, "static")) Env::scheduling = Env::STATIC;
+                else if(!strcmp(optarg, "balanced")) Env::scheduling = Env::BALANCED;
+                else if(!strcmp(optarg, "stealing")) Env::scheduling = Env::STEALING;
+                else usage(argv[0]);
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if((optind != argc) or (not options.Nneurons) or options.densities.empty()) {
+        usage(argv[0]);
+    }
+    if(options.threads.empty()) {
+        int maxThreads = omp_get_max_threads();
+        for(int t = 1; t < maxThreads; t *= 2) {
+            options.threads.push_back(t);
+        }
+        options.threads.push_back(maxThreads);
+    }
+    for(int t : options.threads) {
+        if(t < 1) {
+            usage(argv[0]);
+        }
+    }
+
+    printf("INFO: Precision %s, SIMD %s\n", options.precision.c_str(), simd_name());
+    int status = 0;
+    if(options.precision == "float") {
+        status = bench<float>(options);
+    }
+    else if(options.precision == "fixed") {
+        status = bench<Fixed>(options);
+    }
+    else {
+        status = bench<double>(options);
+    }
+    return(status);
+}
@@ -0,0 +1,107 @@
+/*
+ * convert.cpp: Convert challenge TSV files to binary CSC caches
+ * that main maps directly instead of parsing and sorting triples
+ * (c) Mohammad Hasanzadeh Mofrad, 2019
+ * (e) m.hasanzadeh.mofrad@gmail.com
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+#include "Triple.hpp"
+#include "DenseVec.hpp"
+#include "SparseMat.hpp"
+#include "Reader.hpp"
+#include "Cache.hpp"
+
+/* Convert the features and layer files to caches of WGT weights */
+template<typename WGT>
+int convert(uint32_t Nneurons, uint32_t maxLayers, std::string inputPath, std::string dnnPath) {
+    auto start = std::chrono::high_resolution_clock::now();
+    std::string featuresFile = features_file(inputPath, Nneurons);
+    std::string featuresCache = features_file(inputPath, Nneurons, cache_ext<WGT>());
+    printf("INFO: Start converting the features file %s\n", featuresFile.c_str());
+    uint64_t nrowsFeatures = 0; 
+    uint64_t ncolsFeatures = 0;
+    std::vector<struct Triple<WGT>> featuresTriples;
+    read_triples<WGT>(featuresFile, featuresTriples, nrowsFeatures, ncolsFeatures);
+    struct CSC<WGT> *featuresSpMat = new struct CSC<WGT>((nrowsFeatures + 1), (Nneurons + 1), featuresTriples.size(), featuresTriples);
+    featuresTriples.clear();
+    featuresTriples.shrink_to_fit();
+    write_cache<WGT>(featuresSpMat, featuresCache);
+    delete featuresSpMat;
+    printf("INFO: Done  converting the features file %s\n", featuresCache.c_str());
+    
+    uint64_t DNNedges = 0;
+    printf("INFO: Start converting %d layer files\n", maxLayers);
+    #pragma omp parallel reduction(+:DNNedges)
+    {
+        std::vector<struct Triple<WGT>> layerTriples;
+        #pragma omp for schedule(dynamic)
+        for(uint32_t i = 0; i < maxLayers; i++) {  
+            std::string layerFile = layer_file(dnnPath, Nneurons, i+1);
+            std::string layerCache = layer_file(dnnPath, Nneurons, i+1, cache_ext<WGT>());
+            uint64_t nrows = 0;
+            uint64_t ncols = 0;
+            read_triples<WGT>(layerFile, layerTriples, nrows, ncols);
+            struct CSC<WGT> *layerSpMat = new struct CSC<WGT>((Nneurons + 1), (ncols + 1), layerTriples.size(), layerTriples);
+            DNNedges += layerSpMat->nnz;
+            write_cache<WGT>(layerSpMat, layerCache);
+            delete layerSpMat;
+        }
+    }
+    auto finish = std::chrono::high_resolution_clock::now();
+    printf("INFO: Done  converting %d layer files\n", maxLayers);
+    double convertTime = (double)(std::chrono::duration_cast< std::chrono::nanoseconds>(finish-start).count())/1e9;
+    printf("INFO: DNN neurons/layer: %d, layers:%d, edges:%lu\n", Nneurons, maxLayers, DNNedges);
+    printf("INFO: Convert time (sec): %f\n", convertTime);
+    
+    return(0);
+}
+
+void usage(char *name) {
+    fprintf(stderr, "USAGE: %s -n <Nneurons> -l <maxLayers> [-p <precision>] <path_to_input> <path_to_dnn>\n", name);
+    fprintf(stderr, "    -p <precision>: Weights in float|double|fixed (default double)\n");
+    fprintf(stderr, "Caches older than their TSV files are ignored by main, convert again after changing them\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    printf("INFO: Welcome to Sparse Deep Neural Network cache converter\n");
+    
+    uint32_t Nneurons = 0;
+    uint32_t maxLayers = 0;
+    std::string precision = "double";
+    int opt;
+    while((opt = getopt(argc, argv, "n:l:p:")) != -1) {
+        switch(opt) {
+            case 'n': Nneurons = atoi(optarg); break;
+            case 'l': maxLayers = atoi(optarg); break;
+            case 'p':
+                precision = optarg;
+                if((precision != "float") and (precision != "double") and (precision != "fixed")) usage(argv[0]);
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if((argc - optind) != 2) {
+        usage(argv[0]);
+    }
+    
+    if(precision == "float") {
+        return(convert<float>(Nneurons, maxLayers, argv[optind], argv[optind + 1]));
+    }
+    else if(precision == "fixed") {
+        return(convert<Fixed>(Nneurons, maxLayers, argv[optind], argv[optind + 1]));
+    }
+    else {
+        return(convert<double>(Nneurons, maxLayers, argv[optind], argv[optind + 1]));
+    }
+}
@@ -7,173 +7,526 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <vector>
 #include <algorithm>
 #include <chrono>
+#include <thread>
+
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
 
 #include "Triple.hpp"
 #include "DenseVec.hpp"
+#include "SpaVec.hpp"
 #include "SparseMat.hpp"
+#include "Reader.hpp"
+#include "Cache.hpp"
+#include "LayerQueue.hpp"
 #include "InferenceReLU.cpp"
+#include "Server.hpp"
 #include "Env.hpp"
+#include "Simd.hpp"
+#include "Numa.hpp"
+#include "Profile.hpp"
 
-using WGT = double; 
-int main(int argc, char **argv) {
-    printf("INFO: Welcome to Sparse Deep Neural Network Implementation\n");
+/* Command line options */
+struct Options {
+    uint32_t Nneurons = 0;
+    uint32_t maxLayers = 0;
+    uint32_t streamWindow = 0;
+    bool streamRelease = false;
+    bool printImbalance = false;
+    bool dataflow = false;
+    bool hybrid = false;
+    bool layerValues = false;
+    bool ellpack = false;
+    int indices = WIDE_INDICES; // Row indices of layers
+    uint32_t pipelineStages = 0;
+    bool tiled = false;
+    uint32_t tileRows = 0;  // 0 picks them from the L2 cache size
+    uint32_t fusedLayers = 0;
+    std::string serverPath; // Unix domain socket, or - for stdin/stdout
+    uint32_t batchRows = 1024; // Images of a server batch
+    double latencyBudget = 0.005; // Seconds a server request may wait for others
+    std::string profilePath; // CSV (or JSON) of the per-layer, per-thread profile
+    std::string tracePath;   // Chrome trace events of the run
+    std::string precision = "double";
+    std::string inputPath;
+    std::string dnnPath;
+    int rank = 0;   // MPI rank, ranks split the images
+    int nranks = 1;
+};
+
+/* Names of the row indices of layers (Indices), as given to -z */
+const char *indicesNames[] = {"wide", "short", "delta"};
+
+/* Read a layer from its cache file if there is one not older than its TSV file, otherwise from its TSV file */
+template<typename Weight>
+struct Layer<Weight> read_layer(std::string path, uint32_t Nneurons, uint32_t layer, Accum<Weight> biasValue, 
+                                std::vector<struct Triple<Weight>> &layerTriples, bool parallel = true, bool values = false, bool ellpack = false, 
+                                int indices = WIDE_INDICES) {
+    struct CSC<Weight> *layerSpMat = nullptr;
+    std::string layerFile = layer_file(path, Nneurons, layer + 1);
+    std::string layerCache = layer_file(path, Nneurons, layer + 1, cache_ext<Weight>());
+    if(cache_exists(layerCache, layerFile)) {
+        layerSpMat = read_cache<Weight>(layerCache);
+    }
+    else {
+        uint64_t nrows = 0;
+        uint64_t ncols = 0;
+        read_triples<Weight>(layerFile, layerTriples, nrows, ncols, parallel);
+        layerSpMat = new struct CSC<Weight>((Nneurons + 1), (ncols + 1), layerTriples.size(), layerTriples);
+    }
+    if(not values) {
+        layerSpMat->unify();
+    }
+    if(ellpack) {
+        layerSpMat->ellpack();
+    }
+    layerSpMat->compact(indices);
+    
+    struct DenseVec<Weight> *biaseDenseVec = new struct DenseVec<Weight>((Nneurons + 1));
+    auto &bias_A = biaseDenseVec->A;
+    for(uint32_t j = 1; j < Nneurons+1; j++) {
+        bias_A[j] = biasValue;
+    }
+    if(Numa::placement == Numa::INTERLEAVE) { // Layers are read by all threads
+        layerSpMat->place();
+        biaseDenseVec->A_blk->place();
+    }
+    else if(Numa::placement == Numa::REPLICATE) {
+        layerSpMat->replicate();
+        biaseDenseVec->A_blk->place();
+    }
+    struct Layer<Weight> layer_ = {layer, layerSpMat, biaseDenseVec};
+    return(layer_);
+}
+
+/* Pages of layers, activations (the last Y), and SPAs on every node, and the share remote to the threads reading them */
+template<typename Weight>
+void numa_report(std::vector<struct CSC<Weight>*> &layersSpMat, struct CSC<Weight> *featuresSpMat, std::vector<struct SpaVec<Weight>*> &spa_VEC) {
+    const char *placementNames[] = {"none", "local", "interleave", "replicate"};
+    int nthreads = spa_VEC.size();
+    std::vector<int> nodeThreads(Numa::nnodes);
+    std::vector<int> sharedCopy(nthreads, 0);
+    std::vector<int> threadCopy(nthreads);
+    std::vector<int> nodeCopy(nthreads);
+    for(int t = 0; t < nthreads; t++) {
+        nodeThreads[Numa::thread_node[t]]++;
+        threadCopy[t] = t;
+        nodeCopy[t] = Numa::thread_node[t];
+    }
+    printf("INFO: NUMA placement %s, %d nodes, threads per node:", placementNames[Numa::placement], Numa::nnodes);
+    for(int n = 0; n < Numa::nnodes; n++) {
+        printf(" %d", nodeThreads[n]);
+    }
+    printf("\n");
     
-    if(argc != 7) {
-        fprintf(stderr, "USAGE: %s -n <Nneurons> -l <maxLayers> <path_to_input> <path_to_dnn>\n", argv[0]);
-        exit(1);         
+    bool replicated = (Numa::placement == Numa::REPLICATE);
+    std::vector<std::vector<uint64_t>> layers((replicated) ? Numa::nnodes : 1);
+    for(auto *W : layersSpMat) {
+        if(W and replicated) {
+            for(int n = 0; n < Numa::nnodes; n++) {
+                W->replicas[n]->count_pages(layers[n]);
+            }
+        }
+        else if(W) {
+            W->count_pages(layers[0]);
+        }
     }
-    std::vector<WGT> neuralNetBias = {-0.3,-0.35,-0.4,-0.45};
-    uint32_t Nneurons = atoi(argv[2]);
+    Numa::report("layers", layers, (replicated) ? nodeCopy : sharedCopy);
+    std::vector<std::vector<uint64_t>> activations(1);
+    featuresSpMat->count_pages(activations[0]);
+    Numa::report("activations", activations, sharedCopy);
+    std::vector<std::vector<uint64_t>> spas(nthreads);
+    for(int t = 0; t < nthreads; t++) {
+        spa_VEC[t]->A_blk->count_pages(spas[t]);
+        spa_VEC[t]->IA_blk->count_pages(spas[t]);
+        spa_VEC[t]->bitmap_blk->count_pages(spas[t]);
+    }
+    Numa::report("SPAs", spas, threadCopy);
+}
+
+#ifdef USE_MPI
+/* Rows first to last of A (1-based) as rows 1 to last - first + 1 of a new matrix */
+template<typename Weight>
+struct CSC<Weight>* slice_rows(struct CSC<Weight> *A_CSC, uint32_t first, uint32_t last) {
+    uint32_t *A_JA = A_CSC->JA;
+    uint32_t *A_IA = A_CSC->IA;
+    Weight   *A_A  = A_CSC->A;
+    uint32_t ncols = A_CSC->ncols;
+    uint64_t nnz = 0;
+    for(uint64_t k = 0; k < A_CSC->nnz; k++) {
+        nnz += ((A_IA[k] >= first) and (A_IA[k] <= last));
+    }
+    struct CSC<Weight> *C_CSC = new struct CSC<Weight>((last - first + 2), ncols, (nnz) ? nnz : 1);
+    uint32_t *C_JA = C_CSC->JA;
+    uint32_t *C_IA = C_CSC->IA;
+    Weight   *C_A  = C_CSC->A;
+    uint64_t n = 0;
+    C_JA[0] = 0;
+    for(uint32_t j = 0; j < ncols; j++) {
+        for(uint32_t k = A_JA[j]; k < A_JA[j+1]; k++) {
+            if((A_IA[k] >= first) and (A_IA[k] <= last)) {
+                C_IA[n] = A_IA[k] - first + 1;
+                C_A[n] = A_A[k];
+                n++;
+            }
+        }
+        C_JA[j+1] = n;
+    }
+    C_CSC->nnz = nnz;
+    C_CSC->idx = nnz;
+    return(C_CSC);
+}
+
+/* Concatenate the predicted categories of all ranks on rank 0, ranks hold increasing image ranges */
+void gather_categories(std::vector<uint32_t> &predictedCategories, struct Options &options) {
+    int count = predictedCategories.size();
+    std::vector<int> counts(options.nranks);
+    std::vector<int> displs(options.nranks);
+    MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    int total = 0;
+    for(int i = 0; i < options.nranks; i++) {
+        displs[i] = total;
+        total += counts[i];
+    }
+    std::vector<uint32_t> allCategories((options.rank) ? 0 : total);
+    MPI_Gatherv(predictedCategories.data(), count, MPI_UINT32_T, allCategories.data(), counts.data(), displs.data(), MPI_UINT32_T, 0, MPI_COMM_WORLD);
+    predictedCategories.swap(allCategories);
+}
+#endif
+
+void usage(char *name) {
+    fprintf(stderr, "USAGE: %s -n <Nneurons> -l <maxLayers> [-s <window>] [-r] [-b <scheduling>] [-i] [-d] [-y <format>] [-a] [-e] [-z <indices>] [-p <precision>] [-m <placement>] [-H] [-g <stages>] [-t <rows>] [-f <layers>] [-o <file>] [-c] [-T <file>] <path_to_input> <path_to_dnn>\n", name);
+    fprintf(stderr, "       %s -n <Nneurons> -l <maxLayers> -S <socket> [-B <images>] [-w <ms>] [options] <path_to_dnn>\n", name);
+    fprintf(stderr, "    -s <window>    : Stream layers through a queue of <window> layers while computing\n");
+    fprintf(stderr, "    -r             : Release streamed layers after use\n");
+    fprintf(stderr, "    -b <scheduling>: Column scheduling static|balanced|stealing (default stealing)\n");
+    fprintf(stderr, "    -i             : Print the load imbalance of every layer\n");
+    fprintf(stderr, "    -d             : Dataflow execution, column blocks start as soon as their inputs are done\n");
+    fprintf(stderr, "    -y <format>    : Activations in csc|hybrid column blocks (default csc), hybrid blocks are CSC, bitmap, or dense by density\n");
+    fprintf(stderr, "    -a             : Keep all values of layers with a uniform value\n");
+    fprintf(stderr, "    -e             : Run layers with a fixed fan-in of %d on the ELLPACK kernels\n", ELL_DEGREE);
+    fprintf(stderr, "    -z <indices>   : Row indices of layers wide|short|delta (default wide), short keeps uint16_t rows, delta varint row differences\n");
+    fprintf(stderr, "    -p <precision> : Weights and activations in float|double|fixed (default double)\n");
+    fprintf(stderr, "    -m <placement> : NUMA placement none|local|interleave|replicate (default none), local buffers are placed by first touch, layers are interleaved or replicated per node\n");
+    fprintf(stderr, "    -H             : Back buffers of %lu MiB or more with huge pages (MAP_HUGETLB, otherwise madvise)\n", HUGE_PAGE_SIZE >> 20);
+    fprintf(stderr, "    -g <stages>    : Split threads into <stages> pipeline stages of consecutive layers, batches of images stream through them\n");
+    fprintf(stderr, "    -t <rows>      : Tiled execution, tiles of <rows> images (or auto, sized from the L2 cache) go through several layers at a time\n");
+    fprintf(stderr, "    -f <layers>    : Tiled execution, layers every tile goes through before the next one starts (or auto, sized from the L2 cache)\n");
+    fprintf(stderr, "    -o <file>      : Write the per-layer, per-thread profile as CSV (or JSON if <file> ends with .json), needs make profile\n");
+    fprintf(stderr, "    -c             : Count cycles, instructions, LLC/dTLB misses, branch misses, and page faults of every phase with perf_event_open\n");
+    fprintf(stderr, "    -T <file>      : Write the timeline of layer reads, phases, barriers, and serial sections as Chrome trace events (JSON)\n");
+    fprintf(stderr, "    -S <socket>    : Serve requests on a Unix domain socket (or - for stdin/stdout) with the layers read once\n");
+    fprintf(stderr, "    -B <images>    : Server batches of up to <images> images (default 1024)\n");
+    fprintf(stderr, "    -w <ms>        : Milliseconds a server request may wait to share a batch (default 5)\n");
+    exit(1);
+}
+
+/* Bias of every neuron of the challenge network with Nneurons neurons per layer, in the type the SPA sums in */
+template<typename Value>
+Value bias_value(uint32_t Nneurons) {
+    std::vector<Value> neuralNetBias = {-0.3,-0.35,-0.4,-0.45};
     std::vector<uint32_t> NneuronsVector = {1024, 4096, 16384, 65536};
     std::ptrdiff_t idxN = std::distance(NneuronsVector.begin(), std::find(NneuronsVector.begin(), NneuronsVector.end(), Nneurons));
     if(idxN >= NneuronsVector.size()) {
         fprintf(stderr, "Invalid number of neurons/layer %d\n", Nneurons);
         exit(1);
     }    
-    WGT biasValue = neuralNetBias[idxN];
-    
-    std::string featuresFile = ((std::string) argv[5]) + "/sparse-images-" + std::to_string(Nneurons) + ".tsv";
-    printf("INFO: Start reading the features file %s\n", featuresFile.c_str());
-    std::ifstream fin(featuresFile.c_str());
-    if(!fin.is_open()) {
-        fprintf(stderr, "Error: Opening %s\n", featuresFile.c_str());
-        exit(1);
-    }
-    
-    uint64_t nrowsFeatures = 0; 
-    uint64_t ncolsFeatures = 0;
-    std::vector<struct Triple<WGT>> featuresTriples;
-    struct Triple<WGT> featuresTriple;
-    std::string line;
-    std::istringstream iss;
-    while (std::getline(fin, line)) {
-        iss.clear();
-        iss.str(line);
-        iss >> featuresTriple.row >> featuresTriple.col >> featuresTriple.weight;
-        featuresTriples.push_back(featuresTriple);
-        if(featuresTriple.row > nrowsFeatures)
-            nrowsFeatures = featuresTriple.row;
-        if(featuresTriple.col > ncolsFeatures)
-            ncolsFeatures = featuresTriple.col;
-    }
-    fin.close();
-    printf("INFO: Done  reading the features file %s\n", featuresFile.c_str());
-    printf("INFO: Features file is %lu x %lu, nnz=%lu\n", nrowsFeatures, ncolsFeatures, featuresTriples.size());
-    uint64_t NfeatureVectors = nrowsFeatures;
-    struct CSC<WGT> *featuresSpMat = new struct CSC<WGT>((nrowsFeatures + 1), (Nneurons + 1), featuresTriples.size(), featuresTriples);
-    featuresTriples.clear();
-    featuresTriples.shrink_to_fit();
-    
-    uint32_t maxLayers = atoi(argv[4]);
+    return(neuralNetBias[idxN]);
+}
+
+void check_layers(uint32_t maxLayers) {
     std::vector<uint32_t> maxLayersVector = {120, 480, 1920};
     std::ptrdiff_t idxL = std::distance(maxLayersVector.begin(), std::find(maxLayersVector.begin(), maxLayersVector.end(), maxLayers));
     if(idxL >= maxLayersVector.size()) {
         fprintf(stderr, "Invalid number of layers %d\n", maxLayers);
         exit(1);
     }    
+}
+
+/* Read all layers in parallel, returns the number of edges */
+template<typename WGT>
+uint64_t read_layers(struct Options &options, Accum<WGT> biasValue, std::vector<struct CSC<WGT>*> &layersSpMat, std::vector<struct DenseVec<WGT>*> &biasesDenseVec) {
+    uint32_t Nneurons = options.Nneurons;
+    uint32_t maxLayers = options.maxLayers;
+    uint64_t DNNedges = 0;
+    uint32_t uniformLayers = 0;
+    uint32_t ellpackLayers = 0;
+    uint32_t compactLayers = 0;
+    printf("INFO: Start reading %d layer files\n", maxLayers);
+    auto start = std::chrono::high_resolution_clock::now();
+    #pragma omp parallel reduction(+:DNNedges, uniformLayers, ellpackLayers, compactLayers)
+    {
+        std::vector<struct Triple<WGT>> layerTriples;
+        #pragma omp for schedule(dynamic)
+        for(uint32_t i = 0; i < maxLayers; i++) {  
+            double begin = Trace::now();
+            struct Layer<WGT> layer = read_layer<WGT>(options.dnnPath, Nneurons, i, biasValue, layerTriples, true, options.layerValues, options.ellpack, options.indices);
+            Trace::span(omp_get_thread_num(), Trace::READ, begin, i);
+            DNNedges += layer.W->nnz;
+            uniformLayers += (layer.W->values != GENERAL_VALUES);
+            ellpackLayers += (layer.W->degree == ELL_DEGREE);
+            compactLayers += (layer.W->indices != WIDE_INDICES);
+            layersSpMat[i] = layer.W;
+            biasesDenseVec[i] = layer.b;
+        }
+    }
+    auto finish = std::chrono::high_resolution_clock::now();
+    printf("INFO: Done  reading %d layer files\n", maxLayers);
+    double readLayerTime = (double)(std::chrono::duration_cast< std::chrono::nanoseconds>(finish-start).count())/1e9;
+    double readLayerRate = (double) DNNedges/readLayerTime;
+    printf("INFO: DNN neurons/layer: %d, layers:%d, edges:%lu\n", Nneurons, maxLayers, DNNedges);
+    printf("INFO: Read time (sec): %f, read rate (edges/sec): %f\n", readLayerTime, readLayerRate);
+    printf("INFO: Layers with a uniform value (stored without values): %d of %d\n", uniformLayers, maxLayers);
+    if(options.ellpack) {
+        printf("INFO: Layers with a fixed fan-in of %d (ELLPACK kernels): %d of %d\n", ELL_DEGREE, ellpackLayers, maxLayers);
+    }
+    if(options.indices != WIDE_INDICES) {
+        printf("INFO: Layers with %s row indices: %d of %d\n", indicesNames[options.indices], compactLayers, maxLayers);
+    }
+    return(DNNedges);
+}
+
+/* Inference with the executor picked by the options, for layers all in memory */
+template<typename WGT>
+void infer(struct Options &options, std::vector<struct CSC<WGT>*> &layersSpMat, std::vector<struct DenseVec<WGT>*> &biasesDenseVec,
+           struct CSC<WGT> *featuresSpMat, std::vector<struct SpaVec<WGT>*> &spa_VEC, std::vector<uint32_t> &rowIds) {
+    if(options.pipelineStages) {
+        inferenceReLU_pipeline<WGT>(layersSpMat, biasesDenseVec, featuresSpMat, spa_VEC, options.pipelineStages); /* Train DNN */
+    }
+    else if(options.tiled) {
+        inferenceReLU_tiled<WGT>(layersSpMat, biasesDenseVec, featuresSpMat, spa_VEC, rowIds, options.tileRows, options.fusedLayers); /* Train DNN */
+    }
+    else if(options.dataflow) {
+        inferenceReLU_dataflow<WGT>(layersSpMat, biasesDenseVec, featuresSpMat, spa_VEC, options.hybrid); /* Train DNN */
+    }
+    else if(options.hybrid) {
+        inferenceReLU_hybrid<WGT>(layersSpMat, biasesDenseVec, featuresSpMat, spa_VEC, rowIds); /* Train DNN */
+    }
+    else {
+        inferenceReLU<WGT>(layersSpMat, biasesDenseVec, featuresSpMat, spa_VEC, rowIds); /* Train DNN */
+    }
+}
+
+/* The whole pipeline for weights and activations of type WGT */
+template<typename WGT>
+int run(struct Options &options) {
+    uint32_t Nneurons = options.Nneurons;
+    uint32_t maxLayers = options.maxLayers;
+    uint32_t streamWindow = options.streamWindow;
+    bool streamRelease = options.streamRelease;
+    bool printImbalance = options.printImbalance;
+    bool layerValues = options.layerValues;
+    bool ellpack = options.ellpack;
+    std::string &inputPath = options.inputPath;
+    std::string &dnnPath = options.dnnPath;
     
-    std::string categoryFile = ((std::string) argv[6]) + "/neuron" + std::to_string(Nneurons) + "-l" + std::to_string(maxLayers) + "-categories.tsv";
-    printf("INFO: Start reading the category file %s\n", categoryFile.c_str());
+    Accum<WGT> biasValue = bias_value<Accum<WGT>>(Nneurons);
+    Numa::init();
     
-    fin.clear();
-    fin.open(categoryFile.c_str());
-    if(!fin.is_open()) {
-        fprintf(stderr, "Error: Opening %s\n", categoryFile.c_str());
-        exit(1);
+    uint64_t nrowsFeatures = 0; 
+    uint64_t ncolsFeatures = 0;
+    struct CSC<WGT> *featuresSpMat = nullptr;
+    std::string featuresFile = features_file(inputPath, Nneurons);
+    std::string featuresCache = features_file(inputPath, Nneurons, cache_ext<WGT>());
+    if(cache_exists(featuresCache, featuresFile)) {
+        printf("INFO: Start mapping the features cache %s\n", featuresCache.c_str());
+        featuresSpMat = read_cache<WGT>(featuresCache);
+        nrowsFeatures = featuresSpMat->nrows - 1;
+        ncolsFeatures = featuresSpMat->ncols - 1;
+        printf("INFO: Done  mapping the features cache %s\n", featuresCache.c_str());
+        printf("INFO: Features file is %lu x %lu, nnz=%lu\n", nrowsFeatures, ncolsFeatures, featuresSpMat->nnz);
     }
+    else {
+        printf("INFO: Start reading the features file %s\n", featuresFile.c_str());
+        std::vector<struct Triple<WGT>> featuresTriples;
+        read_triples<WGT>(featuresFile, featuresTriples, nrowsFeatures, ncolsFeatures);
+        printf("INFO: Done  reading the features file %s\n", featuresFile.c_str());
+        printf("INFO: Features file is %lu x %lu, nnz=%lu\n", nrowsFeatures, ncolsFeatures, featuresTriples.size());
+        featuresSpMat = new struct CSC<WGT>((nrowsFeatures + 1), (Nneurons + 1), featuresTriples.size(), featuresTriples);
+        featuresTriples.clear();
+        featuresTriples.shrink_to_fit();
+    }
+    uint64_t NfeatureVectors = nrowsFeatures;
+    uint32_t firstRow = 1; // Image ids of the rows of this rank start from firstRow
+#ifdef USE_MPI
+    firstRow = 1 + (nrowsFeatures * options.rank) / options.nranks;
+    uint32_t lastRow = (nrowsFeatures * (options.rank + 1)) / options.nranks;
+    struct CSC<WGT> *sliceSpMat = slice_rows<WGT>(featuresSpMat, firstRow, lastRow);
+    delete featuresSpMat;
+    featuresSpMat = sliceSpMat;
+    nrowsFeatures = lastRow - firstRow + 1;
+    printf("INFO: MPI ranks %d, rank %d has images %d to %d, nnz=%lu\n", options.nranks, options.rank, firstRow, lastRow, featuresSpMat->nnz);
+#endif
+    
+    check_layers(maxLayers);
+    
+    std::string categoryFile = category_file(dnnPath, Nneurons, maxLayers);
+    printf("INFO: Start reading the category file %s\n", categoryFile.c_str());
     std::vector<uint32_t> trueCategories;
-    uint32_t category = 0;
-    while (std::getline(fin, line)) {
-        iss.clear();
-        iss.str(line);
-        iss >> category;
-        trueCategories.push_back(category);
-    }
-    fin.close();
+    read_categories(categoryFile, trueCategories);
     printf("INFO: Done  reading the category file %s\n", categoryFile.c_str());
     uint64_t Ncategories = trueCategories.size();
     printf("INFO: Number of categories %lu\n", Ncategories);
 
     uint64_t DNNedges = 0;
+    uint32_t uniformLayers = 0;
+    uint32_t ellpackLayers = 0;
+    uint32_t compactLayers = 0;
     
-    std::vector<struct Triple<WGT>> layerTriples;
-    struct Triple<WGT> layerTriple;  
-    std::vector<struct CSC<WGT>*> layersSpMat;
+    std::vector<struct CSC<WGT>*> layersSpMat(maxLayers);
     //std::vector<struct CompressedSpMat<WGT>*> layersSpMat;
-    std::vector<struct DenseVec<WGT>*> biasesDenseVec;
+    std::vector<struct DenseVec<WGT>*> biasesDenseVec(maxLayers);
     //maxLayers = 1;
-    printf("INFO: Start reading %d layer files\n", maxLayers);
+    struct LayerQueue<WGT> *layersQueue = nullptr;
+    std::thread layersReader;
+    double readLayerTime = 0;
     auto start = std::chrono::high_resolution_clock::now();
-    for(uint32_t i = 0; i < maxLayers; i++) {  
-        std::string layerFile = ((std::string) argv[6]) + "/neuron" + std::to_string(Nneurons) + "/n" + std::to_string(Nneurons) + "-l" + std::to_string(i+1) + ".tsv";
-        
-        fin.clear();
-        fin.open(layerFile.c_str());
-        if(!fin.is_open()) {
-            fprintf(stderr, "Error: Opening %s\n", layerFile.c_str());
-            exit(1);
-        }
-
-        uint64_t nrows = 0;
-        uint64_t ncols = 0;
-
-        while (std::getline(fin, line)) {
-            iss.clear();
-            iss.str(line);
-            iss >> layerTriple.row >> layerTriple.col >> layerTriple.weight;
-            layerTriples.push_back(layerTriple);
-            if(layerTriple.row > nrows)
-                nrows = layerTriple.row;
-            if(layerTriple.col > ncols)
-                ncols = layerTriple.col;
-        }
-        fin.close();
-        DNNedges += layerTriples.size();
-        struct CSC<WGT> *layerSpMat = new struct CSC<WGT>((Nneurons + 1), (ncols + 1), layerTriples.size(), layerTriples);
-        layersSpMat.push_back(layerSpMat);
-        layerTriples.clear();
-        layerTriples.shrink_to_fit();
-        
-        struct DenseVec<WGT> *biaseDenseVec = new struct DenseVec<WGT>((Nneurons + 1));
-        auto &bias_A = biaseDenseVec->A;
-        for(uint32_t j = 1; j < Nneurons+1; j++) {
-            bias_A[j] = biasValue;
-        }
-        
-        biasesDenseVec.push_back(biaseDenseVec);
-    } 
-
-    auto finish = std::chrono::high_resolution_clock::now();
-    printf("INFO: Done  reading %d layer files\n", maxLayers);
-    WGT readLayerTime = (WGT)(std::chrono::duration_cast< std::chrono::nanoseconds>(finish-start).count())/1e9;
-    WGT readLayerRate = (WGT) DNNedges/readLayerTime;
-    printf("INFO: DNN neurons/layer: %d, layers:%d, edges:%lu\n", Nneurons, maxLayers, DNNedges);
-    printf("INFO: Read time (sec): %f, read rate (edges/sec): %f\n", readLayerTime, readLayerRate);
+    auto finish = start;
+    if(Trace::enabled) {
+        Trace::init(omp_get_max_threads());
+    }
+    if(streamWindow) {
+        printf("INFO: Start streaming %d layer files (window=%d%s)\n", maxLayers, streamWindow, (streamRelease) ? ", release" : "");
+        layersQueue = new struct LayerQueue<WGT>(streamWindow);
+        layersReader = std::thread([&] {
+            std::vector<struct Triple<WGT>> layerTriples;
+            auto start = std::chrono::high_resolution_clock::now();
+            for(uint32_t i = 0; i < maxLayers; i++) {  
+                double begin = Trace::now();
+                struct Layer<WGT> layer = read_layer<WGT>(dnnPath, Nneurons, i, biasValue, layerTriples, false, layerValues, ellpack, options.indices);
+                Trace::span(Trace::reader(), Trace::READ, begin, i);
+                DNNedges += layer.W->nnz;
+                uniformLayers += (layer.W->values != GENERAL_VALUES);
+                ellpackLayers += (layer.W->degree == ELL_DEGREE);
+                compactLayers += (layer.W->indices != WIDE_INDICES);
+                layersQueue->push(layer);
+            }
+            auto finish = std::chrono::high_resolution_clock::now();
+            readLayerTime = (double)(std::chrono::duration_cast< std::chrono::nanoseconds>(finish-start).count())/1e9;
+        });
+    }
+    else {
+        DNNedges = read_layers<WGT>(options, biasValue, layersSpMat, biasesDenseVec);
+    }
     
     Env::init();
-    std::vector<struct DenseVec<WGT>*> spa_VEC;
-    for(uint32_t i = 0; i < Env::nthreads; i++) {
-        struct DenseVec<WGT> *spa_DVEC = new struct DenseVec<WGT>(nrowsFeatures + 1);
-        spa_VEC.push_back(spa_DVEC);
+    PROFILE_INIT(Env::nthreads, maxLayers);
+    if(Counters::enabled) {
+        Counters::init(maxLayers);
+    }
+    std::vector<struct SpaVec<WGT>*> spa_VEC(Env::nthreads);
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        spa_VEC[tid] = new struct SpaVec<WGT>(nrowsFeatures + 1); // Touched first by its thread
     }
     
     
     
+    std::vector<uint32_t> rowIds(featuresSpMat->nrows); // Image id of every row of Y, rows are compacted as images die
+    for(uint32_t i = 0; i < featuresSpMat->nrows; i++) {
+        rowIds[i] = (firstRow - 1) + i;
+    }
+    if((Numa::placement == Numa::INTERLEAVE) or (Numa::placement == Numa::REPLICATE)) { // Y is read by all threads
+        featuresSpMat->place();
+    }
+    
+#ifdef USE_MPI
+    MPI_Barrier(MPI_COMM_WORLD);
+#endif
     start = std::chrono::high_resolution_clock::now();
-    inferenceReLU<WGT>(layersSpMat, biasesDenseVec, featuresSpMat, spa_VEC); /* Train DNN */
+    if(streamWindow) {
+        inferenceReLU<WGT>(layersQueue, maxLayers, layersSpMat, biasesDenseVec, featuresSpMat, spa_VEC, rowIds, streamRelease); /* Train DNN */
+    }
+    else {
+        infer<WGT>(options, layersSpMat, biasesDenseVec, featuresSpMat, spa_VEC, rowIds);
+    }
     finish = std::chrono::high_resolution_clock::now();
-    WGT challengeRunTime = (WGT)(std::chrono::duration_cast< std::chrono::nanoseconds>(finish-start).count())/1e9;
-    WGT challengeRunRate = NfeatureVectors * (DNNedges/challengeRunTime);
+    if(streamWindow) {
+        layersReader.join();
+        delete layersQueue;
+        printf("INFO: Done  streaming %d layer files\n", maxLayers);
+        double readLayerRate = (double) DNNedges/readLayerTime;
+        printf("INFO: DNN neurons/layer: %d, layers:%d, edges:%lu\n", Nneurons, maxLayers, DNNedges);
+        printf("INFO: Read time (sec): %f, read rate (edges/sec): %f (overlapped)\n", readLayerTime, readLayerRate);
+        printf("INFO: Layers with a uniform value (stored without values): %d of %d\n", uniformLayers, maxLayers);
+        if(ellpack) {
+            printf("INFO: Layers with a fixed fan-in of %d (ELLPACK kernels): %d of %d\n", ELL_DEGREE, ellpackLayers, maxLayers);
+        }
+        if(options.indices != WIDE_INDICES) {
+            printf("INFO: Layers with %s row indices: %d of %d\n", indicesNames[options.indices], compactLayers, maxLayers);
+        }
+    }
+    double challengeRunTime = (double)(std::chrono::duration_cast< std::chrono::nanoseconds>(finish-start).count())/1e9;
+#ifdef USE_MPI
+    std::vector<double> rankRunTimes(options.nranks);
+    MPI_Gather(&challengeRunTime, 1, MPI_DOUBLE, rankRunTimes.data(), 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    for(int i = 0; i < options.nranks; i++) {
+        printf("INFO: Rank %d run time (sec): %f\n", i, rankRunTimes[i]);
+        challengeRunTime = std::max(challengeRunTime, rankRunTimes[i]);
+    }
+#endif
+    double challengeRunRate = NfeatureVectors * (DNNedges/challengeRunTime);
     printf("INFO: Run time (sec): %f, run rate (edges/sec): %f\n", challengeRunTime, challengeRunRate);
+    if(Counters::enabled) {
+        std::vector<uint64_t> layerEdges(maxLayers, DNNedges / maxLayers); // Released streamed layers are gone, as the run rate they count the mean
+        for(uint32_t i = 0; i < maxLayers; i++) {
+            layerEdges[i] = (layersSpMat[i]) ? layersSpMat[i]->nnz : layerEdges[i];
+        }
+        Counters::report(nrowsFeatures, layerEdges);
+        Counters::close();
+    }
+    if(Numa::placement != Numa::NONE) {
+        numa_report<WGT>(layersSpMat, featuresSpMat, spa_VEC);
+    }
+    if(Huge_Pages::enabled) {
+        printf("INFO: Huge pages of %lu MiB: MAP_HUGETLB %lu (%lu over the run), transparent %lu of %lu advised\n", HUGE_PAGE_SIZE >> 20,
+                Huge_Pages::hugetlb_bytes / HUGE_PAGE_SIZE, Huge_Pages::hugetlb_total / HUGE_PAGE_SIZE,
+                Huge_Pages::transparent_bytes() / HUGE_PAGE_SIZE, Huge_Pages::advised_bytes / HUGE_PAGE_SIZE);
+    }
+    
+    const char *schedulingNames[] = {"static", "balanced", "stealing"};
+    double meanImbalance = 0;
+    double maxImbalance = 0;
+    for(uint32_t i = 0; i < Env::layer_imbalance.size(); i++) {
+        if(printImbalance) {
+            printf("INFO: Layer %d imbalance (max/mean busy time): %f\n", i, Env::layer_imbalance[i]);
+        }
+        meanImbalance += Env::layer_imbalance[i];
+        maxImbalance = std::max(maxImbalance, Env::layer_imbalance[i]);
+    }
+    meanImbalance /= (Env::layer_imbalance.size()) ? Env::layer_imbalance.size() : 1;
+    uint64_t stolenBlocks = 0;
+    for(uint32_t i = 0; i < Env::nthreads; i++) {
+        stolenBlocks += Env::stolen_blocks[i];
+    }
+    if(not Env::layer_imbalance.empty()) {
+        printf("INFO: Scheduling %s, imbalance (max/mean busy time): mean %f, max %f, stolen blocks: %lu\n", 
+                schedulingNames[Env::scheduling], meanImbalance, maxImbalance, stolenBlocks);
+    }
+#ifdef PROFILE
+    Profile::report();
+    if(not options.profilePath.empty()) {
+        Profile::write(options.profilePath);
+    }
+#endif
+    if(Trace::enabled) {
+        Trace::write(options.tracePath);
+    }
     
-    validate_prediction<WGT>(featuresSpMat, trueCategories); /* Test DNN */
+    std::vector<uint32_t> predictedCategories = predict_categories<WGT>(featuresSpMat, rowIds);
+#ifdef USE_MPI
+    gather_categories(predictedCategories, options);
+#endif
+    validate_prediction(predictedCategories, trueCategories); /* Test DNN */
     
     delete featuresSpMat;
     for(uint32_t i = 0; i < maxLayers; i++) {  
@@ -193,3 +546,260 @@ int main(int argc, char **argv) {
     
     return(0);
 }
+
+/* Percentile p of sorted values */
+double percentile(std::vector<double> &sorted, double p) {
+    if(sorted.empty()) {
+        return(0);
+    }
+    uint64_t i = (uint64_t) (p * sorted.size());
+    return(sorted[(i < sorted.size()) ? i : sorted.size() - 1]);
+}
+
+/*
+ * Inference server: read the layers once, then run batches of requests from a Unix domain socket
+ * or stdin (see Server.hpp) until the input ends or SIGINT/SIGTERM. Requests are stacked by rows
+ * into one features matrix, and the rows with a category (as validate_prediction counts them)
+ * are split back per request. Latency is from a request read to its reply written.
+ */
+template<typename WGT>
+int serve(struct Options &options) {
+    uint32_t Nneurons = options.Nneurons;
+    uint32_t maxLayers = options.maxLayers;
+    int out = STDOUT_FILENO;
+    if(options.serverPath == "-") { // Replies go to stdout, so logs (buffered ones too) go to stderr
+        out = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    else { // Stop taking clients, and finish the queued requests
+        signal(SIGINT, Server::on_signal);
+        signal(SIGTERM, Server::on_signal);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    
+    Accum<WGT> biasValue = bias_value<Accum<WGT>>(Nneurons);
+    check_layers(maxLayers);
+    Numa::init();
+    std::vector<struct CSC<WGT>*> layersSpMat(maxLayers);
+    std::vector<struct DenseVec<WGT>*> biasesDenseVec(maxLayers);
+    read_layers<WGT>(options, biasValue, layersSpMat, biasesDenseVec);
+    Env::init();
+    std::vector<struct SpaVec<WGT>*> spa_VEC(Env::nthreads);
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        spa_VEC[tid] = new struct SpaVec<WGT>(1);
+    }
+    
+    auto queue = std::make_shared<struct RequestQueue<WGT>>();
+    std::thread acceptor(accept_requests<WGT>, options.serverPath, out, queue, Nneurons);
+    std::vector<struct Request<WGT>> batch;
+    std::vector<double> latencies;
+    uint64_t nimages = 0;
+    uint64_t nbatches = 0;
+    auto first = std::chrono::steady_clock::now();
+    auto last = first;
+    while(queue->pop_batch(batch, options.batchRows, options.latencyBudget)) {
+        if(not nbatches) {
+            first = batch[0].arrival;
+        }
+        std::vector<uint32_t> offsets(batch.size() + 1); // Request k has rows offsets[k]+1 to offsets[k+1]
+        std::vector<struct Triple<WGT>> featuresTriples;
+        for(uint32_t k = 0; k < batch.size(); k++) {
+            offsets[k + 1] = offsets[k] + batch[k].nrows;
+            for(auto triple : batch[k].triples) {
+                triple.row += offsets[k];
+                featuresTriples.push_back(triple);
+            }
+        }
+        uint32_t nrows = offsets[batch.size()];
+        std::vector<uint32_t> predictedCategories;
+        if(not featuresTriples.empty()) {
+            struct CSC<WGT> *featuresSpMat = new struct CSC<WGT>((nrows + 1), (Nneurons + 1), featuresTriples.size(), featuresTriples);
+            #pragma omp parallel
+            {
+                int tid = omp_get_thread_num();
+                spa_VEC[tid]->resize(nrows + 1);
+            }
+            std::vector<uint32_t> rowIds(featuresSpMat->nrows);
+            for(uint32_t i = 0; i < featuresSpMat->nrows; i++) {
+                rowIds[i] = i;
+            }
+            infer<WGT>(options, layersSpMat, biasesDenseVec, featuresSpMat, spa_VEC, rowIds);
+            predictedCategories = predict_categories<WGT>(featuresSpMat, rowIds);
+            delete featuresSpMat;
+        }
+        
+        std::vector<std::string> replies(batch.size());
+        uint32_t k = 0;
+        for(uint32_t row : predictedCategories) {
+            while(row > offsets[k + 1]) {
+                k++;
+            }
+            replies[k] += std::to_string(row - offsets[k]) + "\n";
+        }
+        for(k = 0; k < batch.size(); k++) {
+            replies[k] += "\n";
+            if(not Server::write_all(batch[k].connection->out, replies[k])) {
+                fprintf(stderr, "WARN: Client went away before its reply\n");
+            }
+            last = std::chrono::steady_clock::now();
+            latencies.push_back((double)(std::chrono::duration_cast< std::chrono::nanoseconds>(last - batch[k].arrival).count())/1e9);
+        }
+        nimages += nrows;
+        nbatches++;
+        batch.clear();
+    }
+    Server::stopping = true;
+    acceptor.join();
+    
+    double serveTime = (double)(std::chrono::duration_cast< std::chrono::nanoseconds>(last - first).count())/1e9;
+    uint64_t nrequests = latencies.size();
+    std::sort(latencies.begin(), latencies.end());
+    printf("INFO: Served %lu requests, %lu images in %lu batches (%.1f images per batch)\n", nrequests, nimages, nbatches, (nbatches) ? (double) nimages / nbatches : 0.0);
+    printf("INFO: Latency (ms): p50 %f, p99 %f, max %f\n", 1e3 * percentile(latencies, 0.5), 1e3 * percentile(latencies, 0.99), 1e3 * percentile(latencies, 1));
+    printf("INFO: Throughput: %f images/sec, %f requests/sec\n", (serveTime > 0) ? nimages / serveTime : 0.0, (serveTime > 0) ? nrequests / serveTime : 0.0);
+    
+    for(uint32_t i = 0; i < maxLayers; i++) {  
+        delete layersSpMat[i];
+        delete biasesDenseVec[i];
+    }
+    for(uint32_t i = 0; i < Env::nthreads; i++) {
+        delete spa_VEC[i];
+    }
+    return(0);
+}
+
+int main(int argc, char **argv) {
+    struct Options options;
+#ifdef USE_MPI
+    int provided = 0;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &options.rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &options.nranks);
+    if(options.rank) { // Other ranks only report errors
+        if(not freopen("/dev/null", "w", stdout)) {
+            fprintf(stderr, "Error: Cannot silence rank %d\n", options.rank);
+            exit(1);
+        }
+    }
+#endif
+    printf("INFO: Welcome to Sparse Deep Neural Network Implementation\n");
+    
+    int opt;
+    while((opt = getopt(argc, argv, "n:l:s:rb:idy:aez:p:m:Hg:t:f:o:cT:S:B:w:")) != -1) {
+        switch(opt) {
+            case 'n': options.Nneurons = atoi(optarg); break;
+            case 'l': options.maxLayers = atoi(optarg); break;
+            case 's': options.streamWindow = atoi(optarg); break;
+            case 'r': options.streamRelease = true; break;
+            case 'b':
+                if(!strcmp(optarg, "static")) Env::scheduling = Env::STATIC;
+                else if(!strcmp(optarg, "balanced")) Env::scheduling = Env::BALANCED;
+                else if(!strcmp(optarg, "stealing")) Env::scheduling = Env::STEALING;
+                else usage(argv[0]);
+                break;
+            case 'i': options.printImbalance = true; break;
+            case 'd': options.dataflow = true; break;
+            case 'y':
+                if(!strcmp(optarg, "csc")) options.hybrid = false;
+                else if(!strcmp(optarg, "hybrid")) options.hybrid = true;
+                else usage(argv[0]);
+                break;
+            case 'a': options.layerValues = true; break;
+            case 'e': options.ellpack = true; break;
+            case 'z':
+                if(!strcmp(optarg, "wide")) options.indices = WIDE_INDICES;
+                else if(!strcmp(optarg, "short")) options.indices = SHORT_INDICES;
+                else if(!strcmp(optarg, "delta")) options.indices = DELTA_INDICES;
+                else usage(argv[0]);
+                break;
+            case 'p':
+                options.precision = optarg;
+                if((options.precision != "float") and (options.precision != "double") and (options.precision != "fixed")) usage(argv[0]);
+                break;
+            case 'm':
+                if(!strcmp(optarg, "none")) Numa::placement = Numa::NONE;
+                else if(!strcmp(optarg, "local")) Numa::placement = Numa::LOCAL;
+                else if(!strcmp(optarg, "interleave")) Numa::placement = Numa::INTERLEAVE;
+                else if(!strcmp(optarg, "replicate")) Numa::placement = Numa::REPLICATE;
+                else usage(argv[0]);
+                break;
+            case 'H': Huge_Pages::enabled = true; break;
+            case 'g': options.pipelineStages = atoi(optarg); if(not options.pipelineStages) usage(argv[0]); break;
+            case 't': options.tiled = true; options.tileRows = (strcmp(optarg, "auto")) ? atoi(optarg) : 0; break;
+            case 'f': options.tiled = true; options.fusedLayers = (strcmp(optarg, "auto")) ? atoi(optarg) : 0; break;
+            case 'o': options.profilePath = optarg; break;
+            case 'c': Counters::enabled = true; break;
+            case 'T': options.tracePath = optarg; Trace::enabled = true; break;
+            case 'S': options.serverPath = optarg; break;
+            case 'B': options.batchRows = atoi(optarg); if(not options.batchRows) usage(argv[0]); break;
+            case 'w': options.latencyBudget = atof(optarg) / 1e3; break;
+            default: usage(argv[0]);
+        }
+    }
+    bool server = (not options.serverPath.empty());
+    if((argc - optind) != ((server) ? 1 : 2)) {
+        usage(argv[0]);
+    }
+    if(server and (options.streamWindow or (options.nranks > 1))) {
+        fprintf(stderr, "The server reads all layers once, it cannot stream them or split them over MPI ranks\n");
+        exit(1);
+    }
+    if(options.dataflow and options.streamWindow) {
+        fprintf(stderr, "Dataflow execution needs all layers, it cannot stream them\n");
+        exit(1);
+    }
+    if(options.hybrid and options.streamWindow) {
+        fprintf(stderr, "Hybrid activations are not supported with streamed layers\n");
+        exit(1);
+    }
+    if((options.indices != WIDE_INDICES) and (options.dataflow or options.hybrid)) {
+        fprintf(stderr, "Compact row indices are not supported with dataflow execution or hybrid activations\n");
+        exit(1);
+    }
+    if(options.pipelineStages and (options.streamWindow or options.dataflow or options.hybrid)) {
+        fprintf(stderr, "Pipelined layers are not supported with streamed layers, dataflow execution, or hybrid activations\n");
+        exit(1);
+    }
+    if(options.tiled and (options.streamWindow or options.dataflow or options.hybrid or options.pipelineStages)) {
+        fprintf(stderr, "Tiled execution is not supported with streamed layers, dataflow execution, hybrid activations, or pipelined layers\n");
+        exit(1);
+    }
+#ifndef PROFILE
+    if(not options.profilePath.empty()) {
+        fprintf(stderr, "Profiling needs a build with -DPROFILE (make profile)\n");
+        exit(1);
+    }
+#endif
+    if(((not options.profilePath.empty()) or Counters::enabled) and (server or options.dataflow or options.hybrid or options.pipelineStages or options.tiled)) {
+        fprintf(stderr, "Error: Profiling and counters cover the default and streaming executors only\n");
+        exit(1);
+    }
+    if(Trace::enabled and server) {
+        fprintf(stderr, "Error: Traces are not supported by the server\n");
+        exit(1);
+    }
+    if((Numa::placement == Numa::REPLICATE) and options.streamWindow) {
+        fprintf(stderr, "Replicated layers are not supported with streamed layers\n");
+        exit(1);
+    }
+    options.inputPath = (server) ? "" : argv[optind];
+    options.dnnPath = argv[(server) ? optind : optind + 1];
+    
+    printf("INFO: Precision %s, SIMD %s\n", options.precision.c_str(), simd_name());
+    int status = 0;
+    if(options.precision == "float") {
+        status = (server) ? serve<float>(options) : run<float>(options);
+    }
+    else if(options.precision == "fixed") {
+        status = (server) ? serve<Fixed>(options) : run<Fixed>(options);
+    }
+    else {
+        status = (server) ? serve<double>(options) : run<double>(options);
+    }
+#ifdef USE_MPI
+    MPI_Finalize();
+#endif
+    return(status);
+}